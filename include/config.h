@@ -6,7 +6,23 @@
 
 struct config_screencast {
 	char *output_name;
+	char *region;
 	double max_fps;
+	double idle_min_fps;
+	double idle_backoff;
+	int capture_buffers;
+	bool zero_copy;
+	enum xdpw_buffer_alloc buffer_alloc;
+	int shm_pool_idle_ms;
+	enum xdpw_unchanged_frames unchanged_frames;
+	enum xdpw_capture_pacing capture_pacing;
+	int keepalive_ms;
+	int capture_batch_ms;
+	int copy_threads;
+	int copy_threshold;
+	bool yuv_formats;
+	enum xdpw_yuv_matrix yuv_matrix;
+	enum xdpw_yuv_range yuv_range;
 	char *exec_before;
 	char *exec_after;
 	char *chooser_cmd;
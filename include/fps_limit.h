@@ -4,15 +4,28 @@
 #include <stdint.h>
 #include <time.h>
 
+#include <stdbool.h>
+
 struct fps_limit_state {
 	struct timespec frame_last_time;
 	
 	struct timespec fps_last_time;
 	uint64_t fps_frame_count;
+
+	// lowered rate while frames arrive without damage, 0 at full rate
+	double idle_fps;
 };
 
 void fps_limit_measure_start(struct fps_limit_state *state, double max_fps);
 
 uint64_t fps_limit_measure_end(struct fps_limit_state *state, double max_fps);
 
+// divides the rate by ramp for every frame without damage, starting at
+// ceiling_fps and stopping at floor_fps, and goes back to full rate on damage
+void fps_limit_update_idle(struct fps_limit_state *state, bool damaged,
+	double ceiling_fps, double floor_fps, double ramp);
+
+// the rate to pass to fps_limit_measure_end
+double fps_limit_target(struct fps_limit_state *state, double max_fps);
+
 #endif
@@ -0,0 +1,26 @@
+#ifndef FRAME_CONVERT_H
+#define FRAME_CONVERT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <spa/param/video/raw.h>
+#include <wayland-client-protocol.h>
+
+#include "screencast_common.h"
+
+void xdpw_frame_convert_init(void);
+
+bool xdpw_convert_is_yuv(enum spa_video_format format);
+bool xdpw_convert_supported(enum wl_shm_format src_format);
+bool xdpw_convert_layout(enum spa_video_format format, uint32_t width, uint32_t height,
+	struct xdpw_yuv_layout *layout);
+
+// converts the damaged area of an RGB frame into the planes of a YUV buffer,
+// or the whole frame if damage is NULL
+void xdpw_convert_frame(struct xdpw_frame *frame, enum spa_video_format format,
+	enum spa_video_color_matrix matrix, enum spa_video_color_range range,
+	const struct xdpw_yuv_layout *layout, uint8_t *planes[XDPW_YUV_MAX_PLANES],
+	struct xdpw_region *damage);
+
+#endif
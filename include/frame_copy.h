@@ -0,0 +1,27 @@
+#ifndef FRAME_COPY_H
+#define FRAME_COPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// band is below xdpw_frame_copy_max_bands(), no two bands of a job run with
+// the same index at the same time
+typedef void (*xdpw_copy_band_func_t)(void *data, size_t band,
+	size_t first_row, size_t n_rows);
+
+void xdpw_frame_copy_init(int threads, size_t threshold);
+
+// the most bands a job is split into, fixed once xdpw_frame_copy_init ran
+size_t xdpw_frame_copy_max_bands(void);
+
+// splits rows into bands handled by the worker threads and the caller,
+// returns once all bands are done. Jobs smaller than the threshold run
+// on the calling thread.
+void xdpw_frame_copy_run_bands(xdpw_copy_band_func_t func, void *data,
+	size_t rows, size_t bytes);
+
+// copies rows of length bytes, a negative src_stride flips the image vertically
+void xdpw_copy_rows(uint8_t *dst, ptrdiff_t dst_stride,
+	const uint8_t *src, ptrdiff_t src_stride, size_t length, size_t rows);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef FRAME_SCALE_H
+#define FRAME_SCALE_H
+
+#include <stdint.h>
+
+#include "screencast_common.h"
+
+struct xdpw_scaler;
+
+// downscales 4 byte per pixel frames, enlarging isn't supported. Scalers are
+// created after xdpw_frame_copy_init, they keep a row buffer per copy band
+struct xdpw_scaler *xdpw_scaler_create(uint32_t src_width, uint32_t src_height,
+	uint32_t dst_width, uint32_t dst_height);
+void xdpw_scaler_destroy(struct xdpw_scaler *scaler);
+
+// maps a rectangle of the source frame to the destination pixels depending on it
+void xdpw_scaler_map_rect(const struct xdpw_scaler *scaler, struct xdpw_frame_damage *rect);
+
+// scales the given destination region, or the whole frame if damage is NULL
+int xdpw_scaler_scale(const struct xdpw_scaler *scaler, struct xdpw_frame *frame,
+	uint8_t *dst, uint32_t dst_stride, struct xdpw_region *damage);
+
+#endif
@@ -5,9 +5,19 @@
 
 #define XDPW_PWR_BUFFERS 1
 #define XDPW_PWR_ALIGN 16
+#define XDPW_PWR_DAMAGE_RECTS XDPW_REGION_MAX_RECTS
 
 void xdpw_pwr_stream_init(struct xdpw_screencast_instance *cast);
+// starts connecting on the pipewire thread
 int xdpw_pwr_core_connect(struct xdpw_state *state);
+// called with the lock held once, not recursively
 void xdpw_pwr_stream_destroy(struct xdpw_screencast_instance *cast);
+struct pw_buffer *xdpw_pwr_dequeue_shared_buffer(struct xdpw_screencast_instance *cast,
+	struct xdpw_frame *frame);
+bool xdpw_pwr_buffer_shareable(struct xdpw_screencast_instance *cast,
+	struct pw_buffer *pw_buf, struct xdpw_frame *frame);
+struct pw_buffer *xdpw_pwr_reserve_buffer(struct xdpw_screencast_instance *cast);
+void xdpw_pwr_return_buffer(struct xdpw_screencast_instance *cast,
+	struct pw_buffer *pw_buf);
 
 #endif
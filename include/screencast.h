@@ -3,6 +3,19 @@
 
 #include "screencast_common.h"
 
+struct xdpw_session;
+
+struct xdpw_state;
+
 void xdpw_screencast_instance_destroy(struct xdpw_screencast_instance *cast);
+// answers requests of a closing session that still wait for the output
+// chooser or pipewire
+void xdpw_screencast_cancel_requests(struct xdpw_session *sess);
+// starts the streams of pending Start calls whose captures know their buffer
+// parameters by now, and replies once the streams have their node ids
+void xdpw_screencast_check_starts(struct xdpw_state *state);
+// runs the output choosers of SelectSources calls that came in before the
+// wayland setup was done
+void xdpw_screencast_setup_done(struct xdpw_state *state);
 
 #endif
@@ -6,11 +6,33 @@
 #include <wayland-client-protocol.h>
 
 #include "fps_limit.h"
+#include "spsc_ring.h"
 
 // this seems to be right based on
 // https://github.com/flatpak/xdg-desktop-portal/blob/309a1fc0cf2fb32cceb91dbc666d20cf0a3202c2/src/screen-cast.c#L955
 #define XDP_CAST_PROTO_VER 2
 
+#define XDPW_CAPTURE_BUFFERS_DEFAULT 2
+#define XDPW_CAPTURE_BUFFERS_MAX 8
+
+#define XDPW_REGION_MAX_RECTS 16
+
+#define XDPW_KEEPALIVE_MS_DEFAULT 1000
+
+#define XDPW_IDLE_BACKOFF_DEFAULT 1.5
+
+#define XDPW_CAPTURE_BATCH_MS_DEFAULT 4
+
+// outputs a session with the multiple option can capture
+#define XDPW_SESSION_MAX_SOURCES 8
+
+#define XDPW_COPY_THREADS_MAX 16
+#define XDPW_COPY_THRESHOLD_KB_DEFAULT 8192
+
+#define XDPW_YUV_MAX_PLANES 3
+
+#define XDPW_SHM_POOL_IDLE_MS_DEFAULT 10000
+
 enum cursor_modes {
   HIDDEN = 1,
   EMBEDDED = 2,
@@ -29,11 +51,47 @@ enum xdpw_chooser_types {
   XDPW_CHOOSER_DMENU,
 };
 
+enum xdpw_unchanged_frames {
+  XDPW_UNCHANGED_FRAMES_SEND,
+  XDPW_UNCHANGED_FRAMES_SKIP,
+};
+
+enum xdpw_capture_pacing {
+  XDPW_CAPTURE_PACING_FREE,
+  XDPW_CAPTURE_PACING_CONSUMER,
+};
+
+// part of an output in its logical coordinates, empty for the whole output
+struct xdpw_output_region {
+	int32_t x;
+	int32_t y;
+	int32_t width;
+	int32_t height;
+};
+
 struct xdpw_output_chooser {
 	enum xdpw_chooser_types type;
 	char *cmd;
 };
 
+enum xdpw_buffer_alloc {
+	XDPW_BUFFER_ALLOC_DEFAULT,
+	// fault in all pages when the buffer is created
+	XDPW_BUFFER_ALLOC_PREFAULT,
+	// prefault and prefer huge pages
+	XDPW_BUFFER_ALLOC_HUGEPAGE,
+};
+
+enum xdpw_yuv_matrix {
+	XDPW_YUV_MATRIX_BT709,
+	XDPW_YUV_MATRIX_BT601,
+};
+
+enum xdpw_yuv_range {
+	XDPW_YUV_RANGE_LIMITED,
+	XDPW_YUV_RANGE_FULL,
+};
+
 struct xdpw_frame_damage {
 	uint32_t x;
 	uint32_t y;
@@ -41,20 +99,129 @@ struct xdpw_frame_damage {
 	uint32_t height;
 };
 
+// a bounded list of rectangles, merged when they are close or the list is full
+struct xdpw_region {
+	uint32_t n_rects;
+	struct xdpw_frame_damage rects[XDPW_REGION_MAX_RECTS];
+};
+
 struct xdpw_frame {
 	uint32_t width;
 	uint32_t height;
 	uint32_t size;
+	// length of the mapping at data, may be rounded up to huge pages
+	uint32_t map_size;
 	uint32_t stride;
 	bool y_invert;
 	uint64_t tv_sec;
 	uint32_t tv_nsec;
 	enum wl_shm_format format;
-	struct xdpw_frame_damage damage;
+	struct xdpw_region damage;
 	struct wl_buffer *buffer;
 	void *data;
 };
 
+struct xdpw_scaler;
+struct xdpw_shm_buffer;
+
+// plane layout of a converted YUV buffer
+struct xdpw_yuv_layout {
+	uint32_t n_planes;
+	uint32_t width;
+	uint32_t height;
+	uint32_t strides[XDPW_YUV_MAX_PLANES];
+	uint32_t sizes[XDPW_YUV_MAX_PLANES];
+};
+
+// bookkeeping attached to every pipewire buffer of a stream
+struct xdpw_pwr_buffer {
+	struct wl_list link;
+	struct pw_buffer *pw_buffer;
+	// layout of the contents, for shared buffers also the allocation
+	struct xdpw_frame frame;
+	// damage accumulated since the contents were last brought up to date
+	struct xdpw_region damage;
+	// contents are undefined and need a full copy
+	bool stale;
+	// memory the compositor copies into directly
+	bool shared;
+	int fd;
+	// dequeued but given back unused, handed out again before pipewire's
+	struct wl_list spare_link;
+	bool spare;
+};
+
+enum xdpw_capture_state {
+	XDPW_CAPTURE_IDLE,
+	XDPW_CAPTURE_PENDING,
+	XDPW_CAPTURE_READY,
+	// the pipewire thread copies it out without holding the lock
+	XDPW_CAPTURE_COPYING,
+};
+
+// one slot of the per-instance capture ring
+struct xdpw_capture {
+	struct xdpw_screencast_instance *cast;
+	enum xdpw_capture_state state;
+	uint64_t seq;
+	struct zwlr_screencopy_frame_v1 *wlr_frame;
+	struct xdpw_frame frame;
+	// set while frame.buffer is borrowed from a shared pipewire buffer
+	struct pw_buffer *pw_buffer;
+	// set while frame.buffer comes from the context's shm pool
+	struct xdpw_shm_buffer *shm;
+	// pipewire buffer the frame will be copied into, taken before the
+	// capture is requested when the consumer paces the capture
+	struct pw_buffer *reserved;
+	// batch of captures of several outputs this one was started with, or 0
+	uint64_t batch_seq;
+};
+
+struct xdpw_capture_stats {
+	uint64_t frames;
+	// frames delivered while the next capture was already in flight
+	uint64_t overlapped;
+	// captures postponed because every ring slot was busy
+	uint64_t ring_full;
+	// frames without damage that were not sent to pipewire
+	uint64_t skipped;
+	// captures postponed because the consumer held every pipewire buffer
+	uint64_t starved;
+	// frames not sent to streams that want a lower rate than the capture
+	uint64_t decimated;
+	// time spent copying, scaling and converting frames into pipewire buffers
+	uint64_t copies;
+	uint64_t copy_ns;
+	uint64_t copy_ns_max;
+	// intervals between queued frames since the last report
+	uint64_t intervals;
+	double interval_sum_ms;
+	double interval_sq_sum_ms;
+	double interval_max_ms;
+	// set when the buffer parameters changed until the next frame is queued
+	struct timespec buffer_change;
+	struct timespec last_report;
+};
+
+// presentation timestamps of captures started together on several outputs
+struct xdpw_capture_batch_stats {
+	// batch the frames below belong to
+	uint64_t seq;
+	uint32_t frames;
+	uint64_t first_ns;
+	uint64_t last_ns;
+	uint64_t batches;
+	uint64_t skew_ns;
+	uint64_t skew_ns_max;
+	struct timespec last_report;
+};
+
+enum xdpw_wlr_init_stage {
+	XDPW_WLR_INIT_REGISTRY,
+	XDPW_WLR_INIT_OUTPUTS,
+	XDPW_WLR_INIT_DONE,
+};
+
 struct xdpw_screencast_context {
 
 	// xdpw
@@ -63,6 +230,13 @@ struct xdpw_screencast_context {
 	// pipewire
 	struct pw_context *pwr_context;
 	struct pw_core *core;
+	// the core is connected on the pipewire thread, set under the lock
+	bool pwr_core_done;
+	int pwr_core_err;
+	// wakes the pipewire thread for frames in the instances' frames_ready
+	struct spa_source *frames_event;
+	// wakes the main thread for frames in the instances' frames_done
+	int frames_done_fd;
 
 	// wlroots
 	struct wl_list output_list;
@@ -70,9 +244,24 @@ struct xdpw_screencast_context {
 	struct zwlr_screencopy_manager_v1 *screencopy_manager;
 	struct zxdg_output_manager_v1 *xdg_output_manager;
 	struct wl_shm *shm;
+	// roundtrip of the setup stage in progress
+	struct wl_callback *init_sync;
+	enum xdpw_wlr_init_stage init_stage;
+	int init_err;
+	// capture buffers, kept around for a while after instances go away
+	struct xdpw_shm_pool *shm_pool;
 
 	// sessions
 	struct wl_list screencast_instances;
+
+	// instances waiting for their next capture, all due ones are started
+	// together by one timer
+	struct wl_list capture_batch; // xdpw_screencast_instance::capture_batch_link
+	struct xdpw_timer *capture_batch_timer;
+	uint64_t capture_batches;
+	// set while a batch is being started
+	uint64_t capture_batch_seq;
+	struct xdpw_capture_batch_stats capture_batch_stats;
 };
 
 struct xdpw_screencast_instance {
@@ -83,27 +272,66 @@ struct xdpw_screencast_instance {
 	uint32_t refcount;
 	struct xdpw_screencast_context *ctx;
 	bool initialized;
+	// instances of the same output, cursor mode and region share the capture
+	// loop of one of them, which feeds every frame to the others' streams
+	struct xdpw_screencast_instance *capture_source;
+	struct wl_list capture_sinks; // xdpw_screencast_instance::capture_sink_link
+	struct wl_list capture_sink_link;
 
 	// pipewire
-	struct spa_source *event;
 	struct pw_stream *stream;
 	struct spa_hook stream_listener;
 	struct spa_video_info_raw pwr_format;
+	// valid while a YUV format is negotiated
+	struct xdpw_yuv_layout yuv_layout;
+	// set while the consumer negotiated a smaller size, scaled_frame holds
+	// the layout sent and for YUV formats the scaled RGB frame
+	struct xdpw_scaler *scaler;
+	struct xdpw_frame scaled_frame;
 	uint32_t seq;
+	// frames the pipewire thread copies into this stream without the
+	// lock, a sink closed meanwhile is destroyed once they are done
+	uint32_t copies;
 	uint32_t node_id;
 	bool pwr_stream_state;
+	bool zero_copy;
+	struct wl_list pwr_buffers;
+	struct wl_list pwr_spare_buffers;
+	struct timespec last_queued;
+	// frames arriving earlier are dropped when the capture runs faster than
+	// this stream, their damage is sent with the next frame
+	struct timespec next_frame_due;
+	struct xdpw_region pending_damage;
 
 	// wlroots
-	struct zwlr_screencopy_frame_v1 *frame_callback;
 	struct xdpw_wlr_output *target_output;
 	uint32_t framerate;
-	struct zwlr_screencopy_frame_v1 *wlr_frame;
+	// buffer parameters announced by the compositor for the latest capture,
+	// the shm buffers themselves live in the capture ring
 	struct xdpw_frame simple_frame;
+	struct xdpw_capture captures[XDPW_CAPTURE_BUFFERS_MAX];
+	uint32_t n_captures;
+	uint64_t capture_seq;
+	uint64_t deliver_seq;
+	// set while waiting in the context's capture batch for capture_due
+	struct wl_list capture_batch_link;
+	struct timespec capture_due;
+	// the batch retries a capture that found no free pipewire buffer
+	bool capture_starved;
+	// set by the pipewire thread when the consumer returned a buffer
+	bool buffer_freed;
+	// ready captures to the pipewire thread and delivered ones back
+	struct xdpw_spsc_ring frames_ready;
+	struct xdpw_spsc_ring frames_done;
+	struct xdpw_capture_stats capture_stats;
 	bool with_cursor;
+	struct xdpw_output_region region;
 	int err;
 	bool quit;
 
 	// fps limit
+	// max_fps from the config, lowered to what the consumer negotiated
+	double max_fps;
 	struct fps_limit_state fps_limit;
 };
 
@@ -115,16 +343,48 @@ struct xdpw_wlr_output {
 	char *make;
 	char *model;
 	char *name;
+	// logical position and size in the compositor's layout
+	int x;
+	int y;
 	int width;
 	int height;
 	float framerate;
 };
 
 void randname(char *buf);
+int anonymous_shm_open(void);
+int xdpw_shm_alloc(enum xdpw_buffer_alloc mode, uint32_t size,
+	void **data, uint32_t *map_size);
+bool xdpw_output_region_parse(const char *str, struct xdpw_output_region *region);
+bool xdpw_output_region_is_empty(const struct xdpw_output_region *region);
+bool xdpw_output_region_equal(const struct xdpw_output_region *a,
+	const struct xdpw_output_region *b);
 enum spa_video_format xdpw_format_pw_from_wl_shm(
 	struct xdpw_screencast_instance *cast);
 enum spa_video_format xdpw_format_pw_strip_alpha(enum spa_video_format format);
+uint32_t xdpw_bpp_from_wl_shm(enum wl_shm_format format);
+
+bool xdpw_frame_damage_is_empty(const struct xdpw_frame_damage *damage);
+void xdpw_frame_damage_union(struct xdpw_frame_damage *dst,
+	const struct xdpw_frame_damage *src);
+
+void xdpw_region_clear(struct xdpw_region *region);
+bool xdpw_region_is_empty(const struct xdpw_region *region);
+void xdpw_region_add_rect(struct xdpw_region *region,
+	const struct xdpw_frame_damage *rect);
+void xdpw_region_union(struct xdpw_region *dst, const struct xdpw_region *src);
+struct xdpw_frame_damage xdpw_region_extents(const struct xdpw_region *region);
 
 enum xdpw_chooser_types get_chooser_type(const char *chooser_type);
 const char *chooser_type_str(enum xdpw_chooser_types chooser_type);
+enum xdpw_unchanged_frames get_unchanged_frames(const char *unchanged_frames);
+const char *unchanged_frames_str(enum xdpw_unchanged_frames unchanged_frames);
+enum xdpw_capture_pacing get_capture_pacing(const char *capture_pacing);
+const char *capture_pacing_str(enum xdpw_capture_pacing capture_pacing);
+enum xdpw_buffer_alloc get_buffer_alloc(const char *buffer_alloc);
+const char *buffer_alloc_str(enum xdpw_buffer_alloc buffer_alloc);
+enum xdpw_yuv_matrix get_yuv_matrix(const char *yuv_matrix);
+const char *yuv_matrix_str(enum xdpw_yuv_matrix yuv_matrix);
+enum xdpw_yuv_range get_yuv_range(const char *yuv_range);
+const char *yuv_range_str(enum xdpw_yuv_range yuv_range);
 #endif /* SCREENCAST_COMMON_H */
@@ -0,0 +1,38 @@
+#ifndef SHM_POOL_H
+#define SHM_POOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-client-protocol.h>
+
+struct xdpw_state;
+struct xdpw_shm_block;
+
+// a wl_buffer sub-allocated from a pooled shm block
+struct xdpw_shm_buffer {
+	struct xdpw_shm_block *block;
+	uint32_t offset;
+	void *data;
+	// kept while the slot is free, reused if the next user wants the same
+	// parameters
+	struct wl_buffer *buffer;
+	enum wl_shm_format format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	bool used;
+};
+
+struct xdpw_shm_pool *xdpw_shm_pool_create(struct xdpw_state *state,
+	struct wl_shm *shm);
+void xdpw_shm_pool_destroy(struct xdpw_shm_pool *pool);
+
+// count is how many buffers of this size the caller is likely to need, a
+// new block gets that many slots
+struct xdpw_shm_buffer *xdpw_shm_pool_get(struct xdpw_shm_pool *pool,
+	enum wl_shm_format format, uint32_t width, uint32_t height, uint32_t stride,
+	uint32_t count);
+// the compositor must be done with the buffer
+void xdpw_shm_pool_put(struct xdpw_shm_pool *pool, struct xdpw_shm_buffer *buffer);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// must be a power of two
+#define XDPW_SPSC_RING_SIZE 16
+#define XDPW_SPSC_RING_CACHE_LINE 64
+
+// lock-free queue of pointers between exactly one producer and one consumer
+// thread. Rings are embedded in calloc'd instances, which don't honor an
+// alignment above max_align_t, so head and tail are kept a cache line apart
+// by padding instead
+struct xdpw_spsc_ring {
+	// written by the consumer only
+	atomic_uint_fast32_t head;
+	char head_pad[XDPW_SPSC_RING_CACHE_LINE - sizeof(atomic_uint_fast32_t)];
+	// written by the producer only
+	atomic_uint_fast32_t tail;
+	void *slots[XDPW_SPSC_RING_SIZE];
+};
+
+void xdpw_spsc_ring_init(struct xdpw_spsc_ring *ring);
+// returns false if the ring is full
+bool xdpw_spsc_ring_push(struct xdpw_spsc_ring *ring, void *item);
+// returns NULL if the ring is empty
+void *xdpw_spsc_ring_pop(struct xdpw_spsc_ring *ring);
+
+#endif
@@ -14,7 +14,10 @@
 
 struct xdpw_state;
 
+// starts the setup, the event loop finishes it
 int xdpw_wlr_screencopy_init(struct xdpw_state *state);
+// finishes the setup right away if the event loop didn't yet, called with
+// the lock held
 void xdpw_wlr_screencopy_finish(struct xdpw_screencast_context *ctx);
 
 struct xdpw_wlr_output *xdpw_wlr_output_find_by_name(struct wl_list *output_list,
@@ -22,9 +25,31 @@ struct xdpw_wlr_output *xdpw_wlr_output_find_by_name(struct wl_list *output_list
 struct xdpw_wlr_output *xdpw_wlr_output_first(struct wl_list *output_list);
 struct xdpw_wlr_output *xdpw_wlr_output_find(struct xdpw_screencast_context *ctx,
 	struct wl_output *out, uint32_t id);
-struct xdpw_wlr_output *xdpw_wlr_output_chooser(struct xdpw_screencast_context *ctx);
-
-void xdpw_wlr_frame_free(struct xdpw_screencast_instance *cast);
+struct xdpw_output_chooser_run;
+
+// n_outputs is 0 if the user canceled
+typedef void (*xdpw_output_chooser_done_func_t)(struct xdpw_wlr_output **outputs,
+	struct xdpw_output_region *regions, size_t n_outputs, void *data);
+
+// runs the configured chooser without blocking, func is called from the
+// event loop with up to max outputs and the run is freed afterwards
+struct xdpw_output_chooser_run *xdpw_wlr_output_chooser_start(
+	struct xdpw_screencast_context *ctx, size_t max,
+	xdpw_output_chooser_done_func_t func, void *data);
+// func isn't called for a canceled run
+void xdpw_wlr_output_chooser_cancel(struct xdpw_output_chooser_run *run);
+
+void xdpw_wlr_capture_init(struct xdpw_screencast_instance *cast,
+	uint32_t n_captures);
+struct wl_buffer *xdpw_wlr_import_shm_buffer(struct xdpw_screencast_instance *cast,
+	int fd, struct xdpw_frame *frame);
+void xdpw_wlr_capture_detach_buffer(struct xdpw_screencast_instance *cast,
+	struct pw_buffer *pw_buf, bool *adopted);
+void xdpw_wlr_frame_free(struct xdpw_capture *capture);
 void xdpw_wlr_register_cb(struct xdpw_screencast_instance *cast);
+void xdpw_wlr_capture_buffer_available(struct xdpw_screencast_instance *cast);
+// takes back the frames the pipewire thread is done with
+void xdpw_wlr_frames_done(struct xdpw_screencast_context *ctx);
+double xdpw_wlr_capture_max_fps(struct xdpw_screencast_instance *cast);
 
 #endif
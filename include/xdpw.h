@@ -13,10 +13,35 @@
 #include "screencast_common.h"
 #include "config.h"
 
+struct pw_thread_loop;
+struct xdpw_select_sources;
+struct xdpw_start;
+
+struct xdpw_event_loop_stats {
+	uint64_t iterations;
+	uint64_t events;
+	uint32_t events_max;
+	// sources run again for work left over from their budget
+	uint64_t reruns;
+	uint64_t wayland_reads;
+	uint64_t timers;
+	uint64_t dbus_processed;
+	uint64_t dbus_budget_hits;
+	// longest time other sources kept the loop from looking at frames
+	uint64_t frame_wait_max_ns;
+	// longest time from the compositor's frame timestamp to the handoff to
+	// the pipewire thread
+	uint64_t frame_latency_max_ns;
+	struct timespec last_report;
+};
+
 struct xdpw_state {
 	struct wl_list xdpw_sessions;
 	sd_bus *bus;
 	struct wl_display *wl_display;
+	// pipewire runs on its own thread, the main thread holds the thread
+	// loop's lock while it touches screencast state
+	struct pw_thread_loop *pw_thread_loop;
 	struct pw_loop *pw_loop;
 	struct xdpw_screencast_context screencast;
 	uint32_t screencast_source_types; // bitfield of enum source_types
@@ -24,8 +49,29 @@ struct xdpw_state {
 	uint32_t screencast_version;
 	struct xdpw_config *config;
 	int timer_poll_fd;
-	struct wl_list timers;
-	struct xdpw_timer *next_timer;
+	// min-heap on xdpw_timer::at
+	struct xdpw_timer **timer_heap;
+	size_t n_timers;
+	size_t timer_heap_size;
+	struct wl_list timers_free; // xdpw_timer::link
+	// deadline timer_poll_fd is programmed for, zero if disarmed
+	struct timespec timer_armed_at;
+	bool timers_running;
+
+	// event loop
+	int epoll_fd;
+	struct wl_list fd_watches; // xdpw_fd_watch::link
+	struct wl_list fd_watches_removed;
+	struct wl_list fd_watches_pending; // xdpw_fd_watch::pending_link
+	struct xdpw_event_loop_stats loop_stats;
+	// frame_latency_max_ns since startup
+	uint64_t frame_latency_worst_ns;
+
+	// --startup-time
+	bool startup_time;
+	struct timespec startup;
+	bool startup_first_frame;
+	int loop_err;
 };
 
 struct xdpw_request {
@@ -33,10 +79,16 @@ struct xdpw_request {
 };
 
 struct xdpw_session {
+	struct xdpw_state *state;
 	struct wl_list link;
 	sd_bus_slot *slot;
 	char *session_handle;
-	struct xdpw_screencast_instance *screencast_instance;
+	struct xdpw_screencast_instance *screencast_instances[XDPW_SESSION_MAX_SOURCES];
+	uint32_t n_screencast_instances;
+	// set while the output chooser of SelectSources is open
+	struct xdpw_select_sources *select_sources;
+	// set while Start waits for pipewire to assign the node ids
+	struct xdpw_start *start;
 };
 
 typedef void (*xdpw_event_loop_timer_func_t)(void *data);
@@ -46,7 +98,32 @@ struct xdpw_timer {
 	xdpw_event_loop_timer_func_t func;
 	void *user_data;
 	struct timespec at;
-	struct wl_list link; // xdpw_state::timers
+	size_t heap_index;
+	struct wl_list link; // xdpw_state::timers_free while pooled
+};
+
+// returns true if it stopped for its budget with work left, it runs again in
+// the next iteration without waiting for the fd, with events 0
+typedef bool (*xdpw_event_loop_fd_func_t)(int fd, uint32_t events, void *data);
+
+// order fd watches run in within an iteration, after wayland
+enum xdpw_fd_watch_priority {
+	XDPW_FD_WATCH_PRIORITY_FRAMES,
+	XDPW_FD_WATCH_PRIORITY_TIMERS,
+	XDPW_FD_WATCH_PRIORITY_DEFAULT,
+	XDPW_FD_WATCH_PRIORITIES,
+};
+
+struct xdpw_fd_watch {
+	struct xdpw_state *state;
+	int fd;
+	uint32_t events;
+	enum xdpw_fd_watch_priority priority;
+	xdpw_event_loop_fd_func_t func;
+	void *user_data;
+	bool removed;
+	struct wl_list link; // xdpw_state::fd_watches
+	struct wl_list pending_link; // xdpw_state::fd_watches_pending
 };
 
 enum {
@@ -68,5 +145,23 @@ struct xdpw_timer *xdpw_add_timer(struct xdpw_state *state,
 	uint64_t delay_ns, xdpw_event_loop_timer_func_t func, void *data);
 
 void xdpw_destroy_timer(struct xdpw_timer *timer);
+// runs all timers that are due, called by the event loop
+void xdpw_run_timers(struct xdpw_state *state);
+
+// events are epoll events, the watch is level-triggered
+struct xdpw_fd_watch *xdpw_add_fd_watch(struct xdpw_state *state, int fd,
+	uint32_t events, xdpw_event_loop_fd_func_t func, void *data);
+// safe to call from any fd watch, timer or D-Bus callback
+void xdpw_destroy_fd_watch(struct xdpw_fd_watch *watch);
+
+int xdpw_event_loop_init(struct xdpw_state *state);
+// frame is the compositor's timestamp of a frame handed to pipewire
+void xdpw_event_loop_frame_latency(struct xdpw_state *state,
+	struct timespec *frame);
+// returns once an event source failed
+int xdpw_event_loop_run(struct xdpw_state *state);
+
+// with --startup-time, prints how long after startup milestone was reached
+void xdpw_startup_report(struct xdpw_state *state, const char *milestone);
 
 #endif
@@ -12,8 +12,24 @@
 
 void print_config(enum LOGLEVEL loglevel, struct xdpw_config *config) {
 	logprint(loglevel, "config: outputname  %s", config->screencast_conf.output_name);
+	logprint(loglevel, "config: region: %s\n", config->screencast_conf.region);
 	logprint(loglevel, "config: chooser_cmd: %s\n", config->screencast_conf.chooser_cmd);
 	logprint(loglevel, "config: chooser_type: %s\n", chooser_type_str(config->screencast_conf.chooser_type));
+	logprint(loglevel, "config: idle_min_fps: %f\n", config->screencast_conf.idle_min_fps);
+	logprint(loglevel, "config: idle_backoff: %f\n", config->screencast_conf.idle_backoff);
+	logprint(loglevel, "config: capture_buffers: %d\n", config->screencast_conf.capture_buffers);
+	logprint(loglevel, "config: zero_copy: %d\n", config->screencast_conf.zero_copy);
+	logprint(loglevel, "config: buffer_alloc: %s\n", buffer_alloc_str(config->screencast_conf.buffer_alloc));
+	logprint(loglevel, "config: shm_pool_idle_ms: %d\n", config->screencast_conf.shm_pool_idle_ms);
+	logprint(loglevel, "config: unchanged_frames: %s\n", unchanged_frames_str(config->screencast_conf.unchanged_frames));
+	logprint(loglevel, "config: keepalive_ms: %d\n", config->screencast_conf.keepalive_ms);
+	logprint(loglevel, "config: capture_pacing: %s\n", capture_pacing_str(config->screencast_conf.capture_pacing));
+	logprint(loglevel, "config: capture_batch_ms: %d\n", config->screencast_conf.capture_batch_ms);
+	logprint(loglevel, "config: copy_threads: %d\n", config->screencast_conf.copy_threads);
+	logprint(loglevel, "config: copy_threshold: %d\n", config->screencast_conf.copy_threshold);
+	logprint(loglevel, "config: yuv_formats: %d\n", config->screencast_conf.yuv_formats);
+	logprint(loglevel, "config: yuv_matrix: %s\n", yuv_matrix_str(config->screencast_conf.yuv_matrix));
+	logprint(loglevel, "config: yuv_range: %s\n", yuv_range_str(config->screencast_conf.yuv_range));
 }
 
 // NOTE: calling finish_config won't prepare the config to be read again from config file
@@ -23,6 +39,7 @@ void finish_config(struct xdpw_config *config) {
 
 	// screencast
 	free(config->screencast_conf.output_name);
+	free(config->screencast_conf.region);
 	free(config->screencast_conf.exec_before);
 	free(config->screencast_conf.exec_after);
 	free(config->screencast_conf.chooser_cmd);
@@ -53,6 +70,22 @@ static void getdouble_from_conffile(dictionary *d,
 	*dest = iniparser_getdouble(d, key, fallback);
 }
 
+static void getint_from_conffile(dictionary *d,
+		const char *key, int *dest, int fallback) {
+	if (*dest != 0) {
+		return;
+	}
+	*dest = iniparser_getint(d, key, fallback);
+}
+
+static void getbool_from_conffile(dictionary *d,
+		const char *key, bool *dest, bool fallback) {
+	if (*dest) {
+		return;
+	}
+	*dest = iniparser_getboolean(d, key, fallback);
+}
+
 static bool file_exists(const char *path) {
 	return path && access(path, R_OK) != -1;
 }
@@ -71,10 +104,51 @@ static void config_parse_file(const char *configfile, struct xdpw_config *config
 
 	// screencast
 	getstring_from_conffile(d, "screencast:output_name", &config->screencast_conf.output_name, NULL);
+	getstring_from_conffile(d, "screencast:region", &config->screencast_conf.region, NULL);
 	getdouble_from_conffile(d, "screencast:max_fps", &config->screencast_conf.max_fps, 0);
+	getdouble_from_conffile(d, "screencast:idle_min_fps", &config->screencast_conf.idle_min_fps, 0);
+	getdouble_from_conffile(d, "screencast:idle_backoff", &config->screencast_conf.idle_backoff, XDPW_IDLE_BACKOFF_DEFAULT);
+	getint_from_conffile(d, "screencast:capture_buffers", &config->screencast_conf.capture_buffers, XDPW_CAPTURE_BUFFERS_DEFAULT);
+	getbool_from_conffile(d, "screencast:zero_copy", &config->screencast_conf.zero_copy, false);
+	if (!config->screencast_conf.buffer_alloc) {
+		char *buffer_alloc = NULL;
+		getstring_from_conffile(d, "screencast:buffer_alloc", &buffer_alloc, "default");
+		config->screencast_conf.buffer_alloc = get_buffer_alloc(buffer_alloc);
+		free(buffer_alloc);
+	}
+	getint_from_conffile(d, "screencast:shm_pool_idle_ms", &config->screencast_conf.shm_pool_idle_ms, XDPW_SHM_POOL_IDLE_MS_DEFAULT);
 	getstring_from_conffile(d, "screencast:exec_before", &config->screencast_conf.exec_before, NULL);
 	getstring_from_conffile(d, "screencast:exec_after", &config->screencast_conf.exec_after, NULL);
 	getstring_from_conffile(d, "screencast:chooser_cmd", &config->screencast_conf.chooser_cmd, NULL);
+	if (!config->screencast_conf.unchanged_frames) {
+		char *unchanged_frames = NULL;
+		getstring_from_conffile(d, "screencast:unchanged_frames", &unchanged_frames, "send");
+		config->screencast_conf.unchanged_frames = get_unchanged_frames(unchanged_frames);
+		free(unchanged_frames);
+	}
+	getint_from_conffile(d, "screencast:keepalive_ms", &config->screencast_conf.keepalive_ms, XDPW_KEEPALIVE_MS_DEFAULT);
+	getint_from_conffile(d, "screencast:capture_batch_ms", &config->screencast_conf.capture_batch_ms, XDPW_CAPTURE_BATCH_MS_DEFAULT);
+	if (!config->screencast_conf.capture_pacing) {
+		char *capture_pacing = NULL;
+		getstring_from_conffile(d, "screencast:capture_pacing", &capture_pacing, "free");
+		config->screencast_conf.capture_pacing = get_capture_pacing(capture_pacing);
+		free(capture_pacing);
+	}
+	getint_from_conffile(d, "screencast:copy_threads", &config->screencast_conf.copy_threads, 1);
+	getint_from_conffile(d, "screencast:copy_threshold", &config->screencast_conf.copy_threshold, XDPW_COPY_THRESHOLD_KB_DEFAULT);
+	getbool_from_conffile(d, "screencast:yuv_formats", &config->screencast_conf.yuv_formats, false);
+	if (!config->screencast_conf.yuv_matrix) {
+		char *yuv_matrix = NULL;
+		getstring_from_conffile(d, "screencast:yuv_matrix", &yuv_matrix, "bt709");
+		config->screencast_conf.yuv_matrix = get_yuv_matrix(yuv_matrix);
+		free(yuv_matrix);
+	}
+	if (!config->screencast_conf.yuv_range) {
+		char *yuv_range = NULL;
+		getstring_from_conffile(d, "screencast:yuv_range", &yuv_range, "limited");
+		config->screencast_conf.yuv_range = get_yuv_range(yuv_range);
+		free(yuv_range);
+	}
 	if (!config->screencast_conf.chooser_type) {
 		char *chooser_type = NULL;
 		getstring_from_conffile(d, "screencast:chooser_type", &chooser_type, "default");
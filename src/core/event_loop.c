@@ -0,0 +1,362 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <pipewire/pipewire.h>
+#include <wayland-util.h>
+
+#include "xdpw.h"
+#include "logger.h"
+#include "screencast.h"
+#include "wlr_screencast.h"
+#include "timespec_util.h"
+
+#define XDPW_EVENT_LOOP_MAX_EVENTS 32
+// sd_bus_process calls per iteration, each handles at most one message
+#define XDPW_EVENT_LOOP_DBUS_BUDGET 16
+// time D-Bus may hold up frames for, checked after each message
+#define XDPW_EVENT_LOOP_DBUS_SLICE_NS 2000000
+#define XDPW_EVENT_LOOP_STATS_INTERVAL_SEC 10
+
+static struct xdpw_fd_watch *event_loop_add_watch(struct xdpw_state *state,
+		int fd, uint32_t events, enum xdpw_fd_watch_priority priority,
+		xdpw_event_loop_fd_func_t func, void *data) {
+	struct xdpw_fd_watch *watch = calloc(1, sizeof(struct xdpw_fd_watch));
+	if (watch == NULL) {
+		logprint(ERROR, "fd watch allocation failed");
+		return NULL;
+	}
+	watch->state = state;
+	watch->fd = fd;
+	watch->events = events;
+	watch->priority = priority;
+	watch->func = func;
+	watch->user_data = data;
+	wl_list_init(&watch->pending_link);
+
+	struct epoll_event event = { .events = events, .data.ptr = watch };
+	if (epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		logprint(ERROR, "event-loop: failed to watch fd %d: %s", fd, strerror(errno));
+		free(watch);
+		return NULL;
+	}
+	wl_list_insert(state->fd_watches.prev, &watch->link);
+	return watch;
+}
+
+struct xdpw_fd_watch *xdpw_add_fd_watch(struct xdpw_state *state, int fd,
+		uint32_t events, xdpw_event_loop_fd_func_t func, void *data) {
+	return event_loop_add_watch(state, fd, events,
+		XDPW_FD_WATCH_PRIORITY_DEFAULT, func, data);
+}
+
+void xdpw_destroy_fd_watch(struct xdpw_fd_watch *watch) {
+	if (watch == NULL) {
+		return;
+	}
+	epoll_ctl(watch->state->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+	wl_list_remove(&watch->pending_link);
+	wl_list_init(&watch->pending_link);
+	// the event loop may still hold it for this iteration, it is freed
+	// once the iteration is done
+	wl_list_remove(&watch->link);
+	wl_list_insert(&watch->state->fd_watches_removed, &watch->link);
+	watch->removed = true;
+}
+
+static void free_removed_fd_watches(struct xdpw_state *state) {
+	struct xdpw_fd_watch *watch, *tmp;
+	wl_list_for_each_safe(watch, tmp, &state->fd_watches_removed, link) {
+		wl_list_remove(&watch->link);
+		free(watch);
+	}
+}
+
+static void fd_watch_run(struct xdpw_fd_watch *watch, uint32_t events) {
+	struct xdpw_state *state = watch->state;
+
+	wl_list_remove(&watch->pending_link);
+	wl_list_init(&watch->pending_link);
+	if (watch->func(watch->fd, events, watch->user_data) && !watch->removed) {
+		wl_list_insert(state->fd_watches_pending.prev, &watch->pending_link);
+	}
+}
+
+static bool event_loop_handle_dbus(int fd, uint32_t events, void *data) {
+	struct xdpw_state *state = data;
+
+	// D-Bus handlers take the lock themselves where needed, a slow one
+	// doesn't hold up frame delivery
+	logprint(TRACE, "event-loop: got dbus event");
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < XDPW_EVENT_LOOP_DBUS_BUDGET; i++) {
+		int ret = sd_bus_process(state->bus, NULL);
+		if (ret < 0) {
+			logprint(ERROR, "sd_bus_process failed: %s", strerror(-ret));
+			state->loop_err = ret;
+			return false;
+		}
+		if (ret == 0) {
+			return false;
+		}
+		state->loop_stats.dbus_processed++;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_diff_ns(&now, &start) >= XDPW_EVENT_LOOP_DBUS_SLICE_NS) {
+			break;
+		}
+	}
+	state->loop_stats.dbus_budget_hits++;
+	return true;
+}
+
+static bool event_loop_handle_frames(int fd, uint32_t events, void *data) {
+	struct xdpw_state *state = data;
+
+	logprint(TRACE, "event-loop: got frames from pipewire");
+	pw_thread_loop_lock(state->pw_thread_loop);
+	xdpw_wlr_frames_done(&state->screencast);
+	xdpw_screencast_check_starts(state);
+	pw_thread_loop_unlock(state->pw_thread_loop);
+	return false;
+}
+
+static bool event_loop_handle_timer(int fd, uint32_t events, void *data) {
+	struct xdpw_state *state = data;
+
+	logprint(TRACE, "event-loop: got a timer event");
+	uint64_t expirations;
+	ssize_t n = read(fd, &expirations, sizeof(expirations));
+	if (n < 0) {
+		// rearmed for later since epoll_wait returned
+		if (errno == EAGAIN) {
+			return false;
+		}
+		logprint(ERROR, "failed to read from timer FD: %s", strerror(errno));
+		state->loop_err = -errno;
+		return false;
+	}
+
+	pw_thread_loop_lock(state->pw_thread_loop);
+	xdpw_run_timers(state);
+	pw_thread_loop_unlock(state->pw_thread_loop);
+	return false;
+}
+
+// called with the lock held, on success the caller has to read or cancel
+static int event_loop_prepare_wayland(struct xdpw_state *state) {
+	while (wl_display_prepare_read(state->wl_display) != 0) {
+		if (wl_display_dispatch_pending(state->wl_display) < 0) {
+			logprint(ERROR, "wl_display_dispatch_pending failed: %s", strerror(errno));
+			return -1;
+		}
+	}
+	// with a full socket the rest goes out with the next flush
+	if (wl_display_flush(state->wl_display) < 0 && errno != EAGAIN) {
+		logprint(ERROR, "wl_display_flush failed: %s", strerror(errno));
+		wl_display_cancel_read(state->wl_display);
+		return -1;
+	}
+	return 0;
+}
+
+// called with the lock held
+static int event_loop_dispatch_wayland(struct xdpw_state *state, uint32_t events) {
+	if (events == 0) {
+		wl_display_cancel_read(state->wl_display);
+		return 0;
+	}
+
+	logprint(TRACE, "event-loop: got wayland event");
+	if (wl_display_read_events(state->wl_display) < 0) {
+		logprint(ERROR, "wl_display_read_events failed: %s", strerror(errno));
+		return -1;
+	}
+	state->loop_stats.wayland_reads++;
+	if (wl_display_dispatch_pending(state->wl_display) < 0) {
+		logprint(ERROR, "wl_display_dispatch_pending failed: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+void xdpw_event_loop_frame_latency(struct xdpw_state *state,
+		struct timespec *frame) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t latency_ns = timespec_diff_ns(&now, frame);
+	// the compositor may use another clock
+	if (latency_ns < 0) {
+		return;
+	}
+	if ((uint64_t)latency_ns > state->loop_stats.frame_latency_max_ns) {
+		state->loop_stats.frame_latency_max_ns = latency_ns;
+	}
+	if ((uint64_t)latency_ns > state->frame_latency_worst_ns) {
+		state->frame_latency_worst_ns = latency_ns;
+	}
+}
+
+void xdpw_startup_report(struct xdpw_state *state, const char *milestone) {
+	if (!state->startup_time) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	// printed regardless of the log level
+	fprintf(stderr, "startup: %s after %.3f ms\n", milestone,
+		timespec_diff_ns(&now, &state->startup) / 1000000.0);
+}
+
+static void event_loop_report(struct xdpw_state *state) {
+	struct xdpw_event_loop_stats *stats = &state->loop_stats;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespec_diff_ns(&now, &stats->last_report) <
+			(int64_t)XDPW_EVENT_LOOP_STATS_INTERVAL_SEC * 1000000000) {
+		return;
+	}
+	logprint(DEBUG, "event-loop: %" PRIu64 " iterations, %" PRIu64 " events, "
+		"at most %u per iteration, %" PRIu64 " wayland reads, %" PRIu64 " timers, "
+		"%" PRIu64 " dbus dispatches, dbus budget exhausted %" PRIu64 " times, "
+		"%" PRIu64 " reruns, frames waited at most %.3f ms, "
+		"frame latency at most %.3f ms, %.3f ms since startup",
+		stats->iterations, stats->events, stats->events_max,
+		stats->wayland_reads, stats->timers, stats->dbus_processed,
+		stats->dbus_budget_hits, stats->reruns,
+		stats->frame_wait_max_ns / 1000000.0,
+		stats->frame_latency_max_ns / 1000000.0,
+		state->frame_latency_worst_ns / 1000000.0);
+	*stats = (struct xdpw_event_loop_stats){ .last_report = now };
+}
+
+int xdpw_event_loop_init(struct xdpw_state *state) {
+	wl_list_init(&state->timers_free);
+	wl_list_init(&state->fd_watches);
+	wl_list_init(&state->fd_watches_removed);
+	wl_list_init(&state->fd_watches_pending);
+	clock_gettime(CLOCK_MONOTONIC, &state->loop_stats.last_report);
+
+	state->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (state->epoll_fd < 0) {
+		logprint(ERROR, "event-loop: failed to create epoll instance: %s", strerror(errno));
+		return -1;
+	}
+	state->timer_poll_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (state->timer_poll_fd < 0) {
+		logprint(ERROR, "event-loop: failed to create timer fd: %s", strerror(errno));
+		close(state->epoll_fd);
+		state->epoll_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+int xdpw_event_loop_run(struct xdpw_state *state) {
+	// wayland is read by the loop itself, it has to prepare the read
+	// before every wait
+	struct epoll_event wayland_event = { .events = EPOLLIN, .data.ptr = NULL };
+	if (epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD,
+			wl_display_get_fd(state->wl_display), &wayland_event) < 0) {
+		logprint(ERROR, "event-loop: failed to watch the wayland fd: %s", strerror(errno));
+		return -1;
+	}
+	if (!event_loop_add_watch(state, state->screencast.frames_done_fd, EPOLLIN,
+				XDPW_FD_WATCH_PRIORITY_FRAMES, event_loop_handle_frames, state) ||
+			!event_loop_add_watch(state, state->timer_poll_fd, EPOLLIN,
+				XDPW_FD_WATCH_PRIORITY_TIMERS, event_loop_handle_timer, state) ||
+			!xdpw_add_fd_watch(state, sd_bus_get_fd(state->bus), EPOLLIN,
+				event_loop_handle_dbus, state)) {
+		return -1;
+	}
+
+	struct epoll_event events[XDPW_EVENT_LOOP_MAX_EVENTS];
+	struct wl_list rerun;
+
+	while (state->loop_err == 0) {
+		// sources left with work after their budget run once more this
+		// iteration, so nothing waits for them
+		wl_list_init(&rerun);
+		wl_list_insert_list(&rerun, &state->fd_watches_pending);
+		wl_list_init(&state->fd_watches_pending);
+
+		pw_thread_loop_lock(state->pw_thread_loop);
+		int ret = event_loop_prepare_wayland(state);
+		pw_thread_loop_unlock(state->pw_thread_loop);
+		if (ret < 0) {
+			return ret;
+		}
+
+		int n = epoll_wait(state->epoll_fd, events, XDPW_EVENT_LOOP_MAX_EVENTS,
+			wl_list_empty(&rerun) ? -1 : 0);
+		if (n < 0) {
+			if (errno != EINTR) {
+				logprint(ERROR, "epoll_wait failed: %s", strerror(errno));
+				wl_display_cancel_read(state->wl_display);
+				return -1;
+			}
+			n = 0;
+		}
+
+		uint32_t wayland_events = 0;
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL) {
+				wayland_events = events[i].events;
+			}
+		}
+		pw_thread_loop_lock(state->pw_thread_loop);
+		ret = event_loop_dispatch_wayland(state, wayland_events);
+		pw_thread_loop_unlock(state->pw_thread_loop);
+		if (ret < 0) {
+			return ret;
+		}
+
+		// wayland carries the compositor's frames and went first, then
+		// the buffers pipewire is done with, timers and the rest
+		struct timespec frames_done;
+		for (enum xdpw_fd_watch_priority p = 0; p < XDPW_FD_WATCH_PRIORITIES; p++) {
+			for (int i = 0; i < n && state->loop_err == 0; i++) {
+				struct xdpw_fd_watch *watch = events[i].data.ptr;
+				if (watch != NULL && !watch->removed && watch->priority == p) {
+					logprint(TRACE, "event-loop: got an event on fd %d", watch->fd);
+					fd_watch_run(watch, events[i].events);
+				}
+			}
+			if (p == XDPW_FD_WATCH_PRIORITY_FRAMES) {
+				clock_gettime(CLOCK_MONOTONIC, &frames_done);
+			}
+		}
+		while (!wl_list_empty(&rerun) && state->loop_err == 0) {
+			struct xdpw_fd_watch *watch =
+				wl_container_of(rerun.next, watch, pending_link);
+			state->loop_stats.reruns++;
+			fd_watch_run(watch, 0);
+		}
+		// drop what is left on an error
+		wl_list_remove(&rerun);
+		free_removed_fd_watches(state);
+
+		sd_bus_flush(state->bus);
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		uint64_t wait_ns = timespec_diff_ns(&now, &frames_done);
+		if (wait_ns > state->loop_stats.frame_wait_max_ns) {
+			state->loop_stats.frame_wait_max_ns = wait_ns;
+		}
+
+		state->loop_stats.iterations++;
+		state->loop_stats.events += n;
+		if ((uint32_t)n > state->loop_stats.events_max) {
+			state->loop_stats.events_max = n;
+		}
+		event_loop_report(state);
+	}
+
+	return state->loop_err;
+}
@@ -1,9 +1,6 @@
-#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <sys/timerfd.h>
 #include <getopt.h>
-#include <poll.h>
 #include <pipewire/pipewire.h>
 #include <spa/utils/result.h>
 #include <unistd.h>
@@ -11,13 +8,6 @@
 #include "xdpw.h"
 #include "logger.h"
 
-enum event_loop_fd {
-	EVENT_LOOP_DBUS,
-	EVENT_LOOP_WAYLAND,
-	EVENT_LOOP_PIPEWIRE,
-	EVENT_LOOP_TIMER,
-};
-
 static const char service_name[] = "org.freedesktop.impl.portal.desktop.wlr";
 
 static int xdpw_usage(FILE *stream, int rc) {
@@ -32,6 +22,9 @@ static int xdpw_usage(FILE *stream, int rc) {
 		"                                     (default is $XDG_CONFIG_HOME/xdg-desktop-portal-wlr/config)\n"
 		"    -r, --replace                    Replace a running instance.\n"
 		"    -f, --max-fps=<fps>              Set the FPS limit (default 0, no limit).\n"
+		"    -t, --startup-time               Print the time from startup to acquiring\n"
+		"                                     the bus name, to the end of the setup and\n"
+		"                                     to the first frame.\n"
 		"    -h, --help                       Get help (this text).\n"
 		"\n";
 
@@ -50,14 +43,19 @@ int main(int argc, char *argv[]) {
 	char *configfile = NULL;
 	enum LOGLEVEL loglevel = DEFAULT_LOGLEVEL;
 	bool replace = false;
+	bool startup_time = false;
+
+	struct timespec startup;
+	clock_gettime(CLOCK_MONOTONIC, &startup);
 
-	static const char *shortopts = "l:o:c:f:rh";
+	static const char *shortopts = "l:o:c:f:rth";
 	static const struct option longopts[] = {
 		{ "loglevel", required_argument, NULL, 'l' },
 		{ "output", required_argument, NULL, 'o' },
 		{ "config", required_argument, NULL, 'c' },
 		{ "max-fps", required_argument, NULL, 'f' },
 		{ "replace", no_argument, NULL, 'r' },
+		{ "startup-time", no_argument, NULL, 't' },
 		{ "help", no_argument, NULL, 'h' },
 		{ NULL, 0, NULL, 0 }
 	};
@@ -82,6 +80,9 @@ int main(int argc, char *argv[]) {
 		case 'r':
 			replace = true;
 			break;
+		case 't':
+			startup_time = true;
+			break;
 		case 'f':
 			config.screencast_conf.max_fps = atof(optarg);
 			break;
@@ -114,33 +115,52 @@ int main(int argc, char *argv[]) {
 	logprint(DEBUG, "wlroots: wl_display connected");
 
 	pw_init(NULL, NULL);
-	struct pw_loop *pw_loop = pw_loop_new(NULL);
-	if (!pw_loop) {
+	struct pw_thread_loop *pw_thread_loop = pw_thread_loop_new("xdpw-pipewire", NULL);
+	if (!pw_thread_loop) {
 		logprint(ERROR, "pipewire: failed to create loop");
 		wl_display_disconnect(wl_display);
 		sd_bus_unref(bus);
 		return EXIT_FAILURE;
 	}
-	logprint(DEBUG, "pipewire: pw_loop created");
+	logprint(DEBUG, "pipewire: pw_thread_loop created");
 
 	struct xdpw_state state = {
 		.bus = bus,
 		.wl_display = wl_display,
-		.pw_loop = pw_loop,
+		.pw_thread_loop = pw_thread_loop,
+		.pw_loop = pw_thread_loop_get_loop(pw_thread_loop),
 		.screencast_source_types = MONITOR,
 		.screencast_cursor_modes = HIDDEN | EMBEDDED,
 		.screencast_version = XDP_CAST_PROTO_VER,
 		.config = &config,
+		.startup_time = startup_time,
+		.startup = startup,
 	};
 
 	wl_list_init(&state.xdpw_sessions);
+	ret = xdpw_event_loop_init(&state);
+	if (ret < 0) {
+		goto error;
+	}
+
+	// the pipewire core connects on that thread, the main thread holds the
+	// lock while it touches anything the pipewire thread uses
+	ret = pw_thread_loop_start(state.pw_thread_loop);
+	if (ret < 0) {
+		logprint(ERROR, "pipewire: failed to start the thread loop: %s", spa_strerror(ret));
+		goto error;
+	}
 
+	// only starts the wayland and pipewire setup, portal clients waiting
+	// for the name don't wait for the compositor or pipewire
 	xdpw_screenshot_init(&state);
 	ret = xdpw_screencast_init(&state);
 	if (ret < 0) {
 		logprint(ERROR, "xdpw: failed to initialize screencast");
 		goto error;
 	}
+	// the compositor answers while the name is requested
+	wl_display_flush(state.wl_display);
 
 	uint64_t flags = SD_BUS_NAME_ALLOW_REPLACEMENT;
 	if (replace) {
@@ -152,6 +172,7 @@ int main(int argc, char *argv[]) {
 		logprint(ERROR, "dbus: failed to acquire service name: %s", strerror(-ret));
 		goto error;
 	}
+	xdpw_startup_report(&state, "bus name acquired");
 
 	const char *unique_name;
 	ret = sd_bus_get_unique_name(bus, &unique_name);
@@ -177,92 +198,9 @@ int main(int argc, char *argv[]) {
 		goto error;
 	}
 
-	wl_list_init(&state.timers);
-
-	struct pollfd pollfds[] = {
-		[EVENT_LOOP_DBUS] = {
-			.fd = sd_bus_get_fd(state.bus),
-			.events = POLLIN,
-		},
-		[EVENT_LOOP_WAYLAND] = {
-			.fd = wl_display_get_fd(state.wl_display),
-			.events = POLLIN,
-		},
-		[EVENT_LOOP_PIPEWIRE] = {
-			.fd = pw_loop_get_fd(state.pw_loop),
-			.events = POLLIN,
-		},
-		[EVENT_LOOP_TIMER] = {
-			.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC),
-			.events = POLLIN,
-		}
-	};
-
-	state.timer_poll_fd = pollfds[EVENT_LOOP_TIMER].fd;
-
-	while (1) {
-		ret = poll(pollfds, sizeof(pollfds) / sizeof(pollfds[0]), -1);
-		if (ret < 0) {
-			logprint(ERROR, "poll failed: %s", strerror(errno));
-			goto error;
-		}
-
-		if (pollfds[EVENT_LOOP_DBUS].revents & POLLIN) {
-			logprint(TRACE, "event-loop: got dbus event");
-			do {
-				ret = sd_bus_process(state.bus, NULL);
-			} while (ret > 0);
-			if (ret < 0) {
-				logprint(ERROR, "sd_bus_process failed: %s", strerror(-ret));
-				goto error;
-			}
-		}
-
-		if (pollfds[EVENT_LOOP_WAYLAND].revents & POLLIN) {
-			logprint(TRACE, "event-loop: got wayland event");
-			ret = wl_display_dispatch(state.wl_display);
-			if (ret < 0) {
-				logprint(ERROR, "wl_display_dispatch failed: %s", strerror(errno));
-				goto error;
-			}
-		}
-
-		if (pollfds[EVENT_LOOP_PIPEWIRE].revents & POLLIN) {
-			logprint(TRACE, "event-loop: got pipewire event");
-			ret = pw_loop_iterate(state.pw_loop, 0);
-			if (ret < 0) {
-				logprint(ERROR, "pw_loop_iterate failed: %s", spa_strerror(ret));
-				goto error;
-			}
-		}
-
-		if (pollfds[EVENT_LOOP_TIMER].revents & POLLIN) {
-			logprint(TRACE, "event-loop: got a timer event");
-			
-			int timer_fd = pollfds[EVENT_LOOP_TIMER].fd;
-			uint64_t expirations;
-			ssize_t n = read(timer_fd, &expirations, sizeof(expirations));
-			if (n < 0) {
-				logprint(ERROR, "failed to read from timer FD\n");
-				goto error;
-			}
-
-			struct xdpw_timer *timer = state.next_timer;
-			if (timer != NULL) {
-				xdpw_event_loop_timer_func_t func = timer->func;
-				void *user_data = timer->user_data;
-				xdpw_destroy_timer(timer);
-
-				func(user_data);
-			}
-		}
-
-		do {
-			ret = wl_display_dispatch_pending(state.wl_display);
-			wl_display_flush(state.wl_display);
-		} while (ret > 0);
-
-		sd_bus_flush(state.bus);
+	ret = xdpw_event_loop_run(&state);
+	if (ret < 0) {
+		goto error;
 	}
 
 	// TODO: cleanup
@@ -273,8 +211,8 @@ int main(int argc, char *argv[]) {
 
 error:
 	sd_bus_unref(bus);
-	pw_loop_leave(state.pw_loop);
-	pw_loop_destroy(state.pw_loop);
+	pw_thread_loop_stop(state.pw_thread_loop);
+	pw_thread_loop_destroy(state.pw_thread_loop);
 	wl_display_disconnect(state.wl_display);
 	return EXIT_FAILURE;
 }
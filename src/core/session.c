@@ -5,6 +5,7 @@
 #include <assert.h>
 #include "xdpw.h"
 #include "screencast.h"
+#include "wlr_screencast.h"
 #include "logger.h"
 
 static const char interface_name[] = "org.freedesktop.impl.portal.Session";
@@ -42,6 +43,7 @@ static const sd_bus_vtable session_vtable[] = {
 struct xdpw_session *xdpw_session_create(struct xdpw_state *state, sd_bus *bus, char *object_path) {
 	struct xdpw_session *sess = calloc(1, sizeof(struct xdpw_session));
 
+	sess->state = state;
 	sess->session_handle = object_path;
 
 	if (sd_bus_add_object_vtable(bus, &sess->slot, object_path, interface_name,
@@ -61,16 +63,32 @@ void xdpw_session_destroy(struct xdpw_session *sess) {
 	if (!sess) {
 		return;
 	}
-	struct xdpw_screencast_instance *cast = sess->screencast_instance;
-	if (cast) {
+	xdpw_screencast_cancel_requests(sess);
+
+	pw_thread_loop_lock(sess->state->pw_thread_loop);
+	for (uint32_t i = 0; i < sess->n_screencast_instances; i++) {
+		struct xdpw_screencast_instance *cast = sess->screencast_instances[i];
 		assert(cast->refcount > 0);
 		--cast->refcount;
 		logprint(DEBUG, "xdpw: screencast instance %p now has %d references",
 			cast, cast->refcount);
-		if (cast->refcount < 1) {
+		if (cast->refcount < 1 && cast->capture_source != NULL) {
+			// fed by another instance, nothing of its own is in flight
+			// but a frame the pipewire thread copies into its stream
+			cast->quit = true;
+			if (cast->copies == 0) {
+				xdpw_screencast_instance_destroy(cast);
+			}
+		} else if (cast->refcount < 1) {
 			cast->quit = true;
+			// a capture loop that was never started doesn't come around
+			// to tear it down, a pending first capture still does
+			if (!cast->initialized) {
+				xdpw_wlr_register_cb(cast);
+			}
 		}
 	}
+	pw_thread_loop_unlock(sess->state->pw_thread_loop);
 
 	sd_bus_slot_unref(sess->slot);
 	wl_list_remove(&sess->link);
@@ -0,0 +1,32 @@
+#include "spsc_ring.h"
+
+#include <stddef.h>
+
+void xdpw_spsc_ring_init(struct xdpw_spsc_ring *ring) {
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+}
+
+bool xdpw_spsc_ring_push(struct xdpw_spsc_ring *ring, void *item) {
+	uint_fast32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint_fast32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (tail - head == XDPW_SPSC_RING_SIZE) {
+		return false;
+	}
+	ring->slots[tail % XDPW_SPSC_RING_SIZE] = item;
+	// publishes the slot to the consumer
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+void *xdpw_spsc_ring_pop(struct xdpw_spsc_ring *ring) {
+	uint_fast32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint_fast32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head == tail) {
+		return NULL;
+	}
+	void *item = ring->slots[head % XDPW_SPSC_RING_SIZE];
+	// hands the slot back to the producer
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return item;
+}
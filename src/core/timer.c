@@ -1,4 +1,6 @@
-#include <poll.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <wayland-util.h>
 #include <sys/timerfd.h>
 
@@ -6,48 +8,120 @@
 #include "logger.h"
 #include "timespec_util.h"
 
+// timer nodes are allocated this many at a time and never handed back, the
+// pool keeps the peak number of timers
+#define XDPW_TIMER_POOL_CHUNK 32
+// timers run per wakeup at most, the timerfd is programmed for the rest and
+// expires right away
+#define XDPW_TIMER_RUN_BUDGET 64
+
+static void timer_heap_set(struct xdpw_state *state, size_t i, struct xdpw_timer *timer) {
+	state->timer_heap[i] = timer;
+	timer->heap_index = i;
+}
+
+static void timer_heap_up(struct xdpw_state *state, size_t i) {
+	struct xdpw_timer *timer = state->timer_heap[i];
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (!timespec_less(&timer->at, &state->timer_heap[parent]->at)) {
+			break;
+		}
+		timer_heap_set(state, i, state->timer_heap[parent]);
+		i = parent;
+	}
+	timer_heap_set(state, i, timer);
+}
+
+static void timer_heap_down(struct xdpw_state *state, size_t i) {
+	struct xdpw_timer *timer = state->timer_heap[i];
+	while (true) {
+		size_t child = 2 * i + 1;
+		if (child >= state->n_timers) {
+			break;
+		}
+		if (child + 1 < state->n_timers && timespec_less(
+				&state->timer_heap[child + 1]->at, &state->timer_heap[child]->at)) {
+			child++;
+		}
+		if (!timespec_less(&state->timer_heap[child]->at, &timer->at)) {
+			break;
+		}
+		timer_heap_set(state, i, state->timer_heap[child]);
+		i = child;
+	}
+	timer_heap_set(state, i, timer);
+}
+
+// reprograms the timerfd if the earliest deadline changed
 static void update_timer(struct xdpw_state *state) {
 	int timer_fd = state->timer_poll_fd;
-	if (timer_fd < 0) {
+	if (timer_fd < 0 || state->timers_running) {
 		return;
 	}
 
-	bool updated = false;
-	struct xdpw_timer *timer;
-	wl_list_for_each(timer, &state->timers, link) {
-		if (state->next_timer == NULL ||
-				timespec_less(&timer->at, &state->next_timer->at)) {
-			state->next_timer = timer;
-			updated = true;
-		}
+	// a zero value disarms the timerfd
+	struct timespec at = {0};
+	if (state->n_timers > 0) {
+		at = state->timer_heap[0]->at;
+	}
+	if (at.tv_sec == state->timer_armed_at.tv_sec &&
+			at.tv_nsec == state->timer_armed_at.tv_nsec) {
+		return;
 	}
 
-	if (updated) {
-		struct itimerspec delay = { .it_value = state->next_timer->at };
-		errno = 0;
-		int ret = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &delay, NULL);
-		if (ret < 0) {
-			fprintf(stderr, "failed to timerfd_settime(): %s\n",
-				strerror(errno));
-		}
+	struct itimerspec delay = { .it_value = at };
+	errno = 0;
+	int ret = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &delay, NULL);
+	if (ret < 0) {
+		fprintf(stderr, "failed to timerfd_settime(): %s\n",
+			strerror(errno));
+		return;
+	}
+	state->timer_armed_at = at;
+}
+
+static int timer_pool_grow(struct xdpw_state *state) {
+	struct xdpw_timer *timers = calloc(XDPW_TIMER_POOL_CHUNK, sizeof(struct xdpw_timer));
+	if (timers == NULL) {
+		logprint(ERROR, "Timer allocation failed");
+		return -1;
 	}
+	for (size_t i = 0; i < XDPW_TIMER_POOL_CHUNK; i++) {
+		wl_list_insert(&state->timers_free, &timers[i].link);
+	}
+	return 0;
 }
 
 struct xdpw_timer *xdpw_add_timer(struct xdpw_state *state,
 		uint64_t delay_ns, xdpw_event_loop_timer_func_t func, void *data) {
-	struct xdpw_timer *timer = calloc(1, sizeof(struct xdpw_timer));
-	if (timer == NULL) {
-		logprint(ERROR, "Timer allocation failed");
+	if (state->n_timers == state->timer_heap_size) {
+		size_t size = state->timer_heap_size > 0 ?
+			state->timer_heap_size * 2 : XDPW_TIMER_POOL_CHUNK;
+		struct xdpw_timer **heap = realloc(state->timer_heap, size * sizeof(*heap));
+		if (heap == NULL) {
+			logprint(ERROR, "Timer allocation failed");
+			return NULL;
+		}
+		state->timer_heap = heap;
+		state->timer_heap_size = size;
+	}
+	if (wl_list_empty(&state->timers_free) && timer_pool_grow(state) < 0) {
 		return NULL;
 	}
+
+	struct xdpw_timer *timer = wl_container_of(state->timers_free.next, timer, link);
+	wl_list_remove(&timer->link);
 	timer->state = state;
 	timer->func = func;
 	timer->user_data = data;
-	wl_list_insert(&state->timers, &timer->link);
 
 	clock_gettime(CLOCK_MONOTONIC, &timer->at);
 	timespec_add(&timer->at, delay_ns);
 
+	timer_heap_set(state, state->n_timers, timer);
+	timer_heap_up(state, state->n_timers++);
+
 	update_timer(state);
 	return timer;
 }
@@ -58,12 +132,48 @@ void xdpw_destroy_timer(struct xdpw_timer *timer) {
 	}
 	struct xdpw_state *state = timer->state;
 
-	if (state->next_timer == timer) {
-		state->next_timer = NULL;
+	struct xdpw_timer *last = state->timer_heap[--state->n_timers];
+	if (last != timer) {
+		timer_heap_set(state, timer->heap_index, last);
+		timer_heap_up(state, last->heap_index);
+		timer_heap_down(state, last->heap_index);
 	}
+	wl_list_insert(&state->timers_free, &timer->link);
 
-	wl_list_remove(&timer->link);
-	free(timer);
+	update_timer(state);
+}
+
+void xdpw_run_timers(struct xdpw_state *state) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	// the timerfd expired, it is programmed once for whatever is left
+	// after all due timers ran
+	state->timer_armed_at = (struct timespec){0};
+	state->timers_running = true;
+	int budget = XDPW_TIMER_RUN_BUDGET;
+	bool ran = false;
+	while (state->n_timers > 0 && budget > 0) {
+		if (timespec_less(&now, &state->timer_heap[0]->at)) {
+			// the callbacks may have added timers with no delay
+			if (!ran) {
+				break;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			ran = false;
+			continue;
+		}
+		struct xdpw_timer *timer = state->timer_heap[0];
+		xdpw_event_loop_timer_func_t func = timer->func;
+		void *user_data = timer->user_data;
+		xdpw_destroy_timer(timer);
+
+		func(user_data);
+		state->loop_stats.timers++;
+		budget--;
+		ran = true;
+	}
+	state->timers_running = false;
 
 	update_timer(state);
 }
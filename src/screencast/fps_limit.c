@@ -4,14 +4,14 @@
 #include <stdint.h>
 #include <time.h>
 #include <unistd.h>
-#include <assert.h>
 
 #define FPS_MEASURE_PERIOD_SEC 5.0
 
 void measure_fps(struct fps_limit_state *state, struct timespec *now);
 
 void fps_limit_measure_start(struct fps_limit_state *state, double max_fps) {
-	if (max_fps <= 0.0) {
+	// the idle rate might kick in before the matching measure_end
+	if (max_fps <= 0.0 && state->idle_fps <= 0.0) {
 		return;
 	}
 
@@ -22,9 +22,11 @@ uint64_t fps_limit_measure_end(struct fps_limit_state *state, double max_fps) {
 	if (max_fps <= 0.0) {
 		return 0;
 	}
-
-	// `fps_limit_measure_start` was not called?
-	assert(!timespec_is_zero(&state->frame_last_time));
+	// `fps_limit_measure_start` skips frames at full rate without a
+	// max_fps, the first idle frame has nothing to measure against
+	if (timespec_is_zero(&state->frame_last_time)) {
+		return 0;
+	}
 
 	struct timespec now;
 	clock_gettime(CLOCK_MONOTONIC, &now);
@@ -45,6 +47,36 @@ uint64_t fps_limit_measure_end(struct fps_limit_state *state, double max_fps) {
 	}
 }
 
+void fps_limit_update_idle(struct fps_limit_state *state, bool damaged,
+		double ceiling_fps, double floor_fps, double ramp) {
+	if (damaged || floor_fps <= 0.0) {
+		if (state->idle_fps > 0.0) {
+			logprint(DEBUG, "fps_limit: damage after idling at %0.2f fps, back to full rate",
+				state->idle_fps);
+		}
+		state->idle_fps = 0.0;
+		return;
+	}
+
+	double fps = state->idle_fps > 0.0 ? state->idle_fps : ceiling_fps;
+	// without a known ceiling or ramp go straight to the floor
+	fps = ceiling_fps > 0.0 && ramp > 1.0 ? fps / ramp : floor_fps;
+	if (fps < floor_fps) {
+		fps = floor_fps;
+	}
+	if (fps != state->idle_fps) {
+		logprint(TRACE, "fps_limit: frame without damage, lowering the rate to %0.2f fps", fps);
+	}
+	state->idle_fps = fps;
+}
+
+double fps_limit_target(struct fps_limit_state *state, double max_fps) {
+	if (state->idle_fps > 0.0 && (max_fps <= 0.0 || state->idle_fps < max_fps)) {
+		return state->idle_fps;
+	}
+	return max_fps;
+}
+
 void measure_fps(struct fps_limit_state *state, struct timespec *now) {
 	if (timespec_is_zero(&state->fps_last_time)) {
 		state->fps_last_time = *now;
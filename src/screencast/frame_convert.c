@@ -0,0 +1,668 @@
+#include "frame_convert.h"
+
+#include <spa/utils/defs.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XDPW_CONVERT_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#define XDPW_CONVERT_NEON 1
+#endif
+
+#include "frame_copy.h"
+#include "logger.h"
+
+#define YUV_STRIDE_ALIGN 16
+
+// 8.8 fixed point coefficients, see ITU-R BT.601 and BT.709
+struct yuv_coeffs {
+	int32_t yr, yg, yb;
+	int32_t ur, ug, ub;
+	int32_t vr, vg, vb;
+	int32_t y_offset;
+};
+
+static const struct yuv_coeffs bt601_limited = {
+	66, 129, 25,
+	-38, -74, 112,
+	112, -94, -18,
+	16,
+};
+
+static const struct yuv_coeffs bt601_full = {
+	77, 150, 29,
+	-43, -85, 128,
+	128, -107, -21,
+	0,
+};
+
+static const struct yuv_coeffs bt709_limited = {
+	47, 157, 16,
+	-26, -86, 112,
+	112, -102, -10,
+	16,
+};
+
+static const struct yuv_coeffs bt709_full = {
+	54, 183, 19,
+	-29, -99, 128,
+	128, -116, -12,
+	0,
+};
+
+struct convert_job {
+	// first pixel of the converted area, rows in output order
+	const uint8_t *src;
+	ptrdiff_t src_stride;
+	uint32_t width;
+	uint32_t height;
+	uint32_t r, g, b;
+	const struct yuv_coeffs *c;
+
+	uint8_t *y;
+	uint32_t y_stride;
+	// NV12 keeps both chroma samples interleaved in u
+	uint8_t *u;
+	uint8_t *v;
+	uint32_t uv_stride;
+	bool interleaved;
+};
+
+typedef void (*convert_rows_func_t)(const struct convert_job *job,
+	size_t first_pair, size_t n_pairs);
+
+struct convert_kernel {
+	const char *name;
+	bool (*supported)(void);
+	convert_rows_func_t convert_rows;
+};
+
+static convert_rows_func_t convert_rows_impl;
+
+static bool always_supported(void) {
+	return true;
+}
+
+static inline uint8_t clamp_u8(int32_t v) {
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline uint8_t luma(const struct yuv_coeffs *c, const uint8_t *px,
+		uint32_t r, uint32_t g, uint32_t b) {
+	return clamp_u8(((c->yr * px[r] + c->yg * px[g] + c->yb * px[b] + 128) >> 8) + c->y_offset);
+}
+
+static inline void chroma(const struct convert_job *job, size_t pair, size_t x,
+		const uint8_t *p00, const uint8_t *p01, const uint8_t *p10, const uint8_t *p11) {
+	const struct yuv_coeffs *c = job->c;
+	int32_t r = (p00[job->r] + p01[job->r] + p10[job->r] + p11[job->r] + 2) >> 2;
+	int32_t g = (p00[job->g] + p01[job->g] + p10[job->g] + p11[job->g] + 2) >> 2;
+	int32_t b = (p00[job->b] + p01[job->b] + p10[job->b] + p11[job->b] + 2) >> 2;
+	uint8_t u = clamp_u8(((c->ur * r + c->ug * g + c->ub * b + 128) >> 8) + 128);
+	uint8_t v = clamp_u8(((c->vr * r + c->vg * g + c->vb * b + 128) >> 8) + 128);
+
+	uint8_t *uv_row = job->u + pair * job->uv_stride;
+	if (job->interleaved) {
+		uv_row[x] = u;
+		uv_row[x + 1] = v;
+	} else {
+		uv_row[x / 2] = u;
+		job->v[pair * job->uv_stride + x / 2] = v;
+	}
+}
+
+struct pair_rows {
+	const uint8_t *s0, *s1;
+	uint8_t *y0, *y1;
+	uint8_t *u, *v;
+};
+
+// every pair of rows shares one row of chroma samples, an odd last row is
+// paired with itself
+static inline struct pair_rows pair_rows(const struct convert_job *job, size_t pair) {
+	size_t row0 = pair * 2;
+	size_t row1 = row0 + 1 < job->height ? row0 + 1 : row0;
+	return (struct pair_rows) {
+		.s0 = job->src + (ptrdiff_t)row0 * job->src_stride,
+		.s1 = job->src + (ptrdiff_t)row1 * job->src_stride,
+		.y0 = job->y + row0 * job->y_stride,
+		.y1 = job->y + row1 * job->y_stride,
+		.u = job->u + pair * job->uv_stride,
+		.v = job->interleaved ? NULL : job->v + pair * job->uv_stride,
+	};
+}
+
+// the scalar tails of the vector kernels, from pixel x to the end of the row
+static inline void luma_row(const struct convert_job *job, const uint8_t *s,
+		uint8_t *y, size_t x) {
+	for (; x < job->width; x++) {
+		y[x] = luma(job->c, s + x * 4, job->r, job->g, job->b);
+	}
+}
+
+// x is even, an odd last column is paired with itself
+static inline void chroma_row(const struct convert_job *job, size_t pair,
+		const struct pair_rows *rows, size_t x) {
+	const uint8_t *s0 = rows->s0, *s1 = rows->s1;
+	for (; x + 1 < job->width; x += 2) {
+		chroma(job, pair, x, s0 + x * 4, s0 + x * 4 + 4, s1 + x * 4, s1 + x * 4 + 4);
+	}
+	if (x < job->width) {
+		chroma(job, pair, x, s0 + x * 4, s0 + x * 4, s1 + x * 4, s1 + x * 4);
+	}
+}
+
+// reference implementation, every other kernel must match it bit for bit
+static void convert_rows_scalar(const struct convert_job *job,
+		size_t first_pair, size_t n_pairs) {
+	for (size_t pair = first_pair; pair < first_pair + n_pairs; pair++) {
+		struct pair_rows rows = pair_rows(job, pair);
+		luma_row(job, rows.s0, rows.y0, 0);
+		luma_row(job, rows.s1, rows.y1, 0);
+		chroma_row(job, pair, &rows, 0);
+	}
+}
+
+#ifdef XDPW_CONVERT_X86
+// coefficients in the byte order of a pixel, the unused channel gets 0
+static void pixel_coeffs(const struct convert_job *job, int32_t cr, int32_t cg,
+		int32_t cb, int16_t w[4]) {
+	memset(w, 0, 4 * sizeof(*w));
+	w[job->r] = cr;
+	w[job->g] = cg;
+	w[job->b] = cb;
+}
+
+static bool sse2_supported(void) {
+	return __builtin_cpu_supports("sse2");
+}
+
+static bool avx2_supported(void) {
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("sse2")))
+static inline __m128i coeffs_sse2(const int16_t w[4]) {
+	return _mm_setr_epi16(w[0], w[1], w[2], w[3], w[0], w[1], w[2], w[3]);
+}
+
+// the vector kernels multiply the 16 bit channels of a pixel with
+// _madd_epi16, which leaves two partial sums per pixel in 32 bits. This adds
+// them up for the 2 + 2 pixels of a and b, giving [a0, a1, b0, b1]
+__attribute__((target("sse2")))
+static inline __m128i hsum_pairs_sse2(__m128i a, __m128i b) {
+	__m128 even = _mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b),
+		_MM_SHUFFLE(2, 0, 2, 0));
+	__m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b),
+		_MM_SHUFFLE(3, 1, 3, 1));
+	return _mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd));
+}
+
+// (sum + 128) >> 8 + offset
+__attribute__((target("sse2")))
+static inline __m128i descale_sse2(__m128i sum, __m128i offset) {
+	return _mm_add_epi32(_mm_srai_epi32(
+		_mm_add_epi32(sum, _mm_set1_epi32(128)), 8), offset);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i luma4_sse2(const uint8_t *s, __m128i w) {
+	__m128i px = _mm_loadu_si128((const __m128i *)s);
+	__m128i zero = _mm_setzero_si128();
+	return hsum_pairs_sse2(_mm_madd_epi16(_mm_unpacklo_epi8(px, zero), w),
+		_mm_madd_epi16(_mm_unpackhi_epi8(px, zero), w));
+}
+
+__attribute__((target("sse2")))
+static inline void luma16_sse2(const uint8_t *s, uint8_t *y, __m128i w, __m128i offset) {
+	__m128i a = descale_sse2(luma4_sse2(s, w), offset);
+	__m128i b = descale_sse2(luma4_sse2(s + 16, w), offset);
+	__m128i c = descale_sse2(luma4_sse2(s + 32, w), offset);
+	__m128i d = descale_sse2(luma4_sse2(s + 48, w), offset);
+	_mm_storeu_si128((__m128i *)y,
+		_mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+}
+
+// channel averages of the two 2x2 blocks of 4 pixels in each row
+__attribute__((target("sse2")))
+static inline __m128i block_avg2_sse2(const uint8_t *s0, const uint8_t *s1) {
+	__m128i a = _mm_loadu_si128((const __m128i *)s0);
+	__m128i b = _mm_loadu_si128((const __m128i *)s1);
+	__m128i zero = _mm_setzero_si128();
+	// [px0, px1] and [px2, px3] of both rows
+	__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+	__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+	__m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+	return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+// stores the 8 u samples in the low and the 8 v samples in the high half of uv
+__attribute__((target("sse2")))
+static inline void store_chroma8_sse2(const struct pair_rows *rows, size_t x, __m128i uv) {
+	if (rows->v == NULL) {
+		_mm_storeu_si128((__m128i *)(rows->u + x),
+			_mm_unpacklo_epi8(uv, _mm_srli_si128(uv, 8)));
+	} else {
+		_mm_storel_epi64((__m128i *)(rows->u + x / 2), uv);
+		_mm_storel_epi64((__m128i *)(rows->v + x / 2), _mm_srli_si128(uv, 8));
+	}
+}
+
+__attribute__((target("sse2")))
+static inline void chroma16_sse2(const struct pair_rows *rows, size_t x,
+		__m128i wu, __m128i wv) {
+	const uint8_t *s0 = rows->s0 + x * 4, *s1 = rows->s1 + x * 4;
+	__m128i offset = _mm_set1_epi32(128);
+	__m128i a = block_avg2_sse2(s0, s1);
+	__m128i b = block_avg2_sse2(s0 + 16, s1 + 16);
+	__m128i c = block_avg2_sse2(s0 + 32, s1 + 32);
+	__m128i d = block_avg2_sse2(s0 + 48, s1 + 48);
+
+	__m128i u = _mm_packs_epi32(
+		descale_sse2(hsum_pairs_sse2(_mm_madd_epi16(a, wu), _mm_madd_epi16(b, wu)), offset),
+		descale_sse2(hsum_pairs_sse2(_mm_madd_epi16(c, wu), _mm_madd_epi16(d, wu)), offset));
+	__m128i v = _mm_packs_epi32(
+		descale_sse2(hsum_pairs_sse2(_mm_madd_epi16(a, wv), _mm_madd_epi16(b, wv)), offset),
+		descale_sse2(hsum_pairs_sse2(_mm_madd_epi16(c, wv), _mm_madd_epi16(d, wv)), offset));
+	store_chroma8_sse2(rows, x, _mm_packus_epi16(u, v));
+}
+
+// 16 pixels of both rows per iteration
+__attribute__((target("sse2")))
+static void convert_rows_sse2(const struct convert_job *job,
+		size_t first_pair, size_t n_pairs) {
+	const struct yuv_coeffs *c = job->c;
+	int16_t w[4];
+	pixel_coeffs(job, c->yr, c->yg, c->yb, w);
+	__m128i wy = coeffs_sse2(w);
+	pixel_coeffs(job, c->ur, c->ug, c->ub, w);
+	__m128i wu = coeffs_sse2(w);
+	pixel_coeffs(job, c->vr, c->vg, c->vb, w);
+	__m128i wv = coeffs_sse2(w);
+	__m128i y_offset = _mm_set1_epi32(c->y_offset);
+
+	for (size_t pair = first_pair; pair < first_pair + n_pairs; pair++) {
+		struct pair_rows rows = pair_rows(job, pair);
+		size_t x = 0;
+		for (; x + 16 <= job->width; x += 16) {
+			luma16_sse2(rows.s0 + x * 4, rows.y0 + x, wy, y_offset);
+			luma16_sse2(rows.s1 + x * 4, rows.y1 + x, wy, y_offset);
+			chroma16_sse2(&rows, x, wu, wv);
+		}
+		luma_row(job, rows.s0, rows.y0, x);
+		luma_row(job, rows.s1, rows.y1, x);
+		chroma_row(job, pair, &rows, x);
+	}
+}
+
+__attribute__((target("avx2")))
+static inline __m256i coeffs_avx2(const int16_t w[4]) {
+	return _mm256_setr_epi16(w[0], w[1], w[2], w[3], w[0], w[1], w[2], w[3],
+		w[0], w[1], w[2], w[3], w[0], w[1], w[2], w[3]);
+}
+
+// hsum_pairs_sse2 within each 128 bit lane
+__attribute__((target("avx2")))
+static inline __m256i hsum_pairs_avx2(__m256i a, __m256i b) {
+	__m256 even = _mm256_shuffle_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b),
+		_MM_SHUFFLE(2, 0, 2, 0));
+	__m256 odd = _mm256_shuffle_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b),
+		_MM_SHUFFLE(3, 1, 3, 1));
+	return _mm256_add_epi32(_mm256_castps_si256(even), _mm256_castps_si256(odd));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i descale_avx2(__m256i sum, __m256i offset) {
+	return _mm256_add_epi32(_mm256_srai_epi32(
+		_mm256_add_epi32(sum, _mm256_set1_epi32(128)), 8), offset);
+}
+
+// packs 8 + 8 sums in pixel order to bytes
+__attribute__((target("avx2")))
+static inline __m128i pack16_avx2(__m256i a, __m256i b) {
+	// the packs work per lane, [a0-3, b0-3 | a4-7, b4-7]
+	__m256i ab = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b),
+		_MM_SHUFFLE(3, 1, 2, 0));
+	return _mm_packus_epi16(_mm256_castsi256_si128(ab), _mm256_extracti128_si256(ab, 1));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i luma8_avx2(const uint8_t *s, __m256i w) {
+	// [px0, px1 | px2, px3] and [px4, px5 | px6, px7]
+	__m256i lo = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)s));
+	__m256i hi = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(s + 16)));
+	__m256i sum = hsum_pairs_avx2(_mm256_madd_epi16(lo, w), _mm256_madd_epi16(hi, w));
+	// [p0, p1, p4, p5 | p2, p3, p6, p7]
+	return _mm256_permutevar8x32_epi32(sum, _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7));
+}
+
+__attribute__((target("avx2")))
+static inline void luma16_avx2(const uint8_t *s, uint8_t *y, __m256i w, __m256i offset) {
+	__m256i a = descale_avx2(luma8_avx2(s, w), offset);
+	__m256i b = descale_avx2(luma8_avx2(s + 32, w), offset);
+	_mm_storeu_si128((__m128i *)y, pack16_avx2(a, b));
+}
+
+// channel averages of the four 2x2 blocks of 8 pixels in each row,
+// [blk0, blk2 | blk1, blk3]
+__attribute__((target("avx2")))
+static inline __m256i block_avg4_avx2(const uint8_t *s0, const uint8_t *s1) {
+	// [px0, px1 | px2, px3] and [px4, px5 | px6, px7] of both rows
+	__m256i a = _mm256_add_epi16(
+		_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)s0)),
+		_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)s1)));
+	__m256i b = _mm256_add_epi16(
+		_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(s0 + 16))),
+		_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(s1 + 16))));
+	__m256i sum = _mm256_add_epi16(_mm256_unpacklo_epi64(a, b), _mm256_unpackhi_epi64(a, b));
+	return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(2)), 2);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i chroma8_avx2(__m256i a, __m256i b, __m256i w, __m256i offset) {
+	// [blk0, blk2, blk4, blk6 | blk1, blk3, blk5, blk7]
+	__m256i sum = hsum_pairs_avx2(_mm256_madd_epi16(a, w), _mm256_madd_epi16(b, w));
+	sum = _mm256_permutevar8x32_epi32(sum, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+	return descale_avx2(sum, offset);
+}
+
+__attribute__((target("avx2")))
+static inline void chroma16_avx2(const struct pair_rows *rows, size_t x,
+		__m256i wu, __m256i wv) {
+	const uint8_t *s0 = rows->s0 + x * 4, *s1 = rows->s1 + x * 4;
+	__m256i offset = _mm256_set1_epi32(128);
+	__m256i a = block_avg4_avx2(s0, s1);
+	__m256i b = block_avg4_avx2(s0 + 32, s1 + 32);
+	store_chroma8_sse2(rows, x, pack16_avx2(chroma8_avx2(a, b, wu, offset),
+		chroma8_avx2(a, b, wv, offset)));
+}
+
+// 16 pixels of both rows per iteration
+__attribute__((target("avx2")))
+static void convert_rows_avx2(const struct convert_job *job,
+		size_t first_pair, size_t n_pairs) {
+	const struct yuv_coeffs *c = job->c;
+	int16_t w[4];
+	pixel_coeffs(job, c->yr, c->yg, c->yb, w);
+	__m256i wy = coeffs_avx2(w);
+	pixel_coeffs(job, c->ur, c->ug, c->ub, w);
+	__m256i wu = coeffs_avx2(w);
+	pixel_coeffs(job, c->vr, c->vg, c->vb, w);
+	__m256i wv = coeffs_avx2(w);
+	__m256i y_offset = _mm256_set1_epi32(c->y_offset);
+
+	for (size_t pair = first_pair; pair < first_pair + n_pairs; pair++) {
+		struct pair_rows rows = pair_rows(job, pair);
+		size_t x = 0;
+		for (; x + 16 <= job->width; x += 16) {
+			luma16_avx2(rows.s0 + x * 4, rows.y0 + x, wy, y_offset);
+			luma16_avx2(rows.s1 + x * 4, rows.y1 + x, wy, y_offset);
+			chroma16_avx2(&rows, x, wu, wv);
+		}
+		luma_row(job, rows.s0, rows.y0, x);
+		luma_row(job, rows.s1, rows.y1, x);
+		chroma_row(job, pair, &rows, x);
+	}
+	_mm256_zeroupper();
+}
+#endif
+
+#ifdef XDPW_CONVERT_NEON
+static bool neon_supported(void) {
+#ifdef __linux__
+	return getauxval(AT_HWCAP) & HWCAP_ASIMD;
+#else
+	// Advanced SIMD is mandatory on AArch64
+	return true;
+#endif
+}
+
+// the luma coefficients are positive and sum up to less than 256, the
+// weighted sum fits 16 bits unsigned
+static inline uint8x16_t luma16_neon(const struct convert_job *job, uint8x16x4_t px,
+		uint8x8_t yr, uint8x8_t yg, uint8x8_t yb) {
+	uint8x16_t r = px.val[job->r], g = px.val[job->g], b = px.val[job->b];
+	uint16x8_t lo = vmull_u8(vget_low_u8(r), yr);
+	lo = vmlal_u8(lo, vget_low_u8(g), yg);
+	lo = vmlal_u8(lo, vget_low_u8(b), yb);
+	uint16x8_t hi = vmull_u8(vget_high_u8(r), yr);
+	hi = vmlal_u8(hi, vget_high_u8(g), yg);
+	hi = vmlal_u8(hi, vget_high_u8(b), yb);
+	// the rounding shift is (sum + 128) >> 8
+	uint8x16_t y = vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8));
+	return vqaddq_u8(y, vdupq_n_u8(job->c->y_offset));
+}
+
+// averages of the 8 2x2 blocks of one channel
+static inline int16x8_t block_avg8_neon(uint8x16_t row0, uint8x16_t row1) {
+	return vreinterpretq_s16_u16(vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(row0), row1), 2));
+}
+
+static inline uint8x8_t chroma8_neon(int16x8_t r, int16x8_t g, int16x8_t b,
+		int16_t cr, int16_t cg, int16_t cb) {
+	int32x4_t lo = vmull_n_s16(vget_low_s16(r), cr);
+	lo = vmlal_n_s16(lo, vget_low_s16(g), cg);
+	lo = vmlal_n_s16(lo, vget_low_s16(b), cb);
+	int32x4_t hi = vmull_n_s16(vget_high_s16(r), cr);
+	hi = vmlal_n_s16(hi, vget_high_s16(g), cg);
+	hi = vmlal_n_s16(hi, vget_high_s16(b), cb);
+	int16x8_t sum = vcombine_s16(vmovn_s32(vrshrq_n_s32(lo, 8)),
+		vmovn_s32(vrshrq_n_s32(hi, 8)));
+	return vqmovun_s16(vaddq_s16(sum, vdupq_n_s16(128)));
+}
+
+// 16 pixels of both rows per iteration, vld4 splits the channels
+static void convert_rows_neon(const struct convert_job *job,
+		size_t first_pair, size_t n_pairs) {
+	const struct yuv_coeffs *c = job->c;
+	uint8x8_t yr = vdup_n_u8(c->yr), yg = vdup_n_u8(c->yg), yb = vdup_n_u8(c->yb);
+
+	for (size_t pair = first_pair; pair < first_pair + n_pairs; pair++) {
+		struct pair_rows rows = pair_rows(job, pair);
+		size_t x = 0;
+		for (; x + 16 <= job->width; x += 16) {
+			uint8x16x4_t p0 = vld4q_u8(rows.s0 + x * 4);
+			uint8x16x4_t p1 = vld4q_u8(rows.s1 + x * 4);
+			vst1q_u8(rows.y0 + x, luma16_neon(job, p0, yr, yg, yb));
+			vst1q_u8(rows.y1 + x, luma16_neon(job, p1, yr, yg, yb));
+
+			int16x8_t r = block_avg8_neon(p0.val[job->r], p1.val[job->r]);
+			int16x8_t g = block_avg8_neon(p0.val[job->g], p1.val[job->g]);
+			int16x8_t b = block_avg8_neon(p0.val[job->b], p1.val[job->b]);
+			uint8x8x2_t uv = {{
+				chroma8_neon(r, g, b, c->ur, c->ug, c->ub),
+				chroma8_neon(r, g, b, c->vr, c->vg, c->vb),
+			}};
+			if (rows.v == NULL) {
+				vst2_u8(rows.u + x, uv);
+			} else {
+				vst1_u8(rows.u + x / 2, uv.val[0]);
+				vst1_u8(rows.v + x / 2, uv.val[1]);
+			}
+		}
+		luma_row(job, rows.s0, rows.y0, x);
+		luma_row(job, rows.s1, rows.y1, x);
+		chroma_row(job, pair, &rows, x);
+	}
+}
+#endif
+
+// ordered by preference, the first supported kernel wins. Every kernel is
+// checked against the scalar one by tests/frame_convert_test.c
+static const struct convert_kernel convert_kernels[] = {
+#ifdef XDPW_CONVERT_X86
+	{ "avx2", avx2_supported, convert_rows_avx2 },
+	{ "sse2", sse2_supported, convert_rows_sse2 },
+#endif
+#ifdef XDPW_CONVERT_NEON
+	{ "neon", neon_supported, convert_rows_neon },
+#endif
+	{ "scalar", always_supported, convert_rows_scalar },
+};
+
+void xdpw_frame_convert_init(void) {
+	if (convert_rows_impl != NULL) {
+		return;
+	}
+
+	for (size_t i = 0; i < sizeof(convert_kernels) / sizeof(convert_kernels[0]); i++) {
+		const struct convert_kernel *kernel = &convert_kernels[i];
+		if (kernel->supported()) {
+			convert_rows_impl = kernel->convert_rows;
+			logprint(DEBUG, "frame_convert: using %s kernel", kernel->name);
+			return;
+		}
+	}
+}
+
+bool xdpw_convert_is_yuv(enum spa_video_format format) {
+	return format == SPA_VIDEO_FORMAT_NV12 || format == SPA_VIDEO_FORMAT_I420;
+}
+
+// byte offsets of the color channels in a little endian pixel
+static bool rgb_offsets(enum wl_shm_format format,
+		uint32_t *r, uint32_t *g, uint32_t *b) {
+	switch (format) {
+	case WL_SHM_FORMAT_ARGB8888:
+	case WL_SHM_FORMAT_XRGB8888:
+		*r = 2; *g = 1; *b = 0;
+		return true;
+	case WL_SHM_FORMAT_ABGR8888:
+	case WL_SHM_FORMAT_XBGR8888:
+		*r = 0; *g = 1; *b = 2;
+		return true;
+	case WL_SHM_FORMAT_RGBA8888:
+	case WL_SHM_FORMAT_RGBX8888:
+		*r = 3; *g = 2; *b = 1;
+		return true;
+	case WL_SHM_FORMAT_BGRA8888:
+	case WL_SHM_FORMAT_BGRX8888:
+		*r = 1; *g = 2; *b = 3;
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool xdpw_convert_supported(enum wl_shm_format src_format) {
+	uint32_t r, g, b;
+	return rgb_offsets(src_format, &r, &g, &b);
+}
+
+bool xdpw_convert_layout(enum spa_video_format format, uint32_t width, uint32_t height,
+		struct xdpw_yuv_layout *layout) {
+	uint32_t chroma_width = (width + 1) / 2;
+	uint32_t chroma_height = (height + 1) / 2;
+
+	*layout = (struct xdpw_yuv_layout) {
+		.width = width,
+		.height = height,
+	};
+	layout->strides[0] = SPA_ROUND_UP_N(width, YUV_STRIDE_ALIGN);
+	layout->sizes[0] = layout->strides[0] * height;
+
+	switch (format) {
+	case SPA_VIDEO_FORMAT_NV12:
+		layout->n_planes = 2;
+		layout->strides[1] = SPA_ROUND_UP_N(chroma_width * 2, YUV_STRIDE_ALIGN);
+		layout->sizes[1] = layout->strides[1] * chroma_height;
+		return true;
+	case SPA_VIDEO_FORMAT_I420:
+		layout->n_planes = 3;
+		layout->strides[1] = SPA_ROUND_UP_N(chroma_width, YUV_STRIDE_ALIGN);
+		layout->sizes[1] = layout->strides[1] * chroma_height;
+		layout->strides[2] = layout->strides[1];
+		layout->sizes[2] = layout->sizes[1];
+		return true;
+	default:
+		return false;
+	}
+}
+
+static const struct yuv_coeffs *yuv_coeffs(enum spa_video_color_matrix matrix,
+		enum spa_video_color_range range) {
+	bool full = range == SPA_VIDEO_COLOR_RANGE_0_255;
+	if (matrix == SPA_VIDEO_COLOR_MATRIX_BT601) {
+		return full ? &bt601_full : &bt601_limited;
+	}
+	return full ? &bt709_full : &bt709_limited;
+}
+
+static void convert_band(void *data, size_t band, size_t first_pair, size_t n_pairs) {
+	convert_rows_impl(data, first_pair, n_pairs);
+}
+
+static void convert_rect(struct xdpw_frame *frame, const struct convert_job *base,
+		const struct xdpw_yuv_layout *layout, uint8_t *planes[XDPW_YUV_MAX_PLANES],
+		struct xdpw_frame_damage rect) {
+	// chroma samples cover 2x2 pixels, grow the rectangle to whole samples
+	uint32_t x1 = rect.x + rect.width;
+	uint32_t y1 = rect.y + rect.height;
+	rect.x &= ~1u;
+	rect.y &= ~1u;
+	x1 = x1 + 1 < layout->width ? (x1 + 1) & ~1u : layout->width;
+	y1 = y1 + 1 < layout->height ? (y1 + 1) & ~1u : layout->height;
+	if (rect.x >= x1 || rect.y >= y1) {
+		return;
+	}
+
+	struct convert_job job = *base;
+	job.width = x1 - rect.x;
+	job.height = y1 - rect.y;
+
+	size_t src_row = frame->y_invert ? frame->height - rect.y - 1 : rect.y;
+	job.src = (const uint8_t *)frame->data + src_row * frame->stride + (size_t)rect.x * 4;
+	job.y = planes[0] + (size_t)rect.y * layout->strides[0] + rect.x;
+	if (job.interleaved) {
+		job.u = planes[1] + (size_t)(rect.y / 2) * layout->strides[1] + rect.x;
+	} else {
+		job.u = planes[1] + (size_t)(rect.y / 2) * layout->strides[1] + rect.x / 2;
+		job.v = planes[2] + (size_t)(rect.y / 2) * layout->strides[2] + rect.x / 2;
+	}
+
+	xdpw_frame_copy_run_bands(convert_band, &job, (job.height + 1) / 2,
+		(size_t)job.width * job.height * 4);
+}
+
+void xdpw_convert_frame(struct xdpw_frame *frame, enum spa_video_format format,
+		enum spa_video_color_matrix matrix, enum spa_video_color_range range,
+		const struct xdpw_yuv_layout *layout, uint8_t *planes[XDPW_YUV_MAX_PLANES],
+		struct xdpw_region *damage) {
+	if (convert_rows_impl == NULL) {
+		xdpw_frame_convert_init();
+	}
+
+	struct convert_job job = {
+		.src_stride = frame->y_invert ? -(ptrdiff_t)frame->stride : (ptrdiff_t)frame->stride,
+		.c = yuv_coeffs(matrix, range),
+		.y_stride = layout->strides[0],
+		.uv_stride = layout->strides[1],
+		.interleaved = format == SPA_VIDEO_FORMAT_NV12,
+	};
+	if (!rgb_offsets(frame->format, &job.r, &job.g, &job.b)) {
+		logprint(ERROR, "frame_convert: unsupported source format %d", frame->format);
+		return;
+	}
+
+	// the buffer covers the negotiated size, the frame might be smaller
+	uint32_t width = SPA_MIN(frame->width, layout->width);
+	uint32_t height = SPA_MIN(frame->height, layout->height);
+	struct xdpw_yuv_layout clipped = *layout;
+	clipped.width = width;
+	clipped.height = height;
+
+	if (damage == NULL) {
+		struct xdpw_frame_damage all = { 0, 0, width, height };
+		convert_rect(frame, &job, &clipped, planes, all);
+		return;
+	}
+	for (uint32_t i = 0; i < damage->n_rects; i++) {
+		convert_rect(frame, &job, &clipped, planes, damage->rects[i]);
+	}
+}
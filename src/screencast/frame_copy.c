@@ -0,0 +1,405 @@
+#include "frame_copy.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XDPW_COPY_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#define XDPW_COPY_NEON 1
+#endif
+
+#include "logger.h"
+#include "screencast_common.h"
+
+#define LLC_SIZE_FALLBACK (8 * 1024 * 1024)
+
+typedef void (*copy_rows_func_t)(uint8_t *dst, ptrdiff_t dst_stride,
+	const uint8_t *src, ptrdiff_t src_stride, size_t length, size_t rows,
+	bool streaming);
+
+struct copy_kernel {
+	const char *name;
+	bool (*supported)(void);
+	copy_rows_func_t copy_rows;
+};
+
+struct copy_pool {
+	pthread_t threads[XDPW_COPY_THREADS_MAX];
+	int n_threads;
+	size_t threshold;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+
+	// current job, guarded by lock
+	uint64_t generation;
+	xdpw_copy_band_func_t func;
+	void *data;
+	size_t rows;
+	size_t n_bands;
+	size_t next_band;
+	size_t done_bands;
+};
+
+struct copy_rows_job {
+	uint8_t *dst;
+	ptrdiff_t dst_stride;
+	const uint8_t *src;
+	ptrdiff_t src_stride;
+	size_t length;
+	bool streaming;
+};
+
+static bool always_supported(void) {
+	return true;
+}
+
+// reference implementation, every other kernel must match it bit for bit
+static void copy_rows_scalar(uint8_t *dst, ptrdiff_t dst_stride,
+		const uint8_t *src, ptrdiff_t src_stride, size_t length, size_t rows,
+		bool streaming) {
+	for (size_t i = 0; i < rows; ++i) {
+		memcpy(dst + (ptrdiff_t)i * dst_stride, src + (ptrdiff_t)i * src_stride, length);
+	}
+}
+
+static bool copy_initialized;
+static copy_rows_func_t copy_rows_impl = copy_rows_scalar;
+static size_t streaming_threshold = LLC_SIZE_FALLBACK;
+static struct copy_pool pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+#ifdef XDPW_COPY_X86
+static bool sse2_supported(void) {
+	return __builtin_cpu_supports("sse2");
+}
+
+static bool avx2_supported(void) {
+	return __builtin_cpu_supports("avx2");
+}
+
+static bool avx512_supported(void) {
+	return __builtin_cpu_supports("avx512f");
+}
+
+// non-temporal stores need an aligned destination, the unaligned head and
+// the tail of each row go through memcpy
+
+__attribute__((target("sse2")))
+static void copy_rows_sse2(uint8_t *dst, ptrdiff_t dst_stride,
+		const uint8_t *src, ptrdiff_t src_stride, size_t length, size_t rows,
+		bool streaming) {
+	for (size_t i = 0; i < rows; ++i) {
+		uint8_t *d = dst + (ptrdiff_t)i * dst_stride;
+		const uint8_t *s = src + (ptrdiff_t)i * src_stride;
+		size_t n = length;
+
+		size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+		if (head > n) {
+			head = n;
+		}
+		memcpy(d, s, head);
+		d += head;
+		s += head;
+		n -= head;
+
+		for (; n >= 64; n -= 64, d += 64, s += 64) {
+			__m128i a = _mm_loadu_si128((const __m128i *)s);
+			__m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+			__m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+			__m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+			if (streaming) {
+				_mm_stream_si128((__m128i *)d, a);
+				_mm_stream_si128((__m128i *)(d + 16), b);
+				_mm_stream_si128((__m128i *)(d + 32), c);
+				_mm_stream_si128((__m128i *)(d + 48), e);
+			} else {
+				_mm_store_si128((__m128i *)d, a);
+				_mm_store_si128((__m128i *)(d + 16), b);
+				_mm_store_si128((__m128i *)(d + 32), c);
+				_mm_store_si128((__m128i *)(d + 48), e);
+			}
+		}
+		memcpy(d, s, n);
+	}
+	if (streaming) {
+		_mm_sfence();
+	}
+}
+
+__attribute__((target("avx2")))
+static void copy_rows_avx2(uint8_t *dst, ptrdiff_t dst_stride,
+		const uint8_t *src, ptrdiff_t src_stride, size_t length, size_t rows,
+		bool streaming) {
+	for (size_t i = 0; i < rows; ++i) {
+		uint8_t *d = dst + (ptrdiff_t)i * dst_stride;
+		const uint8_t *s = src + (ptrdiff_t)i * src_stride;
+		size_t n = length;
+
+		size_t head = (32 - ((uintptr_t)d & 31)) & 31;
+		if (head > n) {
+			head = n;
+		}
+		memcpy(d, s, head);
+		d += head;
+		s += head;
+		n -= head;
+
+		for (; n >= 128; n -= 128, d += 128, s += 128) {
+			__m256i a = _mm256_loadu_si256((const __m256i *)s);
+			__m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+			__m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+			__m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+			if (streaming) {
+				_mm256_stream_si256((__m256i *)d, a);
+				_mm256_stream_si256((__m256i *)(d + 32), b);
+				_mm256_stream_si256((__m256i *)(d + 64), c);
+				_mm256_stream_si256((__m256i *)(d + 96), e);
+			} else {
+				_mm256_store_si256((__m256i *)d, a);
+				_mm256_store_si256((__m256i *)(d + 32), b);
+				_mm256_store_si256((__m256i *)(d + 64), c);
+				_mm256_store_si256((__m256i *)(d + 96), e);
+			}
+		}
+		memcpy(d, s, n);
+	}
+	if (streaming) {
+		_mm_sfence();
+	}
+	_mm256_zeroupper();
+}
+
+__attribute__((target("avx512f")))
+static void copy_rows_avx512(uint8_t *dst, ptrdiff_t dst_stride,
+		const uint8_t *src, ptrdiff_t src_stride, size_t length, size_t rows,
+		bool streaming) {
+	for (size_t i = 0; i < rows; ++i) {
+		uint8_t *d = dst + (ptrdiff_t)i * dst_stride;
+		const uint8_t *s = src + (ptrdiff_t)i * src_stride;
+		size_t n = length;
+
+		size_t head = (64 - ((uintptr_t)d & 63)) & 63;
+		if (head > n) {
+			head = n;
+		}
+		memcpy(d, s, head);
+		d += head;
+		s += head;
+		n -= head;
+
+		for (; n >= 128; n -= 128, d += 128, s += 128) {
+			__m512i a = _mm512_loadu_si512((const void *)s);
+			__m512i b = _mm512_loadu_si512((const void *)(s + 64));
+			if (streaming) {
+				_mm512_stream_si512((void *)d, a);
+				_mm512_stream_si512((void *)(d + 64), b);
+			} else {
+				_mm512_store_si512((void *)d, a);
+				_mm512_store_si512((void *)(d + 64), b);
+			}
+		}
+		memcpy(d, s, n);
+	}
+	if (streaming) {
+		_mm_sfence();
+	}
+}
+#endif
+
+#ifdef XDPW_COPY_NEON
+static bool neon_supported(void) {
+#ifdef __linux__
+	return getauxval(AT_HWCAP) & HWCAP_ASIMD;
+#else
+	// Advanced SIMD is mandatory on AArch64
+	return true;
+#endif
+}
+
+// there is no portable non-temporal store on NEON, streaming is ignored
+static void copy_rows_neon(uint8_t *dst, ptrdiff_t dst_stride,
+		const uint8_t *src, ptrdiff_t src_stride, size_t length, size_t rows,
+		bool streaming) {
+	for (size_t i = 0; i < rows; ++i) {
+		uint8_t *d = dst + (ptrdiff_t)i * dst_stride;
+		const uint8_t *s = src + (ptrdiff_t)i * src_stride;
+		size_t n = length;
+
+		for (; n >= 64; n -= 64, d += 64, s += 64) {
+			uint8x16x4_t v = vld1q_u8_x4(s);
+			vst1q_u8_x4(d, v);
+		}
+		for (; n >= 16; n -= 16, d += 16, s += 16) {
+			vst1q_u8(d, vld1q_u8(s));
+		}
+		memcpy(d, s, n);
+	}
+}
+#endif
+
+// ordered by preference, the first supported kernel wins. Every kernel is
+// checked against the scalar one by tests/frame_copy_test.c
+static const struct copy_kernel copy_kernels[] = {
+#ifdef XDPW_COPY_X86
+	{ "avx512", avx512_supported, copy_rows_avx512 },
+	{ "avx2", avx2_supported, copy_rows_avx2 },
+	{ "sse2", sse2_supported, copy_rows_sse2 },
+#endif
+#ifdef XDPW_COPY_NEON
+	{ "neon", neon_supported, copy_rows_neon },
+#endif
+	{ "scalar", always_supported, copy_rows_scalar },
+};
+
+// takes bands of the current job until none are left, called with the lock held
+static void copy_pool_work(void) {
+	while (pool.next_band < pool.n_bands) {
+		size_t band = pool.next_band++;
+		size_t first_row = pool.rows * band / pool.n_bands;
+		size_t end_row = pool.rows * (band + 1) / pool.n_bands;
+
+		pthread_mutex_unlock(&pool.lock);
+		pool.func(pool.data, band, first_row, end_row - first_row);
+		pthread_mutex_lock(&pool.lock);
+
+		if (++pool.done_bands == pool.n_bands) {
+			pthread_cond_signal(&pool.done_cond);
+		}
+	}
+}
+
+static void *copy_pool_thread(void *data) {
+	uint64_t generation = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	while (true) {
+		while (pool.generation == generation) {
+			pthread_cond_wait(&pool.work_cond, &pool.lock);
+		}
+		generation = pool.generation;
+		copy_pool_work();
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+static void copy_pool_init(int threads, size_t threshold) {
+	if (threads > XDPW_COPY_THREADS_MAX) {
+		logprint(WARN, "frame_copy: limiting copy threads to %d", XDPW_COPY_THREADS_MAX);
+		threads = XDPW_COPY_THREADS_MAX;
+	}
+	pool.threshold = threshold;
+
+	// the calling thread, the pipewire one, takes a band as well
+	sigset_t mask, old_mask;
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+	for (int i = 0; i < threads - 1; i++) {
+		int err = pthread_create(&pool.threads[pool.n_threads], NULL,
+			copy_pool_thread, NULL);
+		if (err != 0) {
+			logprint(ERROR, "frame_copy: failed to start copy thread: %s", strerror(err));
+			break;
+		}
+		pool.n_threads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (pool.n_threads > 0) {
+		logprint(INFO, "frame_copy: splitting copies above %zu bytes across %d threads",
+			pool.threshold, pool.n_threads + 1);
+	}
+}
+
+void xdpw_frame_copy_init(int threads, size_t threshold) {
+	if (copy_initialized) {
+		return;
+	}
+	copy_initialized = true;
+
+#ifdef _SC_LEVEL3_CACHE_SIZE
+	long llc_size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+	if (llc_size > 0) {
+		streaming_threshold = llc_size;
+	}
+#endif
+
+	copy_pool_init(threads, threshold);
+
+	for (size_t i = 0; i < sizeof(copy_kernels) / sizeof(copy_kernels[0]); i++) {
+		const struct copy_kernel *kernel = &copy_kernels[i];
+		if (!kernel->supported()) {
+			logprint(DEBUG, "frame_copy: %s kernel not supported by this cpu", kernel->name);
+			continue;
+		}
+		copy_rows_impl = kernel->copy_rows;
+		logprint(INFO, "frame_copy: using %s kernel, streaming stores above %zu bytes",
+			kernel->name, streaming_threshold);
+		return;
+	}
+}
+
+size_t xdpw_frame_copy_max_bands(void) {
+	return (size_t)pool.n_threads + 1;
+}
+
+void xdpw_frame_copy_run_bands(xdpw_copy_band_func_t func, void *data,
+		size_t rows, size_t bytes) {
+	if (pool.n_threads == 0 || bytes < pool.threshold || rows < 2) {
+		func(data, 0, 0, rows);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.func = func;
+	pool.data = data;
+	pool.rows = rows;
+	pool.n_bands = (size_t)pool.n_threads + 1 < rows ? (size_t)pool.n_threads + 1 : rows;
+	pool.next_band = 0;
+	pool.done_bands = 0;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.work_cond);
+
+	copy_pool_work();
+	while (pool.done_bands < pool.n_bands) {
+		pthread_cond_wait(&pool.done_cond, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void copy_rows_band(void *data, size_t band, size_t first_row, size_t n_rows) {
+	struct copy_rows_job *job = data;
+	copy_rows_impl(job->dst + (ptrdiff_t)first_row * job->dst_stride, job->dst_stride,
+		job->src + (ptrdiff_t)first_row * job->src_stride, job->src_stride,
+		job->length, n_rows, job->streaming);
+}
+
+void xdpw_copy_rows(uint8_t *dst, ptrdiff_t dst_stride,
+		const uint8_t *src, ptrdiff_t src_stride, size_t length, size_t rows) {
+	// frames larger than the last level cache would only evict useful data
+	struct copy_rows_job job = {
+		.dst = dst,
+		.dst_stride = dst_stride,
+		.src = src,
+		.src_stride = src_stride,
+		.length = length,
+		.streaming = length * rows > streaming_threshold,
+	};
+	xdpw_frame_copy_run_bands(copy_rows_band, &job, rows, length * rows);
+}
@@ -0,0 +1,290 @@
+#include "frame_scale.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame_copy.h"
+#include "logger.h"
+
+#define SCALE_WEIGHT_BITS 14
+#define SCALE_WEIGHT_ONE (1 << SCALE_WEIGHT_BITS)
+// larger boxes go through the area filter, see box_recip
+#define SCALE_BOX_MAX_PIXELS 256
+
+// source pixels covered by each destination pixel along one axis and their
+// share of it, the weights of one destination pixel add up to SCALE_WEIGHT_ONE
+struct scale_axis {
+	uint32_t taps;
+	uint32_t *first;
+	uint32_t *count;
+	uint16_t *weights;
+};
+
+struct xdpw_scaler {
+	uint32_t src_width;
+	uint32_t src_height;
+	uint32_t dst_width;
+	uint32_t dst_height;
+
+	// integer factors use a plain box filter
+	uint32_t box_x;
+	uint32_t box_y;
+	uint64_t box_recip;
+
+	struct scale_axis x;
+	struct scale_axis y;
+	// one row of the area filter's sums per band, see xdpw_frame_copy_run_bands
+	uint32_t *acc;
+	size_t acc_bands;
+};
+
+struct scale_job {
+	const struct xdpw_scaler *scaler;
+	const uint8_t *src;
+	ptrdiff_t src_stride;
+	uint8_t *dst;
+	uint32_t dst_stride;
+	struct xdpw_frame_damage rect;
+};
+
+static void box_rows(const struct scale_job *job, size_t first_row, size_t n_rows) {
+	const struct xdpw_scaler *scaler = job->scaler;
+	uint32_t bx = scaler->box_x, by = scaler->box_y;
+	uint32_t half = bx * by / 2;
+
+	for (size_t row = first_row; row < first_row + n_rows; row++) {
+		size_t y = job->rect.y + row;
+		const uint8_t *src = job->src + (ptrdiff_t)(y * by) * job->src_stride;
+		uint8_t *dst = job->dst + y * job->dst_stride;
+
+		for (size_t x = job->rect.x; x < (size_t)job->rect.x + job->rect.width; x++) {
+			uint32_t sum[4] = { 0 };
+			for (uint32_t sy = 0; sy < by; sy++) {
+				const uint8_t *px = src + (ptrdiff_t)sy * job->src_stride + x * bx * 4;
+				for (uint32_t sx = 0; sx < bx; sx++) {
+					for (int c = 0; c < 4; c++) {
+						sum[c] += px[sx * 4 + c];
+					}
+				}
+			}
+			for (int c = 0; c < 4; c++) {
+				dst[x * 4 + c] = ((sum[c] + half) * scaler->box_recip) >> 32;
+			}
+		}
+	}
+}
+
+// separable area filter, each destination row accumulates the horizontally
+// filtered source rows it covers
+static void area_rows(const struct scale_job *job, size_t band,
+		size_t first_row, size_t n_rows) {
+	const struct xdpw_scaler *scaler = job->scaler;
+	const struct scale_axis *ax = &scaler->x, *ay = &scaler->y;
+	uint32_t x0 = job->rect.x, x1 = job->rect.x + job->rect.width;
+	uint32_t *acc = scaler->acc + band * scaler->dst_width * 4;
+
+	for (size_t row = first_row; row < first_row + n_rows; row++) {
+		size_t y = job->rect.y + row;
+		memset(acc, 0, (size_t)job->rect.width * 4 * sizeof(*acc));
+
+		for (uint32_t ty = 0; ty < ay->count[y]; ty++) {
+			const uint8_t *src = job->src + (ptrdiff_t)(ay->first[y] + ty) * job->src_stride;
+			uint32_t wy = ay->weights[y * ay->taps + ty];
+
+			for (uint32_t x = x0; x < x1; x++) {
+				const uint8_t *px = src + (size_t)ax->first[x] * 4;
+				const uint16_t *wx = &ax->weights[(size_t)x * ax->taps];
+				uint32_t h[4] = { 0 };
+				for (uint32_t tx = 0; tx < ax->count[x]; tx++) {
+					for (int c = 0; c < 4; c++) {
+						h[c] += wx[tx] * px[tx * 4 + c];
+					}
+				}
+				// keep 8 fractional bits so the sum fits 32 bits
+				for (int c = 0; c < 4; c++) {
+					acc[(x - x0) * 4 + c] += wy * (h[c] >> (SCALE_WEIGHT_BITS - 8));
+				}
+			}
+		}
+
+		uint8_t *dst = job->dst + y * job->dst_stride + (size_t)x0 * 4;
+		for (uint32_t i = 0; i < job->rect.width * 4; i++) {
+			dst[i] = (acc[i] + (1u << (SCALE_WEIGHT_BITS + 7))) >> (SCALE_WEIGHT_BITS + 8);
+		}
+	}
+}
+
+static void scale_axis_finish(struct scale_axis *axis) {
+	free(axis->first);
+	free(axis->count);
+	free(axis->weights);
+}
+
+static int scale_axis_init(struct scale_axis *axis, uint32_t src_len, uint32_t dst_len) {
+	axis->taps = (src_len + dst_len - 1) / dst_len + 1;
+	axis->first = calloc(dst_len, sizeof(*axis->first));
+	axis->count = calloc(dst_len, sizeof(*axis->count));
+	axis->weights = calloc((size_t)dst_len * axis->taps, sizeof(*axis->weights));
+	if (!axis->first || !axis->count || !axis->weights) {
+		scale_axis_finish(axis);
+		return -1;
+	}
+
+	// positions are in units of 1/dst_len source pixels
+	for (uint32_t i = 0; i < dst_len; i++) {
+		uint64_t start = (uint64_t)i * src_len;
+		uint64_t end = start + src_len;
+		uint16_t *weights = &axis->weights[(size_t)i * axis->taps];
+		uint32_t total = 0;
+
+		axis->first[i] = start / dst_len;
+		for (uint32_t j = axis->first[i]; (uint64_t)j * dst_len < end && j < src_len; j++) {
+			uint64_t lo = SPA_MAX(start, (uint64_t)j * dst_len);
+			uint64_t hi = SPA_MIN(end, (uint64_t)(j + 1) * dst_len);
+			uint32_t w = (hi - lo) * SCALE_WEIGHT_ONE / src_len;
+			weights[axis->count[i]++] = w;
+			total += w;
+		}
+		// rounding leftovers go to the last pixel
+		weights[axis->count[i] - 1] += SCALE_WEIGHT_ONE - total;
+	}
+	return 0;
+}
+
+struct xdpw_scaler *xdpw_scaler_create(uint32_t src_width, uint32_t src_height,
+		uint32_t dst_width, uint32_t dst_height) {
+	if (dst_width == 0 || dst_height == 0 ||
+			dst_width > src_width || dst_height > src_height) {
+		logprint(ERROR, "frame_scale: can't scale %ux%u to %ux%u",
+			src_width, src_height, dst_width, dst_height);
+		return NULL;
+	}
+
+	struct xdpw_scaler *scaler = calloc(1, sizeof(*scaler));
+	if (scaler == NULL) {
+		return NULL;
+	}
+	scaler->src_width = src_width;
+	scaler->src_height = src_height;
+	scaler->dst_width = dst_width;
+	scaler->dst_height = dst_height;
+
+	if (src_width % dst_width == 0 && src_height % dst_height == 0 &&
+			(src_width / dst_width) * (src_height / dst_height) <= SCALE_BOX_MAX_PIXELS) {
+		scaler->box_x = src_width / dst_width;
+		scaler->box_y = src_height / dst_height;
+		// exact division by multiplication for sums of up to 256 bytes
+		uint64_t n = scaler->box_x * scaler->box_y;
+		scaler->box_recip = ((1ull << 32) + n - 1) / n;
+		logprint(DEBUG, "frame_scale: %ux%u box filter", scaler->box_x, scaler->box_y);
+		return scaler;
+	}
+
+	if (scale_axis_init(&scaler->x, src_width, dst_width) < 0) {
+		free(scaler);
+		return NULL;
+	}
+	if (scale_axis_init(&scaler->y, src_height, dst_height) < 0) {
+		scale_axis_finish(&scaler->x);
+		free(scaler);
+		return NULL;
+	}
+	// a damaged rectangle is at most as wide as the frame
+	scaler->acc_bands = xdpw_frame_copy_max_bands();
+	scaler->acc = calloc(scaler->acc_bands * dst_width * 4, sizeof(*scaler->acc));
+	if (scaler->acc == NULL) {
+		logprint(ERROR, "frame_scale: failed to allocate row buffers");
+		scale_axis_finish(&scaler->x);
+		scale_axis_finish(&scaler->y);
+		free(scaler);
+		return NULL;
+	}
+	logprint(DEBUG, "frame_scale: area filter");
+	return scaler;
+}
+
+void xdpw_scaler_destroy(struct xdpw_scaler *scaler) {
+	if (scaler == NULL) {
+		return;
+	}
+	if (!scaler->box_x) {
+		scale_axis_finish(&scaler->x);
+		scale_axis_finish(&scaler->y);
+		free(scaler->acc);
+	}
+	free(scaler);
+}
+
+void xdpw_scaler_map_rect(const struct xdpw_scaler *scaler, struct xdpw_frame_damage *rect) {
+	uint64_t x0 = (uint64_t)rect->x * scaler->dst_width / scaler->src_width;
+	uint64_t y0 = (uint64_t)rect->y * scaler->dst_height / scaler->src_height;
+	uint64_t x1 = ((uint64_t)(rect->x + rect->width) * scaler->dst_width +
+		scaler->src_width - 1) / scaler->src_width;
+	uint64_t y1 = ((uint64_t)(rect->y + rect->height) * scaler->dst_height +
+		scaler->src_height - 1) / scaler->src_height;
+
+	x1 = SPA_MIN(x1, (uint64_t)scaler->dst_width);
+	y1 = SPA_MIN(y1, (uint64_t)scaler->dst_height);
+	rect->x = x0;
+	rect->y = y0;
+	rect->width = x1 > x0 ? x1 - x0 : 0;
+	rect->height = y1 > y0 ? y1 - y0 : 0;
+}
+
+static void scale_band(void *data, size_t band, size_t first_row, size_t n_rows) {
+	const struct scale_job *job = data;
+	if (job->scaler->box_x) {
+		box_rows(job, first_row, n_rows);
+	} else {
+		area_rows(job, band, first_row, n_rows);
+	}
+}
+
+static void scale_rect(const struct scale_job *base, struct xdpw_frame_damage rect) {
+	const struct xdpw_scaler *scaler = base->scaler;
+	if (rect.x >= scaler->dst_width || rect.y >= scaler->dst_height) {
+		return;
+	}
+	rect.width = SPA_MIN(rect.width, scaler->dst_width - rect.x);
+	rect.height = SPA_MIN(rect.height, scaler->dst_height - rect.y);
+	if (rect.width == 0 || rect.height == 0) {
+		return;
+	}
+
+	struct scale_job job = *base;
+	job.rect = rect;
+	// the work is proportional to the source pixels read
+	size_t bytes = (size_t)rect.width * rect.height * 4 *
+		(scaler->src_width / scaler->dst_width) * (scaler->src_height / scaler->dst_height);
+	xdpw_frame_copy_run_bands(scale_band, &job, rect.height, bytes);
+}
+
+int xdpw_scaler_scale(const struct xdpw_scaler *scaler, struct xdpw_frame *frame,
+		uint8_t *dst, uint32_t dst_stride, struct xdpw_region *damage) {
+	if (frame->width != scaler->src_width || frame->height != scaler->src_height ||
+			xdpw_bpp_from_wl_shm(frame->format) != 4) {
+		logprint(ERROR, "frame_scale: frame doesn't match the scaler");
+		return -1;
+	}
+
+	// rows in output order, flipped frames are read bottom up
+	struct scale_job job = {
+		.scaler = scaler,
+		.src = frame->y_invert ?
+			(const uint8_t *)frame->data + (size_t)(frame->height - 1) * frame->stride :
+			(const uint8_t *)frame->data,
+		.src_stride = frame->y_invert ? -(ptrdiff_t)frame->stride : (ptrdiff_t)frame->stride,
+		.dst = dst,
+		.dst_stride = dst_stride,
+	};
+
+	if (damage == NULL) {
+		struct xdpw_frame_damage all = { 0, 0, scaler->dst_width, scaler->dst_height };
+		scale_rect(&job, all);
+		return 0;
+	}
+	for (uint32_t i = 0; i < damage->n_rects; i++) {
+		scale_rect(&job, damage->rects[i]);
+	}
+	return 0;
+}
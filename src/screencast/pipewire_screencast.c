@@ -1,83 +1,605 @@
 #include "pipewire_screencast.h"
 
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <pipewire/pipewire.h>
 #include <spa/utils/result.h>
 #include <spa/param/props.h>
 #include <spa/param/format-utils.h>
 #include <spa/param/video/format-utils.h>
 
+#include "frame_convert.h"
+#include "frame_copy.h"
+#include "frame_scale.h"
 #include "wlr_screencast.h"
 #include "xdpw.h"
 #include "logger.h"
+#include "timespec_util.h"
 
 static void writeFrameData(void *pwFramePointer, void *wlrFramePointer,
 		uint32_t height, uint32_t stride, bool inverted) {
+	if (height == 0) {
+		return;
+	}
 	if (!inverted) {
-		memcpy(pwFramePointer, wlrFramePointer, height * stride);
+		xdpw_copy_rows(pwFramePointer, stride, wlrFramePointer, stride,
+			stride, height);
 		return;
 	}
 
-	for (size_t i = 0; i < (size_t)height; ++i) {
-		void *flippedWlrRowPointer = wlrFramePointer + ((height - i - 1) * stride);
-		void *pwRowPointer = pwFramePointer + (i * stride);
-		memcpy(pwRowPointer, flippedWlrRowPointer, stride);
+	uint8_t *lastWlrRowPointer = (uint8_t *)wlrFramePointer + (size_t)(height - 1) * stride;
+	xdpw_copy_rows(pwFramePointer, stride, lastWlrRowPointer, -(ptrdiff_t)stride,
+		stride, height);
+}
+
+static void writeFrameDamage(void *pwFramePointer, void *wlrFramePointer,
+		uint32_t height, uint32_t stride, bool inverted, uint32_t bpp,
+		struct xdpw_region *damage) {
+	for (uint32_t r = 0; r < damage->n_rects; ++r) {
+		struct xdpw_frame_damage *rect = &damage->rects[r];
+		size_t offset = (size_t)rect->x * bpp;
+		size_t length = (size_t)rect->width * bpp;
+		if (rect->height == 0) {
+			continue;
+		}
+
+		uint8_t *pwRowPointer = (uint8_t *)pwFramePointer + (size_t)rect->y * stride + offset;
+		size_t wlrRow = inverted ? height - rect->y - 1 : rect->y;
+		uint8_t *wlrRowPointer = (uint8_t *)wlrFramePointer + wlrRow * stride + offset;
+		xdpw_copy_rows(pwRowPointer, stride, wlrRowPointer,
+			inverted ? -(ptrdiff_t)stride : (ptrdiff_t)stride, length, rect->height);
 	}
+}
 
-	return;
+static void flipFrameData(void *framePointer, uint32_t height, uint32_t stride) {
+	uint8_t tmp[4096];
+
+	for (size_t i = 0; i < (size_t)height / 2; ++i) {
+		uint8_t *top = (uint8_t *)framePointer + (i * stride);
+		uint8_t *bottom = (uint8_t *)framePointer + ((height - i - 1) * stride);
+		for (size_t off = 0; off < stride; off += sizeof(tmp)) {
+			size_t n = stride - off < sizeof(tmp) ? stride - off : sizeof(tmp);
+			memcpy(tmp, top + off, n);
+			memcpy(top + off, bottom + off, n);
+			memcpy(bottom + off, tmp, n);
+		}
+	}
 }
 
-static void pwr_on_event(void *data, uint64_t expirations) {
-	struct xdpw_screencast_instance *cast = data;
-	struct pw_buffer *pw_buf;
-	struct spa_buffer *spa_buf;
+static void pwr_fill_header(struct xdpw_screencast_instance *cast,
+		struct spa_buffer *spa_buf) {
 	struct spa_meta_header *h;
-	struct spa_data *d;
+	if ((h = spa_buffer_find_meta_data(spa_buf, SPA_META_Header, sizeof(*h)))) {
+		h->pts = -1;
+		h->flags = 0;
+		h->seq = cast->seq++;
+		h->dts_offset = 0;
+	}
+}
+
+static bool pwr_buffer_matches(struct xdpw_pwr_buffer *pwr_buf,
+		struct xdpw_frame *frame) {
+	return pwr_buf->frame.width == frame->width &&
+		pwr_buf->frame.height == frame->height &&
+		pwr_buf->frame.stride == frame->stride &&
+		pwr_buf->frame.format == frame->format;
+}
+
+// damage of a captured frame in the orientation it is sent in
+static void pwr_frame_damage(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame, struct xdpw_region *damage) {
+	xdpw_region_clear(damage);
+	for (uint32_t i = 0; i < frame->damage.n_rects; i++) {
+		struct xdpw_frame_damage rect = frame->damage.rects[i];
+		if (rect.x >= frame->width || rect.y >= frame->height) {
+			continue;
+		}
+		if (rect.width > frame->width - rect.x) {
+			rect.width = frame->width - rect.x;
+		}
+		if (rect.height > frame->height - rect.y) {
+			rect.height = frame->height - rect.y;
+		}
+		if (frame->y_invert) {
+			rect.y = frame->height - rect.y - rect.height;
+		}
+		if (cast->scaler != NULL) {
+			xdpw_scaler_map_rect(cast->scaler, &rect);
+		}
+		xdpw_region_add_rect(damage, &rect);
+	}
+}
+
+// every buffer but the one being filled falls behind by this damage
+static void pwr_buffers_add_damage(struct xdpw_screencast_instance *cast,
+		struct xdpw_region *damage) {
+	struct xdpw_pwr_buffer *pwr_buf;
+	wl_list_for_each(pwr_buf, &cast->pwr_buffers, link) {
+		xdpw_region_union(&pwr_buf->damage, damage);
+	}
+}
+
+static void pwr_fill_damage(struct spa_buffer *spa_buf,
+		struct xdpw_region *damage) {
+	struct spa_meta *damage_meta = spa_buffer_find_meta(spa_buf, SPA_META_VideoDamage);
+	if (damage_meta == NULL) {
+		return;
+	}
+
+	struct spa_meta_region *r = spa_meta_first(damage_meta);
+	for (uint32_t i = 0; i < damage->n_rects && spa_meta_check(r, damage_meta); i++, r++) {
+		struct xdpw_frame_damage rect = damage->rects[i];
+		if (!spa_meta_check(r + 1, damage_meta) && i + 1 < damage->n_rects) {
+			// out of space, the last region covers everything left
+			for (uint32_t j = i + 1; j < damage->n_rects; j++) {
+				xdpw_frame_damage_union(&rect, &damage->rects[j]);
+			}
+		}
+		r->region = SPA_REGION(rect.x, rect.y, rect.width, rect.height);
+	}
+	// a zero sized region terminates the list
+	if (spa_meta_check(r, damage_meta)) {
+		r->region = SPA_REGION(0, 0, 0, 0);
+	}
+}
+
+bool xdpw_pwr_buffer_shareable(struct xdpw_screencast_instance *cast,
+		struct pw_buffer *pw_buf, struct xdpw_frame *frame) {
+	struct xdpw_pwr_buffer *pwr_buf = pw_buf->user_data;
+	// the compositor can't scale into the shared buffer
+	return cast->scaler == NULL && pwr_buf != NULL && pwr_buf->shared &&
+		pwr_buffer_matches(pwr_buf, frame);
+}
+
+// spare buffers first, they were taken from pipewire but never queued
+static struct pw_buffer *pwr_dequeue_buffer(struct xdpw_screencast_instance *cast) {
+	if (!wl_list_empty(&cast->pwr_spare_buffers)) {
+		struct xdpw_pwr_buffer *pwr_buf =
+			wl_container_of(cast->pwr_spare_buffers.next, pwr_buf, spare_link);
+		wl_list_remove(&pwr_buf->spare_link);
+		pwr_buf->spare = false;
+		return pwr_buf->pw_buffer;
+	}
+	return pw_stream_dequeue_buffer(cast->stream);
+}
+
+static bool pwr_buffer_usable(struct xdpw_screencast_instance *cast,
+		struct pw_buffer *pw_buf) {
+	struct spa_buffer *spa_buf = pw_buf->buffer;
+	uint32_t n_planes = xdpw_convert_is_yuv(cast->pwr_format.format) ?
+		cast->yuv_layout.n_planes : 1;
+
+	if (spa_buf->n_datas < n_planes) {
+		logprint(ERROR, "pipewire: buffer has %u planes, need %u", spa_buf->n_datas, n_planes);
+		return false;
+	}
+	for (uint32_t i = 0; i < n_planes; i++) {
+		if (spa_buf->datas[i].data == NULL) {
+			logprint(TRACE, "pipewire: data pointer undefined");
+			return false;
+		}
+	}
+	return true;
+}
+
+struct pw_buffer *xdpw_pwr_dequeue_shared_buffer(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	if (!cast->pwr_stream_state || cast->scaler != NULL) {
+		return NULL;
+	}
+
+	struct pw_buffer *pw_buf = pwr_dequeue_buffer(cast);
+	if (pw_buf == NULL) {
+		logprint(TRACE, "pipewire: no shared buffer available");
+		return NULL;
+	}
+
+	if (!xdpw_pwr_buffer_shareable(cast, pw_buf, frame)) {
+		logprint(DEBUG, "pipewire: shared buffer doesn't match the frame");
+		xdpw_pwr_return_buffer(cast, pw_buf);
+		return NULL;
+	}
+
+	return pw_buf;
+}
+
+struct pw_buffer *xdpw_pwr_reserve_buffer(struct xdpw_screencast_instance *cast) {
+	if (!cast->pwr_stream_state) {
+		return NULL;
+	}
+	struct pw_buffer *pw_buf = pwr_dequeue_buffer(cast);
+	if (pw_buf == NULL) {
+		logprint(TRACE, "pipewire: consumer holds every buffer");
+	}
+	return pw_buf;
+}
+
+void xdpw_pwr_return_buffer(struct xdpw_screencast_instance *cast,
+		struct pw_buffer *pw_buf) {
+	struct xdpw_pwr_buffer *pwr_buf = pw_buf->user_data;
+	struct spa_data *d = pw_buf->buffer->datas;
+
+	if (pwr_buf != NULL && pwr_buffer_usable(cast, pw_buf)) {
+		// the compositor may have written into it already
+		pwr_buf->stale = true;
+		pwr_buf->spare = true;
+		wl_list_insert(cast->pwr_spare_buffers.prev, &pwr_buf->spare_link);
+		return;
+	}
+
+	// pipewire has no way to take an unused buffer back, a buffer that
+	// can't carry a frame goes to the consumer empty
+	d[0].chunk->size = 0;
+	d[0].chunk->flags = SPA_CHUNK_FLAG_CORRUPTED;
+	pw_stream_queue_buffer(cast->stream, pw_buf);
+}
+
+static void pwr_frame_queued(struct xdpw_screencast_instance *cast,
+		struct timespec *now) {
+	struct xdpw_capture_stats *stats = &cast->capture_stats;
+
+	if (!timespec_is_zero(&stats->buffer_change)) {
+		logprint(INFO, "pipewire: first frame queued %.2f ms after the buffer change",
+			timespec_diff_ns(now, &stats->buffer_change) / 1000000.0);
+		stats->buffer_change = (struct timespec) { 0 };
+	}
+
+	if (!timespec_is_zero(&cast->last_queued)) {
+		double interval_ms = timespec_diff_ns(now, &cast->last_queued) / 1000000.0;
+		stats->intervals++;
+		stats->interval_sum_ms += interval_ms;
+		stats->interval_sq_sum_ms += interval_ms * interval_ms;
+		if (interval_ms > stats->interval_max_ms) {
+			stats->interval_max_ms = interval_ms;
+		}
+	}
+	cast->last_queued = *now;
+}
 
+// runs on the pipewire thread in pwr_on_frames, the main thread keeps
+// dispatching during a copy. The capture being copied is in
+// XDPW_CAPTURE_COPYING, which keeps it and its instance from being torn down,
+// and copies keeps a sink from being destroyed
+static void pwr_copy_unlock(struct xdpw_screencast_instance *cast) {
+	cast->copies++;
+	pw_thread_loop_unlock(cast->ctx->state->pw_thread_loop);
+}
+
+static void pwr_copy_lock(struct xdpw_screencast_instance *cast) {
+	pw_thread_loop_lock(cast->ctx->state->pw_thread_loop);
+	cast->copies--;
+}
+
+static void pwr_queue_shared(struct xdpw_screencast_instance *cast,
+		struct xdpw_capture *capture, struct xdpw_region *damage) {
+	struct pw_buffer *pw_buf = capture->pw_buffer;
+	struct xdpw_pwr_buffer *pwr_buf = pw_buf->user_data;
+	struct xdpw_frame *frame = &capture->frame;
+	struct spa_buffer *spa_buf = pw_buf->buffer;
+	struct spa_data *d = spa_buf->datas;
+
+	capture->pw_buffer = NULL;
+	capture->frame.buffer = NULL;
+	capture->frame.data = NULL;
+
+	pwr_fill_header(cast, spa_buf);
+	pwr_fill_damage(spa_buf, damage);
+
+	// the compositor wrote straight into this buffer, only fix up the orientation
+	if (frame->y_invert) {
+		pwr_copy_unlock(cast);
+		flipFrameData(pwr_buf->frame.data, frame->height, frame->stride);
+		pwr_copy_lock(cast);
+	}
+	pwr_buffers_add_damage(cast, damage);
+	xdpw_region_clear(&pwr_buf->damage);
+	pwr_buf->stale = false;
+
+	d[0].chunk->size = frame->size;
+	d[0].chunk->stride = frame->stride;
+	d[0].chunk->offset = 0;
+	d[0].chunk->flags = SPA_CHUNK_FLAG_NONE;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pwr_frame_queued(cast, &now);
+
+	logprint(TRACE, "pipewire: shared buffer fd %d", (int)d[0].fd);
+	logprint(TRACE, "pipewire: size %d", frame->size);
+	logprint(TRACE, "pipewire: y_invert %d", frame->y_invert);
 	logprint(TRACE, "********************");
-	logprint(TRACE, "pipewire: event fired");
 
-	if ((pw_buf = pw_stream_dequeue_buffer(cast->stream)) == NULL) {
+	pw_stream_queue_buffer(cast->stream, pw_buf);
+}
+
+// the conversion reads whole 2x2 chroma blocks, the scaled frame has to be
+// up to date around the damage as well
+static void pwr_convert_frame(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame, uint8_t *planes[XDPW_YUV_MAX_PLANES],
+		struct xdpw_region *damage) {
+	struct xdpw_frame *src = frame;
+	if (cast->scaler != NULL) {
+		struct xdpw_region grown;
+		if (damage != NULL) {
+			grown = *damage;
+			for (uint32_t i = 0; i < grown.n_rects; i++) {
+				struct xdpw_frame_damage *rect = &grown.rects[i];
+				uint32_t x1 = rect->x + rect->width + 1;
+				uint32_t y1 = rect->y + rect->height + 1;
+				rect->x = rect->x > 0 ? rect->x - 1 : 0;
+				rect->y = rect->y > 0 ? rect->y - 1 : 0;
+				rect->width = x1 - rect->x;
+				rect->height = y1 - rect->y;
+			}
+		}
+		if (xdpw_scaler_scale(cast->scaler, frame, cast->scaled_frame.data,
+				cast->scaled_frame.stride, damage ? &grown : NULL) < 0) {
+			return;
+		}
+		src = &cast->scaled_frame;
+	}
+	xdpw_convert_frame(src, cast->pwr_format.format,
+		cast->pwr_format.color_matrix, cast->pwr_format.color_range,
+		&cast->yuv_layout, planes, damage);
+}
+
+// pw_buf was reserved before the capture, or NULL to take any free buffer
+static void pwr_queue_frame(struct xdpw_screencast_instance *cast,
+		struct pw_buffer *pw_buf, struct xdpw_frame *frame, struct xdpw_region *damage) {
+	struct xdpw_pwr_buffer *pwr_buf;
+	struct spa_buffer *spa_buf;
+	struct spa_data *d;
+	bool yuv = xdpw_convert_is_yuv(cast->pwr_format.format);
+	uint32_t n_planes = yuv ? cast->yuv_layout.n_planes : 1;
+
+	if (pw_buf == NULL && (pw_buf = pwr_dequeue_buffer(cast)) == NULL) {
 		logprint(WARN, "pipewire: out of buffers");
-		goto out;
+		// no buffer got this frame, all of them fall behind by its damage
+		pwr_buffers_add_damage(cast, damage);
+		return;
 	}
 
+	if (!pwr_buffer_usable(cast, pw_buf)) {
+		goto error;
+	}
 	spa_buf = pw_buf->buffer;
 	d = spa_buf->datas;
-	if ((d[0].data) == NULL) {
-		logprint(TRACE, "pipewire: data pointer undefined");
-		goto out;
-	}
-	if ((h = spa_buffer_find_meta_data(spa_buf, SPA_META_Header, sizeof(*h)))) {
-		h->pts = -1;
-		h->flags = 0;
-		h->seq = cast->seq++;
-		h->dts_offset = 0;
+	pwr_fill_header(cast, spa_buf);
+	pwr_fill_damage(spa_buf, damage);
+
+	pwr_buf = pw_buf->user_data;
+	if (yuv) {
+		for (uint32_t i = 0; i < n_planes; i++) {
+			d[i].type = SPA_DATA_MemPtr;
+			d[i].maxsize = cast->yuv_layout.sizes[i];
+			d[i].mapoffset = 0;
+			d[i].flags = 0;
+			d[i].fd = -1;
+			d[i].chunk->size = cast->yuv_layout.sizes[i];
+			d[i].chunk->stride = cast->yuv_layout.strides[i];
+			d[i].chunk->offset = 0;
+			d[i].chunk->flags = SPA_CHUNK_FLAG_NONE;
+		}
+	} else {
+		struct xdpw_frame *out = cast->scaler ? &cast->scaled_frame : frame;
+		// shared buffers keep the memfd description set up in add_buffer
+		if (pwr_buf == NULL || !pwr_buf->shared) {
+			d[0].type = SPA_DATA_MemPtr;
+			d[0].maxsize = out->size;
+			d[0].mapoffset = 0;
+			d[0].flags = 0;
+			d[0].fd = -1;
+		}
+		d[0].chunk->size = out->size;
+		d[0].chunk->stride = out->stride;
+		d[0].chunk->offset = 0;
+		d[0].chunk->flags = SPA_CHUNK_FLAG_NONE;
 	}
 
-	d[0].type = SPA_DATA_MemPtr;
-	d[0].maxsize = cast->simple_frame.size;
-	d[0].mapoffset = 0;
-	d[0].chunk->size = cast->simple_frame.size;
-	d[0].chunk->stride = cast->simple_frame.stride;
-	d[0].chunk->offset = 0;
-	d[0].flags = 0;
-	d[0].fd = -1;
+	struct timespec copy_start, copy_end;
+	clock_gettime(CLOCK_MONOTONIC, &copy_start);
 
-	writeFrameData(d[0].data, cast->simple_frame.data, cast->simple_frame.height,
-		cast->simple_frame.stride, cast->simple_frame.y_invert);
+	// buffers keep their contents, only bring the parts up to date that
+	// changed since this buffer was last sent
+	pwr_buffers_add_damage(cast, damage);
+	uint32_t bpp = xdpw_bpp_from_wl_shm(frame->format);
+	bool full = pwr_buf == NULL || pwr_buf->stale || !pwr_buffer_matches(pwr_buf, frame);
+	// only the pipewire thread touches the buffer, its damage and the
+	// scaler, the lock is needed again for the bookkeeping
+	pwr_copy_unlock(cast);
+	if (yuv) {
+		uint8_t *planes[XDPW_YUV_MAX_PLANES] = { 0 };
+		for (uint32_t i = 0; i < n_planes; i++) {
+			planes[i] = d[i].data;
+		}
+		if (full || !xdpw_region_is_empty(&pwr_buf->damage)) {
+			pwr_convert_frame(cast, frame, planes, full ? NULL : &pwr_buf->damage);
+		}
+	} else if (cast->scaler != NULL) {
+		if (full || !xdpw_region_is_empty(&pwr_buf->damage)) {
+			xdpw_scaler_scale(cast->scaler, frame, d[0].data,
+				cast->scaled_frame.stride, full ? NULL : &pwr_buf->damage);
+		}
+	} else if (full || bpp == 0) {
+		writeFrameData(d[0].data, frame->data, frame->height,
+			frame->stride, frame->y_invert);
+		full = true;
+	} else if (!xdpw_region_is_empty(&pwr_buf->damage)) {
+		writeFrameDamage(d[0].data, frame->data, frame->height,
+			frame->stride, frame->y_invert, bpp, &pwr_buf->damage);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &copy_end);
+	pwr_copy_lock(cast);
+	if (pwr_buf != NULL) {
+		if (full) {
+			pwr_buf->frame.width = frame->width;
+			pwr_buf->frame.height = frame->height;
+			pwr_buf->frame.stride = frame->stride;
+			pwr_buf->frame.format = frame->format;
+			pwr_buf->stale = false;
+		}
+		xdpw_region_clear(&pwr_buf->damage);
+	}
+
+	uint64_t copy_ns = timespec_diff_ns(&copy_end, &copy_start);
+	cast->capture_stats.copies++;
+	cast->capture_stats.copy_ns += copy_ns;
+	if (copy_ns > cast->capture_stats.copy_ns_max) {
+		cast->capture_stats.copy_ns_max = copy_ns;
+	}
+	pwr_frame_queued(cast, &copy_end);
 
 	logprint(TRACE, "pipewire: pointer %p", d[0].data);
 	logprint(TRACE, "pipewire: size %d", d[0].maxsize);
 	logprint(TRACE, "pipewire: stride %d", d[0].chunk->stride);
-	logprint(TRACE, "pipewire: width %d", cast->simple_frame.width);
-	logprint(TRACE, "pipewire: height %d", cast->simple_frame.height);
-	logprint(TRACE, "pipewire: y_invert %d", cast->simple_frame.y_invert);
+	logprint(TRACE, "pipewire: width %d", frame->width);
+	logprint(TRACE, "pipewire: height %d", frame->height);
+	logprint(TRACE, "pipewire: y_invert %d", frame->y_invert);
 	logprint(TRACE, "********************");
 
 	pw_stream_queue_buffer(cast->stream, pw_buf);
+	return;
+
+error:
+	pwr_buffers_add_damage(cast, damage);
+	xdpw_pwr_return_buffer(cast, pw_buf);
+}
+
+static bool pwr_skip_unchanged(struct xdpw_screencast_instance *cast,
+		struct xdpw_region *damage) {
+	struct xdpw_config *config = cast->ctx->state->config;
+	if (config->screencast_conf.unchanged_frames != XDPW_UNCHANGED_FRAMES_SKIP ||
+			!xdpw_region_is_empty(damage)) {
+		return false;
+	}
+
+	// consumers still get a frame every keepalive interval
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t keepalive_ns = (int64_t)config->screencast_conf.keepalive_ms * 1000000;
+	if (keepalive_ns > 0 &&
+			timespec_diff_ns(&now, &cast->last_queued) >= keepalive_ns) {
+		return false;
+	}
+
+	logprint(TRACE, "pipewire: skipping unchanged frame");
+	cast->capture_stats.skipped++;
+	return true;
+}
 
-out:
-	xdpw_wlr_frame_free(cast);
+// streams slower than the capture take the first frame at or after their
+// next due time, with half an output frame of slack for timing jitter
+static bool pwr_decimate(struct xdpw_screencast_instance *cast,
+		double capture_fps, struct timespec *now) {
+	if (cast->max_fps <= 0 || (capture_fps > 0 && cast->max_fps >= capture_fps)) {
+		cast->next_frame_due = (struct timespec) { 0 };
+		return false;
+	}
+
+	int64_t interval_ns = TIMESPEC_NSEC_PER_SEC / cast->max_fps;
+	int64_t slack_ns = cast->framerate > 0 ?
+		TIMESPEC_NSEC_PER_SEC / cast->framerate / 2 : 0;
+	if (!timespec_is_zero(&cast->next_frame_due) &&
+			timespec_diff_ns(&cast->next_frame_due, now) > slack_ns) {
+		return true;
+	}
+
+	// don't try to catch up after a pause
+	if (timespec_is_zero(&cast->next_frame_due) ||
+			timespec_diff_ns(now, &cast->next_frame_due) > interval_ns) {
+		cast->next_frame_due = *now;
+	}
+	timespec_add(&cast->next_frame_due, interval_ns);
+	return false;
+}
+
+// own is set for the stream of the instance that captured the frame, only it
+// can use the shared and reserved buffers of the capture slot
+static void pwr_deliver_frame(struct xdpw_screencast_instance *cast,
+		struct xdpw_capture *capture, bool own, double capture_fps,
+		struct timespec *now) {
+	struct xdpw_region damage;
+	pwr_frame_damage(cast, &capture->frame, &damage);
+
+	if (pwr_decimate(cast, capture_fps, now)) {
+		xdpw_region_union(&cast->pending_damage, &damage);
+		capture->cast->capture_stats.decimated++;
+		return;
+	}
+	xdpw_region_union(&damage, &cast->pending_damage);
+	xdpw_region_clear(&cast->pending_damage);
+
+	if (pwr_skip_unchanged(cast, &damage)) {
+		// borrowed and reserved buffers stay with the capture slot
+	} else if (own && capture->pw_buffer != NULL) {
+		pwr_queue_shared(cast, capture, &damage);
+	} else if (cast->pwr_stream_state) {
+		pwr_queue_frame(cast, own ? capture->reserved : NULL, &capture->frame, &damage);
+		if (own) {
+			capture->reserved = NULL;
+		}
+	}
+}
+
+static void pwr_wake_main(struct xdpw_screencast_context *ctx) {
+	uint64_t one = 1;
+	if (write(ctx->frames_done_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		logprint(ERROR, "pipewire: failed to wake the main thread: %s",
+			strerror(errno));
+	}
+}
+
+// runs on the pipewire thread, the frames go back to the main thread which
+// owns the wayland side of the capture. Only the bookkeeping is done under
+// the lock, see pwr_copy_unlock
+static void pwr_on_frames(void *data, uint64_t expirations) {
+	struct xdpw_screencast_context *ctx = data;
+	bool done = false;
+
+	logprint(TRACE, "********************");
+	logprint(TRACE, "pipewire: event fired");
+
+	struct xdpw_screencast_instance *cast;
+	wl_list_for_each(cast, &ctx->screencast_instances, link) {
+		struct xdpw_capture *capture;
+		// frames arrive in the order they were requested
+		while ((capture = xdpw_spsc_ring_pop(&cast->frames_ready)) != NULL) {
+			// torn down in the meantime
+			if (capture->state != XDPW_CAPTURE_READY) {
+				continue;
+			}
+			if (!cast->quit && !cast->err) {
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				double capture_fps = xdpw_wlr_capture_max_fps(cast);
+
+				// the other streams first, a shared buffer is only
+				// flipped in place once it is queued. Sinks may come
+				// and go while a copy runs without the lock
+				capture->state = XDPW_CAPTURE_COPYING;
+				struct xdpw_screencast_instance *sink;
+				wl_list_for_each(sink, &cast->capture_sinks, capture_sink_link) {
+					if (!sink->quit) {
+						pwr_deliver_frame(sink, capture, false, capture_fps, &now);
+					}
+				}
+				if (!cast->quit && !cast->err) {
+					pwr_deliver_frame(cast, capture, true, capture_fps, &now);
+				}
+				capture->state = XDPW_CAPTURE_READY;
+			}
+			// holds at most the instance's captures, which can't overflow it
+			xdpw_spsc_ring_push(&cast->frames_done, capture);
+			done = true;
+		}
+	}
+
+	if (done) {
+		pwr_wake_main(ctx);
+	}
 }
 
 static void pwr_handle_stream_state_changed(void *data,
@@ -92,11 +614,115 @@ static void pwr_handle_stream_state_changed(void *data,
 	switch (state) {
 	case PW_STREAM_STATE_STREAMING:
 		cast->pwr_stream_state = true;
+		cast->buffer_freed = true;
 		break;
 	default:
 		cast->pwr_stream_state = false;
 		break;
 	}
+	// Start replies once the node id is known
+	pwr_wake_main(cast->ctx);
+}
+
+// the consumer gave a buffer back
+static void pwr_handle_stream_process(void *data) {
+	struct xdpw_screencast_instance *cast = data;
+
+	logprint(TRACE, "pipewire: process event handle");
+	if (!cast->buffer_freed) {
+		cast->buffer_freed = true;
+		pwr_wake_main(cast->ctx);
+	}
+}
+
+static enum spa_video_color_matrix pwr_color_matrix(enum xdpw_yuv_matrix matrix) {
+	switch (matrix) {
+	case XDPW_YUV_MATRIX_BT601:
+		return SPA_VIDEO_COLOR_MATRIX_BT601;
+	case XDPW_YUV_MATRIX_BT709:
+		return SPA_VIDEO_COLOR_MATRIX_BT709;
+	}
+	abort();
+}
+
+static enum spa_video_color_range pwr_color_range(enum xdpw_yuv_range range) {
+	switch (range) {
+	case XDPW_YUV_RANGE_FULL:
+		return SPA_VIDEO_COLOR_RANGE_0_255;
+	case XDPW_YUV_RANGE_LIMITED:
+		return SPA_VIDEO_COLOR_RANGE_16_235;
+	}
+	abort();
+}
+
+static void pwr_destroy_scaler(struct xdpw_screencast_instance *cast) {
+	xdpw_scaler_destroy(cast->scaler);
+	cast->scaler = NULL;
+	free(cast->scaled_frame.data);
+	cast->scaled_frame = (struct xdpw_frame) { 0 };
+}
+
+// frames are sent at the negotiated size, smaller ones are scaled down
+static void pwr_setup_scaler(struct xdpw_screencast_instance *cast) {
+	struct xdpw_frame *frame = &cast->simple_frame;
+	uint32_t width = cast->pwr_format.size.width;
+	uint32_t height = cast->pwr_format.size.height;
+
+	pwr_destroy_scaler(cast);
+	if (width == 0 || height == 0 ||
+			(width == frame->width && height == frame->height)) {
+		return;
+	}
+	if (width > frame->width || height > frame->height ||
+			xdpw_bpp_from_wl_shm(frame->format) != 4) {
+		logprint(WARN, "pipewire: can't scale %ux%u to %ux%u, sending the native size",
+			frame->width, frame->height, width, height);
+		return;
+	}
+
+	cast->scaler = xdpw_scaler_create(frame->width, frame->height, width, height);
+	if (cast->scaler == NULL) {
+		return;
+	}
+	cast->scaled_frame.width = width;
+	cast->scaled_frame.height = height;
+	cast->scaled_frame.stride = SPA_ROUND_UP_N(width * 4, XDPW_PWR_ALIGN);
+	cast->scaled_frame.size = cast->scaled_frame.stride * height;
+	cast->scaled_frame.format = frame->format;
+
+	// YUV conversion reads from a scaled RGB copy
+	if (xdpw_convert_is_yuv(cast->pwr_format.format)) {
+		cast->scaled_frame.data = malloc(cast->scaled_frame.size);
+		if (cast->scaled_frame.data == NULL) {
+			logprint(ERROR, "pipewire: failed to allocate the scaled frame");
+			pwr_destroy_scaler(cast);
+			return;
+		}
+	}
+	logprint(INFO, "pipewire: scaling %ux%u to %ux%u",
+		frame->width, frame->height, width, height);
+}
+
+// pace captures to the lower of the configured and the negotiated rate, the
+// offered maximum is the output's refresh rate and isn't worth limiting to
+static void pwr_update_max_fps(struct xdpw_screencast_instance *cast) {
+	double max_fps = cast->ctx->state->config->screencast_conf.max_fps;
+	struct spa_fraction *rate = &cast->pwr_format.max_framerate;
+
+	if (rate->num > 0 && rate->denom > 0 &&
+			(uint64_t)rate->num < (uint64_t)cast->framerate * rate->denom) {
+		double negotiated = (double)rate->num / rate->denom;
+		if (max_fps <= 0 || negotiated < max_fps) {
+			max_fps = negotiated;
+		}
+	}
+
+	if (max_fps != cast->max_fps && max_fps > 0) {
+		logprint(INFO, "pipewire: pacing captures to %0.2f fps", max_fps);
+	} else if (max_fps != cast->max_fps) {
+		logprint(INFO, "pipewire: pacing captures to the output's refresh rate");
+	}
+	cast->max_fps = max_fps;
 }
 
 static void pwr_handle_stream_param_changed(void *data, uint32_t id,
@@ -106,43 +732,256 @@ static void pwr_handle_stream_param_changed(void *data, uint32_t id,
 	uint8_t params_buffer[1024];
 	struct spa_pod_builder b =
 		SPA_POD_BUILDER_INIT(params_buffer, sizeof(params_buffer));
-	const struct spa_pod *params[2];
+	const struct spa_pod *params[3];
 
 	if (!param || id != SPA_PARAM_Format) {
 		return;
 	}
 
+	// the consumer may leave out the optional max framerate
+	cast->pwr_format.max_framerate = SPA_FRACTION(0, 1);
 	spa_format_video_raw_parse(param, &cast->pwr_format);
+	pwr_update_max_fps(cast);
+	pwr_setup_scaler(cast);
+	struct xdpw_frame *out = cast->scaler ? &cast->scaled_frame : &cast->simple_frame;
 
-	params[0] = spa_pod_builder_add_object(&b,
-		SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
-		SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(XDPW_PWR_BUFFERS, 1, 32),
-		SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(1),
-		SPA_PARAM_BUFFERS_size,    SPA_POD_Int(cast->simple_frame.size),
-		SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(cast->simple_frame.stride),
-		SPA_PARAM_BUFFERS_align,   SPA_POD_Int(XDPW_PWR_ALIGN));
+	if (xdpw_convert_is_yuv(cast->pwr_format.format)) {
+		struct xdpw_config *config = cast->ctx->state->config;
+		if (cast->pwr_format.color_matrix != SPA_VIDEO_COLOR_MATRIX_BT601 &&
+				cast->pwr_format.color_matrix != SPA_VIDEO_COLOR_MATRIX_BT709) {
+			cast->pwr_format.color_matrix = pwr_color_matrix(config->screencast_conf.yuv_matrix);
+		}
+		if (cast->pwr_format.color_range != SPA_VIDEO_COLOR_RANGE_0_255 &&
+				cast->pwr_format.color_range != SPA_VIDEO_COLOR_RANGE_16_235) {
+			cast->pwr_format.color_range = pwr_color_range(config->screencast_conf.yuv_range);
+		}
+		xdpw_convert_layout(cast->pwr_format.format, out->width,
+			out->height, &cast->yuv_layout);
+		logprint(INFO, "pipewire: converting to %s, %s range",
+			cast->pwr_format.format == SPA_VIDEO_FORMAT_NV12 ? "NV12" : "I420",
+			cast->pwr_format.color_range == SPA_VIDEO_COLOR_RANGE_0_255 ? "full" : "limited");
+
+		// one block per plane, the luma plane is the largest
+		params[0] = spa_pod_builder_add_object(&b,
+			SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+			SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(XDPW_PWR_BUFFERS, 1, 32),
+			SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(cast->yuv_layout.n_planes),
+			SPA_PARAM_BUFFERS_size,    SPA_POD_Int(cast->yuv_layout.sizes[0]),
+			SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(cast->yuv_layout.strides[0]),
+			SPA_PARAM_BUFFERS_align,   SPA_POD_Int(XDPW_PWR_ALIGN));
+	} else if (cast->zero_copy) {
+		// one buffer per capture slot plus one held by the consumer
+		params[0] = spa_pod_builder_add_object(&b,
+			SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+			SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(cast->n_captures + 1, 1, 32),
+			SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(1),
+			SPA_PARAM_BUFFERS_size,    SPA_POD_Int(cast->simple_frame.size),
+			SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(cast->simple_frame.stride),
+			SPA_PARAM_BUFFERS_align,   SPA_POD_Int(XDPW_PWR_ALIGN),
+			SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(1 << SPA_DATA_MemFd));
+	} else {
+		params[0] = spa_pod_builder_add_object(&b,
+			SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+			SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(XDPW_PWR_BUFFERS, 1, 32),
+			SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(1),
+			SPA_PARAM_BUFFERS_size,    SPA_POD_Int(out->size),
+			SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(out->stride),
+			SPA_PARAM_BUFFERS_align,   SPA_POD_Int(XDPW_PWR_ALIGN));
+	}
 
 	params[1] = spa_pod_builder_add_object(&b,
 		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
 		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
 		SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header)));
 
-	pw_stream_update_params(stream, params, 2);
+	params[2] = spa_pod_builder_add_object(&b,
+		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage),
+		SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(
+			sizeof(struct spa_meta_region) * XDPW_PWR_DAMAGE_RECTS,
+			sizeof(struct spa_meta_region) * 1,
+			sizeof(struct spa_meta_region) * XDPW_PWR_DAMAGE_RECTS));
+
+	pw_stream_update_params(stream, params, 3);
+}
+
+static int pwr_buffer_share(struct xdpw_screencast_instance *cast,
+		struct xdpw_pwr_buffer *pwr_buf) {
+	struct spa_data *d = pwr_buf->pw_buffer->buffer->datas;
+
+	if ((d[0].type & (1u << SPA_DATA_MemFd)) == 0) {
+		logprint(ERROR, "pipewire: unsupported buffer data type %08x", d[0].type);
+		return -1;
+	}
+
+	enum xdpw_buffer_alloc mode = cast->ctx->state->config->screencast_conf.buffer_alloc;
+	pwr_buf->fd = xdpw_shm_alloc(mode, pwr_buf->frame.size, &pwr_buf->frame.data,
+		&pwr_buf->frame.map_size);
+	if (pwr_buf->fd < 0) {
+		logprint(ERROR, "pipewire: failed to allocate shared buffer");
+		return -1;
+	}
+
+	// libwayland serializes requests from this thread with the main thread,
+	// which only flushes them
+	pwr_buf->frame.buffer = xdpw_wlr_import_shm_buffer(cast, pwr_buf->fd, &pwr_buf->frame);
+	if (pwr_buf->frame.buffer == NULL) {
+		logprint(ERROR, "pipewire: failed to import shared buffer");
+		goto error_mmap;
+	}
+
+	d[0].type = SPA_DATA_MemFd;
+	d[0].flags = SPA_DATA_FLAG_READWRITE;
+	d[0].fd = pwr_buf->fd;
+	d[0].mapoffset = 0;
+	d[0].maxsize = pwr_buf->frame.size;
+	d[0].data = pwr_buf->frame.data;
+
+	pwr_buf->shared = true;
+	logprint(DEBUG, "pipewire: shared buffer fd %d added", pwr_buf->fd);
+	return 0;
+
+error_mmap:
+	munmap(pwr_buf->frame.data, pwr_buf->frame.map_size);
+	close(pwr_buf->fd);
+	return -1;
+}
+
+static void pwr_handle_stream_add_buffer(void *data, struct pw_buffer *buffer) {
+	struct xdpw_screencast_instance *cast = data;
+
+	logprint(TRACE, "pipewire: add buffer event handle");
+
+	struct xdpw_pwr_buffer *pwr_buf = calloc(1, sizeof(*pwr_buf));
+	if (pwr_buf == NULL) {
+		logprint(ERROR, "pipewire: buffer allocation failed");
+		return;
+	}
+	pwr_buf->pw_buffer = buffer;
+	pwr_buf->frame = cast->simple_frame;
+	pwr_buf->frame.buffer = NULL;
+	pwr_buf->frame.data = NULL;
+	pwr_buf->stale = true;
+	pwr_buf->fd = -1;
+
+	if (cast->zero_copy && pwr_buffer_share(cast, pwr_buf) < 0) {
+		free(pwr_buf);
+		return;
+	}
+
+	wl_list_insert(&cast->pwr_buffers, &pwr_buf->link);
+	buffer->user_data = pwr_buf;
+}
+
+static void pwr_handle_stream_remove_buffer(void *data, struct pw_buffer *buffer) {
+	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_pwr_buffer *pwr_buf = buffer->user_data;
+
+	logprint(TRACE, "pipewire: remove buffer event handle");
+
+	if (pwr_buf == NULL) {
+		return;
+	}
+
+	if (pwr_buf->shared) {
+		bool adopted;
+		xdpw_wlr_capture_detach_buffer(cast, buffer, &adopted);
+		if (!adopted) {
+			wl_buffer_destroy(pwr_buf->frame.buffer);
+			munmap(pwr_buf->frame.data, pwr_buf->frame.map_size);
+		}
+		close(pwr_buf->fd);
+		buffer->buffer->datas[0].fd = -1;
+		buffer->buffer->datas[0].data = NULL;
+		logprint(DEBUG, "pipewire: shared buffer removed");
+	}
+
+	if (pwr_buf->spare) {
+		wl_list_remove(&pwr_buf->spare_link);
+	}
+	wl_list_remove(&pwr_buf->link);
+	free(pwr_buf);
+	buffer->user_data = NULL;
 }
 
 static const struct pw_stream_events pwr_stream_events = {
 	PW_VERSION_STREAM_EVENTS,
 	.state_changed = pwr_handle_stream_state_changed,
 	.param_changed = pwr_handle_stream_param_changed,
+	.add_buffer = pwr_handle_stream_add_buffer,
+	.remove_buffer = pwr_handle_stream_remove_buffer,
+	.process = pwr_handle_stream_process,
 };
 
+static void pwr_add_video_size(struct spa_pod_builder *b,
+		struct xdpw_screencast_instance *cast) {
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_size,
+		SPA_POD_CHOICE_RANGE_Rectangle(
+			&SPA_RECTANGLE(cast->simple_frame.width, cast->simple_frame.height),
+			&SPA_RECTANGLE(1, 1),
+			&SPA_RECTANGLE(cast->simple_frame.width, cast->simple_frame.height)),
+		0);
+	// variable framerate
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_framerate,
+		SPA_POD_Fraction(&SPA_FRACTION(0, 1)), 0);
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_maxFramerate,
+		SPA_POD_CHOICE_RANGE_Fraction(
+			&SPA_FRACTION(cast->framerate, 1),
+			&SPA_FRACTION(1, 1),
+			&SPA_FRACTION(cast->framerate, 1)),
+		0);
+}
+
+static const struct spa_pod *pwr_build_rgb_format(struct spa_pod_builder *b,
+		struct xdpw_screencast_instance *cast) {
+	enum spa_video_format format = xdpw_format_pw_from_wl_shm(cast);
+	enum spa_video_format format_without_alpha =
+		xdpw_format_pw_strip_alpha(format);
+
+	struct spa_pod_frame f;
+	spa_pod_builder_push_object(b, &f, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+	spa_pod_builder_add(b, SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video), 0);
+	spa_pod_builder_add(b, SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw), 0);
+	if (format_without_alpha != SPA_VIDEO_FORMAT_UNKNOWN) {
+		spa_pod_builder_add(b, SPA_FORMAT_VIDEO_format,
+			SPA_POD_CHOICE_ENUM_Id(3, format, format, format_without_alpha), 0);
+	} else {
+		spa_pod_builder_add(b, SPA_FORMAT_VIDEO_format,
+			SPA_POD_CHOICE_ENUM_Id(2, format, format), 0);
+	}
+	pwr_add_video_size(b, cast);
+	return spa_pod_builder_pop(b, &f);
+}
+
+// converted formats, the config picks the defaults for consumers without a preference
+static const struct spa_pod *pwr_build_yuv_format(struct spa_pod_builder *b,
+		struct xdpw_screencast_instance *cast) {
+	struct config_screencast *conf = &cast->ctx->state->config->screencast_conf;
+	enum spa_video_color_matrix matrix = pwr_color_matrix(conf->yuv_matrix);
+	enum spa_video_color_range range = pwr_color_range(conf->yuv_range);
+
+	struct spa_pod_frame f;
+	spa_pod_builder_push_object(b, &f, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+	spa_pod_builder_add(b, SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video), 0);
+	spa_pod_builder_add(b, SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw), 0);
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_format,
+		SPA_POD_CHOICE_ENUM_Id(3, SPA_VIDEO_FORMAT_NV12,
+			SPA_VIDEO_FORMAT_NV12, SPA_VIDEO_FORMAT_I420), 0);
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_colorMatrix,
+		SPA_POD_CHOICE_ENUM_Id(3, matrix,
+			SPA_VIDEO_COLOR_MATRIX_BT601, SPA_VIDEO_COLOR_MATRIX_BT709), 0);
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_colorRange,
+		SPA_POD_CHOICE_ENUM_Id(3, range,
+			SPA_VIDEO_COLOR_RANGE_16_235, SPA_VIDEO_COLOR_RANGE_0_255), 0);
+	pwr_add_video_size(b, cast);
+	return spa_pod_builder_pop(b, &f);
+}
+
 void xdpw_pwr_stream_init(struct xdpw_screencast_instance *cast) {
 	struct xdpw_screencast_context *ctx = cast->ctx;
 	struct xdpw_state *state = ctx->state;
 
-	pw_loop_enter(state->pw_loop);
-
-	uint8_t buffer[1024];
+	uint8_t buffer[2048];
 	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 
 	char name[] = "xdpw-stream-XXXXXX";
@@ -157,56 +996,39 @@ void xdpw_pwr_stream_init(struct xdpw_screencast_instance *cast) {
 		abort();
 	}
 	cast->pwr_stream_state = false;
+	cast->zero_copy = state->config->screencast_conf.zero_copy;
+	wl_list_init(&cast->pwr_buffers);
+	wl_list_init(&cast->pwr_spare_buffers);
 
-	/* make an event to signal frame ready */
-	cast->event =
-		pw_loop_add_event(state->pw_loop, pwr_on_event, cast);
-	logprint(DEBUG, "pipewire: registered event %p", cast->event);
-
-	enum spa_video_format format = xdpw_format_pw_from_wl_shm(cast);
-	enum spa_video_format format_without_alpha =
-		xdpw_format_pw_strip_alpha(format);
-
-	struct spa_pod_frame f;
-	spa_pod_builder_push_object(&b, &f, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
-	spa_pod_builder_add(&b, SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video), 0);
-	spa_pod_builder_add(&b, SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw), 0);
-	if (format_without_alpha != SPA_VIDEO_FORMAT_UNKNOWN) {
-		spa_pod_builder_add(&b, SPA_FORMAT_VIDEO_format,
-			SPA_POD_CHOICE_ENUM_Id(3, format, format, format_without_alpha), 0);
-	} else {
-		spa_pod_builder_add(&b, SPA_FORMAT_VIDEO_format,
-			SPA_POD_CHOICE_ENUM_Id(2, format, format), 0);
+	const struct spa_pod *params[2];
+	uint32_t n_params = 0;
+	params[n_params++] = pwr_build_rgb_format(&b, cast);
+	if (state->config->screencast_conf.yuv_formats) {
+		if (cast->zero_copy) {
+			logprint(WARN, "pipewire: yuv formats aren't available with zero copy");
+		} else if (!xdpw_convert_supported(cast->simple_frame.format)) {
+			logprint(WARN, "pipewire: can't convert the output format to yuv");
+		} else {
+			params[n_params++] = pwr_build_yuv_format(&b, cast);
+		}
 	}
-	spa_pod_builder_add(&b, SPA_FORMAT_VIDEO_size,
-		SPA_POD_CHOICE_RANGE_Rectangle(
-			&SPA_RECTANGLE(cast->simple_frame.width, cast->simple_frame.height),
-			&SPA_RECTANGLE(1, 1),
-			&SPA_RECTANGLE(4096, 4096)),
-		0);
-	// variable framerate
-	spa_pod_builder_add(&b, SPA_FORMAT_VIDEO_framerate,
-		SPA_POD_Fraction(&SPA_FRACTION(0, 1)), 0);
-	spa_pod_builder_add(&b, SPA_FORMAT_VIDEO_maxFramerate,
-		SPA_POD_CHOICE_RANGE_Fraction(
-			&SPA_FRACTION(cast->framerate, 1),
-			&SPA_FRACTION(1, 1),
-			&SPA_FRACTION(cast->framerate, 1)),
-		0);
-	const struct spa_pod *param = spa_pod_builder_pop(&b, &f);
 
 	pw_stream_add_listener(cast->stream, &cast->stream_listener,
 		&pwr_stream_events, cast);
 
+	enum pw_stream_flags flags = PW_STREAM_FLAG_DRIVER | PW_STREAM_FLAG_MAP_BUFFERS;
+	if (cast->zero_copy) {
+		flags |= PW_STREAM_FLAG_ALLOC_BUFFERS;
+	}
+
 	pw_stream_connect(cast->stream,
 		PW_DIRECTION_OUTPUT,
 		PW_ID_ANY,
-		(PW_STREAM_FLAG_DRIVER |
-			PW_STREAM_FLAG_MAP_BUFFERS),
-		&param, 1);
+		flags,
+		params, n_params);
 }
 
-int xdpw_pwr_core_connect(struct xdpw_state *state) {
+static int pwr_core_connect(struct xdpw_state *state) {
 	struct xdpw_screencast_context *ctx = &state->screencast;
 
 	logprint(DEBUG, "pipewire: establishing connection to core");
@@ -226,6 +1048,58 @@ int xdpw_pwr_core_connect(struct xdpw_state *state) {
 			return -1;
 		}
 	}
+
+	/* make an event to signal frames ready */
+	if (!ctx->frames_event) {
+		ctx->frames_event = pw_loop_add_event(state->pw_loop, pwr_on_frames, ctx);
+		if (!ctx->frames_event) {
+			logprint(ERROR, "pipewire: failed to add the frame event");
+			return -1;
+		}
+		logprint(DEBUG, "pipewire: registered event %p", ctx->frames_event);
+	}
+	return 0;
+}
+
+static int pwr_core_connect_cb(struct spa_loop *loop, bool async, uint32_t seq,
+		const void *data, size_t size, void *user_data) {
+	struct xdpw_state *state = user_data;
+	struct xdpw_screencast_context *ctx = &state->screencast;
+
+	ctx->pwr_core_err = pwr_core_connect(state);
+	ctx->pwr_core_done = true;
+	if (ctx->pwr_core_err == 0) {
+		xdpw_startup_report(state, "pipewire connected");
+	}
+	// Start calls waiting for the connection go on
+	pwr_wake_main(ctx);
+	return 0;
+}
+
+int xdpw_pwr_core_connect(struct xdpw_state *state) {
+	struct xdpw_screencast_context *ctx = &state->screencast;
+
+	// the event loop watches it from the start
+	if (ctx->frames_done_fd < 0) {
+		ctx->frames_done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (ctx->frames_done_fd < 0) {
+			logprint(ERROR, "pipewire: failed to create the frame eventfd: %s",
+				strerror(errno));
+			return -1;
+		}
+	}
+
+	// loading the context's modules and connecting runs alongside the
+	// wayland setup, the lock covers the case of the thread not having
+	// entered its loop yet, where the call runs right here
+	pw_thread_loop_lock(state->pw_thread_loop);
+	int ret = pw_loop_invoke(state->pw_loop, pwr_core_connect_cb, 0, NULL, 0,
+		false, state);
+	pw_thread_loop_unlock(state->pw_thread_loop);
+	if (ret < 0) {
+		logprint(ERROR, "pipewire: failed to queue the connection: %s", spa_strerror(ret));
+		return -1;
+	}
 	return 0;
 }
 
@@ -235,4 +1109,5 @@ void xdpw_pwr_stream_destroy(struct xdpw_screencast_instance *cast) {
 	pw_stream_disconnect(cast->stream);
 	pw_stream_destroy(cast->stream);
 	cast->stream = NULL;
+	pwr_destroy_scaler(cast);
 }
@@ -8,16 +8,42 @@
 #include <assert.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <spa/utils/result.h>
 
+#include "frame_convert.h"
+#include "frame_copy.h"
 #include "pipewire_screencast.h"
 #include "wlr_screencast.h"
 #include "xdpw.h"
 #include "logger.h"
+#include "timespec_util.h"
 
 static const char object_path[] = "/org/freedesktop/portal/desktop";
 static const char interface_name[] = "org.freedesktop.impl.portal.ScreenCast";
 
+#define XDPW_START_TIMEOUT_SEC 5
+
+// a Start call answered once pipewire assigned the node ids
+struct xdpw_start {
+	struct xdpw_session *sess;
+	sd_bus_message *msg;
+	struct xdpw_timer *timeout;
+	// the handshake is measured from the call to the reply
+	struct timespec started;
+	struct rusage usage;
+};
+
+// a SelectSources call answered once the output chooser is done
+struct xdpw_select_sources {
+	struct xdpw_session *sess;
+	sd_bus_message *msg;
+	bool cursor_embedded;
+	size_t max_outputs;
+	// NULL until the wayland setup is done
+	struct xdpw_output_chooser_run *chooser;
+};
+
 void exec_with_shell(char *command) {
 	pid_t pid = fork();
 	if (pid < 0) {
@@ -37,7 +63,8 @@ void exec_with_shell(char *command) {
 }
 
 void xdpw_screencast_instance_init(struct xdpw_screencast_context *ctx,
-		struct xdpw_screencast_instance *cast, struct xdpw_wlr_output *out, bool with_cursor) {
+		struct xdpw_screencast_instance *cast, struct xdpw_wlr_output *out,
+		struct xdpw_output_region *region, bool with_cursor) {
 
 	// only run exec_before if there's no other instance running that already ran it
 	if (wl_list_empty(&ctx->screencast_instances)) {
@@ -51,14 +78,53 @@ void xdpw_screencast_instance_init(struct xdpw_screencast_context *ctx,
 	cast->ctx = ctx;
 	cast->target_output = out;
 	cast->framerate = out->framerate;
+	cast->max_fps = ctx->state->config->screencast_conf.max_fps;
 	cast->with_cursor = with_cursor;
+	cast->region = *region;
 	cast->refcount = 1;
+	wl_list_init(&cast->capture_sinks);
+	wl_list_init(&cast->capture_sink_link);
+	xdpw_wlr_capture_init(cast, ctx->state->config->screencast_conf.capture_buffers);
 	logprint(INFO, "xdpw: screencast instance %p has %d references", cast, cast->refcount);
 	wl_list_insert(&ctx->screencast_instances, &cast->link);
 	logprint(INFO, "xdpw: %d active screencast instances",
 		wl_list_length(&ctx->screencast_instances));
 }
 
+// a remaining sink takes over the capture loop of a source that goes away,
+// its own capture ring has been idle so far and starts now. A sink without a
+// stream yet gets one on Start, with the frame parameters of its own captures
+static void promote_capture_sink(struct xdpw_screencast_instance *cast) {
+	if (wl_list_empty(&cast->capture_sinks)) {
+		return;
+	}
+
+	// prefer a sink whose stream is already running
+	struct xdpw_screencast_instance *source =
+		wl_container_of(cast->capture_sinks.next, source, capture_sink_link);
+	struct xdpw_screencast_instance *sink, *tmp;
+	wl_list_for_each(sink, &cast->capture_sinks, capture_sink_link) {
+		if (sink->initialized) {
+			source = sink;
+			break;
+		}
+	}
+	wl_list_remove(&source->capture_sink_link);
+	wl_list_init(&source->capture_sink_link);
+	source->capture_source = NULL;
+
+	wl_list_for_each_safe(sink, tmp, &cast->capture_sinks, capture_sink_link) {
+		wl_list_remove(&sink->capture_sink_link);
+		wl_list_insert(source->capture_sinks.prev, &sink->capture_sink_link);
+		sink->capture_source = source;
+	}
+	wl_list_init(&cast->capture_sinks);
+
+	logprint(INFO, "xdpw: screencast instance %p takes over capturing from %p",
+		source, cast);
+	xdpw_wlr_register_cb(source);
+}
+
 void xdpw_screencast_instance_destroy(struct xdpw_screencast_instance *cast) {
 	assert(cast->refcount == 0); // Fails assert if called by screencast_finish
 	logprint(DEBUG, "xdpw: destroying cast instance");
@@ -73,71 +139,154 @@ void xdpw_screencast_instance_destroy(struct xdpw_screencast_instance *cast) {
 	}
 
 	wl_list_remove(&cast->link);
-	xdpw_pwr_stream_destroy(cast);
+	wl_list_remove(&cast->capture_sink_link);
+	promote_capture_sink(cast);
+	if (cast->initialized) {
+		xdpw_pwr_stream_destroy(cast);
+	}
 	free(cast);
 }
 
-bool setup_outputs(struct xdpw_screencast_context *ctx, struct xdpw_session *sess, bool with_cursor) {
-
-	struct xdpw_wlr_output *output, *tmp_o;
-	wl_list_for_each_reverse_safe(output, tmp_o, &ctx->output_list, link) {
-		logprint(INFO, "wlroots: capturable output: %s model: %s: id: %i name: %s",
-			output->make, output->model, output->id, output->name);
-	}
-
-	struct xdpw_wlr_output *out;
-	out = xdpw_wlr_output_chooser(ctx);
-	if (!out) {
-		logprint(ERROR, "wlroots: no output found");
-		return false;
-	}
 
+static void setup_output(struct xdpw_screencast_context *ctx, struct xdpw_session *sess,
+		struct xdpw_wlr_output *out, struct xdpw_output_region *region, bool with_cursor) {
+	// every session gets its own stream, sessions of the same output share
+	// the capture loop of one that is running. One that didn't start yet
+	// might never, its session can close first
+	struct xdpw_screencast_instance *source = NULL;
 	struct xdpw_screencast_instance *cast, *tmp_c;
 	wl_list_for_each_reverse_safe(cast, tmp_c, &ctx->screencast_instances, link) {
 		logprint(INFO, "xdpw: existing screencast instance: %d %s cursor",
 			cast->target_output->id,
 			cast->with_cursor ? "with" : "without");
 
-		if (cast->target_output->id == out->id && cast->with_cursor == with_cursor) {
-			if (cast->refcount == 0) {
+		if (cast->target_output->id == out->id && cast->with_cursor == with_cursor &&
+				xdpw_output_region_equal(&cast->region, region) &&
+				cast->capture_source == NULL) {
+			if (cast->refcount == 0 || cast->quit || cast->err) {
 				logprint(DEBUG,
 					"xdpw: matching cast instance found, "
 					"but is already scheduled for destruction, skipping");
+			} else if (!cast->initialized) {
+				logprint(DEBUG,
+					"xdpw: matching cast instance found, "
+					"but it isn't capturing yet, skipping");
+			} else {
+				source = cast;
 			}
-			else {
-				sess->screencast_instance = cast;
-				++cast->refcount;
-			}
-			logprint(INFO, "xdpw: screencast instance %p now has %d references",
-				cast, cast->refcount);
 		}
 	}
 
-	if (!sess->screencast_instance) {
-		sess->screencast_instance = calloc(1, sizeof(struct xdpw_screencast_instance));
-		xdpw_screencast_instance_init(ctx, sess->screencast_instance,
-			out, with_cursor);
+	cast = calloc(1, sizeof(struct xdpw_screencast_instance));
+	xdpw_screencast_instance_init(ctx, cast, out, region, with_cursor);
+	if (source != NULL) {
+		cast->capture_source = source;
+		wl_list_insert(source->capture_sinks.prev, &cast->capture_sink_link);
+		// later changes are passed on by the source's buffer events
+		cast->simple_frame.width = source->simple_frame.width;
+		cast->simple_frame.height = source->simple_frame.height;
+		cast->simple_frame.stride = source->simple_frame.stride;
+		cast->simple_frame.size = source->simple_frame.size;
+		cast->simple_frame.format = source->simple_frame.format;
+		logprint(INFO, "xdpw: screencast instance %p captures for %p", source, cast);
+	}
+	sess->screencast_instances[sess->n_screencast_instances++] = cast;
+
+	logprint(INFO, "wlroots: output: %s", cast->target_output->name);
+	if (!xdpw_output_region_is_empty(region)) {
+		logprint(INFO, "wlroots: region: %d,%d %dx%d",
+			region->x, region->y, region->width, region->height);
+	}
+}
+
+bool setup_outputs(struct xdpw_screencast_context *ctx, struct xdpw_session *sess,
+		bool with_cursor, struct xdpw_wlr_output **outs,
+		struct xdpw_output_region *regions, size_t n_outs) {
+
+	struct xdpw_wlr_output *output, *tmp_o;
+	wl_list_for_each_reverse_safe(output, tmp_o, &ctx->output_list, link) {
+		logprint(INFO, "wlroots: capturable output: %s model: %s: id: %i name: %s",
+			output->make, output->model, output->id, output->name);
+	}
+
+	if (sess->n_screencast_instances > 0) {
+		logprint(ERROR, "xdpw: sources of session %s already selected",
+			sess->session_handle);
+		return false;
+	}
+
+	if (n_outs == 0) {
+		logprint(ERROR, "wlroots: no output found");
+		return false;
+	}
+
+	for (size_t i = 0; i < n_outs; i++) {
+		bool duplicate = false;
+		for (size_t j = 0; j < i; j++) {
+			duplicate |= outs[j] == outs[i] &&
+				xdpw_output_region_equal(&regions[j], &regions[i]);
+		}
+		if (duplicate) {
+			logprint(WARN, "wlroots: output %s selected twice, skipping", outs[i]->name);
+			continue;
+		}
+		setup_output(ctx, sess, outs[i], &regions[i], with_cursor);
 	}
-	logprint(INFO, "wlroots: output: %s",
-		sess->screencast_instance->target_output->name);
 
 	return true;
 
 }
 
-static int start_screencast(struct xdpw_screencast_instance *cast) {
-	xdpw_wlr_register_cb(cast);
-
-	// process at least one frame so that we know
-	// some of the metadata required for the pipewire
-	// remote state connected event
-	wl_display_dispatch(cast->ctx->state->wl_display);
-	wl_display_roundtrip(cast->ctx->state->wl_display);
+// the first frames of all root captures are requested at once, so a session
+// of several outputs gets its buffer parameters within one frame interval.
+// The streams are set up by xdpw_screencast_check_starts once they are known
+static void start_captures(struct xdpw_screencast_instance **casts, uint32_t n_casts) {
+	for (uint32_t i = 0; i < n_casts; i++) {
+		// sinks are attached to running sources only, and the session holds
+		// a reference to each of its own, so none of them is torn down here
+		struct xdpw_screencast_instance *cast = casts[i];
+		if (cast->capture_source == NULL && !cast->initialized && !cast->err) {
+			xdpw_wlr_register_cb(cast);
+		}
+	}
+}
 
-	xdpw_pwr_stream_init(cast);
+// returns 1 once all streams of the session have their node ids, 0 while
+// that is still pending and -1 if the session can't be started
+static int start_streams(struct xdpw_screencast_context *ctx, struct xdpw_session *sess) {
+	if (!ctx->pwr_core_done) {
+		return 0;
+	}
+	if (ctx->pwr_core_err < 0) {
+		logprint(ERROR, "xdpw: pipewire is not available");
+		return -1;
+	}
 
-	cast->initialized = true;
-	return 0;
+	bool ready = true;
+	for (uint32_t i = 0; i < sess->n_screencast_instances; i++) {
+		struct xdpw_screencast_instance *cast = sess->screencast_instances[i];
+		struct xdpw_screencast_instance *source = cast->capture_source != NULL ?
+			cast->capture_source : cast;
+		if (source->err) {
+			logprint(ERROR, "xdpw: capture of output %s failed",
+				source->target_output->name);
+			return -1;
+		}
+		if (!source->initialized) {
+			if (source->simple_frame.width == 0) {
+				ready = false;
+				continue;
+			}
+			xdpw_pwr_stream_init(source);
+			source->initialized = true;
+		}
+		if (!cast->initialized) {
+			xdpw_pwr_stream_init(cast);
+			cast->initialized = true;
+		}
+		ready &= cast->node_id != 0;
+	}
+	return ready;
 }
 
 static int method_screencast_create_session(sd_bus_message *msg, void *data,
@@ -224,6 +373,111 @@ static int method_screencast_create_session(sd_bus_message *msg, void *data,
 	return 0;
 }
 
+static int reply_response(sd_bus_message *msg, uint32_t response) {
+	sd_bus_message *reply = NULL;
+	int ret = sd_bus_message_new_method_return(msg, &reply);
+	if (ret < 0) {
+		return ret;
+	}
+	ret = sd_bus_message_append(reply, "ua{sv}", response, 0);
+	if (ret < 0) {
+		sd_bus_message_unref(reply);
+		return ret;
+	}
+	ret = sd_bus_send(NULL, reply, NULL);
+	sd_bus_message_unref(reply);
+	return ret < 0 ? ret : 0;
+}
+
+static void select_sources_free(struct xdpw_select_sources *select) {
+	select->sess->select_sources = NULL;
+	sd_bus_message_unref(select->msg);
+	free(select);
+}
+
+static void select_sources_done(struct xdpw_wlr_output **outputs,
+		struct xdpw_output_region *regions, size_t n_outputs, void *data) {
+	struct xdpw_select_sources *select = data;
+	struct xdpw_session *sess = select->sess;
+	struct xdpw_state *state = sess->state;
+
+	pw_thread_loop_lock(state->pw_thread_loop);
+	bool selected = n_outputs > 0 && setup_outputs(&state->screencast, sess,
+		select->cursor_embedded, outputs, regions, n_outputs);
+	pw_thread_loop_unlock(state->pw_thread_loop);
+
+	int ret = reply_response(select->msg,
+		selected ? PORTAL_RESPONSE_SUCCESS : PORTAL_RESPONSE_CANCELLED);
+	if (ret < 0) {
+		logprint(ERROR, "dbus: failed to reply to select sources: %s", strerror(-ret));
+	}
+	select_sources_free(select);
+}
+
+static void start_free(struct xdpw_start *start) {
+	start->sess->start = NULL;
+	xdpw_destroy_timer(start->timeout);
+	sd_bus_message_unref(start->msg);
+	free(start);
+}
+
+static double timeval_diff_ms(struct timeval *t1, struct timeval *t2) {
+	return (t1->tv_sec - t2->tv_sec) * 1000.0 + (t1->tv_usec - t2->tv_usec) / 1000.0;
+}
+
+// cpu time is counted for the whole process, pipewire's thread included
+static void start_report(struct xdpw_start *start, const char *result) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	logprint(INFO, "xdpw: start %s after %.2f ms, %.2f ms cpu time", result,
+		timespec_diff_ns(&now, &start->started) / 1000000.0,
+		timeval_diff_ms(&usage.ru_utime, &start->usage.ru_utime) +
+		timeval_diff_ms(&usage.ru_stime, &start->usage.ru_stime));
+}
+
+static bool select_sources_start_chooser(struct xdpw_select_sources *select) {
+	struct xdpw_screencast_context *ctx = &select->sess->state->screencast;
+	if (ctx->init_err < 0) {
+		return false;
+	}
+	select->chooser = xdpw_wlr_output_chooser_start(ctx, select->max_outputs,
+		select_sources_done, select);
+	return select->chooser != NULL;
+}
+
+void xdpw_screencast_setup_done(struct xdpw_state *state) {
+	struct xdpw_session *sess, *tmp_s;
+	wl_list_for_each_safe(sess, tmp_s, &state->xdpw_sessions, link) {
+		struct xdpw_select_sources *select = sess->select_sources;
+		if (select == NULL || select->chooser != NULL) {
+			continue;
+		}
+		if (!select_sources_start_chooser(select)) {
+			reply_response(select->msg, PORTAL_RESPONSE_CANCELLED);
+			select_sources_free(select);
+		}
+	}
+}
+
+void xdpw_screencast_cancel_requests(struct xdpw_session *sess) {
+	struct xdpw_select_sources *select = sess->select_sources;
+	if (select != NULL) {
+		xdpw_wlr_output_chooser_cancel(select->chooser);
+		reply_response(select->msg, PORTAL_RESPONSE_CANCELLED);
+		select_sources_free(select);
+	}
+
+	struct xdpw_start *start = sess->start;
+	if (start != NULL) {
+		reply_response(start->msg, PORTAL_RESPONSE_CANCELLED);
+		start_report(start, "canceled");
+		start_free(start);
+	}
+}
+
 static int method_screencast_select_sources(sd_bus_message *msg, void *data,
 		sd_bus_error *ret_error) {
 	struct xdpw_state *state = data;
@@ -237,6 +491,7 @@ static int method_screencast_select_sources(sd_bus_message *msg, void *data,
 
 	// default to embedded cursor mode if not specified
 	bool cursor_embedded = true;
+	bool multiple = false;
 
 	char *request_handle, *session_handle, *app_id;
 	ret = sd_bus_message_read(msg, "oos", &request_handle, &session_handle, &app_id);
@@ -261,8 +516,9 @@ static int method_screencast_select_sources(sd_bus_message *msg, void *data,
 		}
 
 		if (strcmp(key, "multiple") == 0) {
-			bool multiple;
-			sd_bus_message_read(msg, "v", "b", &multiple);
+			int multiple_opt;
+			sd_bus_message_read(msg, "v", "b", &multiple_opt);
+			multiple = multiple_opt;
 			logprint(INFO, "dbus: option multiple: %x", multiple);
 		} else if (strcmp(key, "types") == 0) {
 			uint32_t mask;
@@ -301,31 +557,38 @@ static int method_screencast_select_sources(sd_bus_message *msg, void *data,
 		return ret;
 	}
 
-	bool output_selection_canceled = 1;
+	struct xdpw_session *found = NULL;
 	wl_list_for_each_reverse_safe(sess, tmp_s, &state->xdpw_sessions, link) {
 		if (strcmp(sess->session_handle, session_handle) == 0) {
 				logprint(DEBUG, "dbus: select sources: found matching session %s", sess->session_handle);
-				output_selection_canceled = !setup_outputs(ctx, sess, cursor_embedded);
+				found = sess;
 		}
 	}
-
-	ret = sd_bus_message_new_method_return(msg, &reply);
-	if (ret < 0) {
-		return ret;
+	if (found == NULL || found->select_sources != NULL) {
+		return reply_response(msg, PORTAL_RESPONSE_CANCELLED);
 	}
-	if (output_selection_canceled) {
-		ret = sd_bus_message_append(reply, "ua{sv}", PORTAL_RESPONSE_CANCELLED, 0);
-	} else {
-		ret = sd_bus_message_append(reply, "ua{sv}", PORTAL_RESPONSE_SUCCESS, 0);
+
+	// the reply waits for the chooser, running screencasts go on meanwhile
+	struct xdpw_select_sources *select = calloc(1, sizeof(*select));
+	if (select == NULL) {
+		return -ENOMEM;
 	}
-	if (ret < 0) {
-		return ret;
+	select->sess = found;
+	select->msg = sd_bus_message_ref(msg);
+	select->cursor_embedded = cursor_embedded;
+	select->max_outputs = multiple ? XDPW_SESSION_MAX_SOURCES : 1;
+	found->select_sources = select;
+
+	// the outputs are known once the wayland setup is done, which starts
+	// the chooser then
+	if (ctx->init_stage != XDPW_WLR_INIT_DONE) {
+		logprint(DEBUG, "xdpw: select sources waits for the wayland setup");
+		return 0;
 	}
-	ret = sd_bus_send(NULL, reply, NULL);
-	if (ret < 0) {
-		return ret;
+	if (!select_sources_start_chooser(select)) {
+		select_sources_free(select);
+		return reply_response(msg, PORTAL_RESPONSE_CANCELLED);
 	}
-	sd_bus_message_unref(reply);
 	return 0;
 
 error:
@@ -352,6 +615,124 @@ error:
 	return -1;
 }
 
+// the stream's place in the compositor's logical coordinates, the frames
+// are in pixels and larger on a scaled output
+static void stream_logical_rect(struct xdpw_screencast_instance *cast,
+		struct xdpw_output_region *rect) {
+	struct xdpw_wlr_output *out = cast->target_output;
+	if (!xdpw_output_region_is_empty(&cast->region)) {
+		*rect = cast->region;
+	} else if (out->width > 0 && out->height > 0) {
+		*rect = (struct xdpw_output_region) {
+			.width = out->width,
+			.height = out->height,
+		};
+	} else {
+		// without xdg-output the layout is unknown
+		*rect = (struct xdpw_output_region) {
+			.width = cast->simple_frame.width,
+			.height = cast->simple_frame.height,
+		};
+	}
+	rect->x += out->x;
+	rect->y += out->y;
+}
+
+static int start_reply(struct xdpw_start *start) {
+	struct xdpw_session *sess = start->sess;
+	sd_bus_message *reply = NULL;
+	int ret = sd_bus_message_new_method_return(start->msg, &reply);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = sd_bus_message_append(reply, "u", PORTAL_RESPONSE_SUCCESS);
+	if (ret < 0) {
+		goto out;
+	}
+	ret = sd_bus_message_open_container(reply, 'a', "{sv}");
+	if (ret < 0) {
+		goto out;
+	}
+	ret = sd_bus_message_open_container(reply, 'e', "sv");
+	if (ret < 0) {
+		goto out;
+	}
+	ret = sd_bus_message_append(reply, "s", "streams");
+	if (ret < 0) {
+		goto out;
+	}
+	ret = sd_bus_message_open_container(reply, 'v', "a(ua{sv})");
+	if (ret < 0) {
+		goto out;
+	}
+	ret = sd_bus_message_open_container(reply, 'a', "(ua{sv})");
+	if (ret < 0) {
+		goto out;
+	}
+	for (uint32_t i = 0; i < sess->n_screencast_instances; i++) {
+		struct xdpw_screencast_instance *cast = sess->screencast_instances[i];
+		struct xdpw_output_region rect;
+		stream_logical_rect(cast, &rect);
+		ret = sd_bus_message_append(reply, "(ua{sv})",
+			cast->node_id, 2,
+			"position", "(ii)", rect.x, rect.y,
+			"size", "(ii)", rect.width, rect.height);
+		if (ret < 0) {
+			goto out;
+		}
+	}
+	for (int i = 0; i < 4; i++) {
+		ret = sd_bus_message_close_container(reply);
+		if (ret < 0) {
+			goto out;
+		}
+	}
+
+	ret = sd_bus_send(NULL, reply, NULL);
+
+out:
+	sd_bus_message_unref(reply);
+	return ret < 0 ? ret : 0;
+}
+
+void xdpw_screencast_check_starts(struct xdpw_state *state) {
+	pw_thread_loop_lock(state->pw_thread_loop);
+	struct xdpw_session *sess, *tmp_s;
+	wl_list_for_each_safe(sess, tmp_s, &state->xdpw_sessions, link) {
+		struct xdpw_start *start = sess->start;
+		if (start == NULL) {
+			continue;
+		}
+		int ready = start_streams(&state->screencast, sess);
+		if (ready == 0) {
+			continue;
+		}
+
+		int ret = ready > 0 ? start_reply(start) :
+			reply_response(start->msg, PORTAL_RESPONSE_ENDED);
+		if (ret < 0) {
+			logprint(ERROR, "dbus: failed to reply to start: %s", strerror(-ret));
+		}
+		start_report(start, ready > 0 ? "replied" : "failed");
+		start_free(start);
+	}
+	pw_thread_loop_unlock(state->pw_thread_loop);
+}
+
+static void start_timeout_cb(void *data) {
+	struct xdpw_start *start = data;
+	start->timeout = NULL;
+
+	logprint(ERROR, "xdpw: streams not ready within %d seconds", XDPW_START_TIMEOUT_SEC);
+	int ret = reply_response(start->msg, PORTAL_RESPONSE_ENDED);
+	if (ret < 0) {
+		logprint(ERROR, "dbus: failed to reply to start: %s", strerror(-ret));
+	}
+	start_report(start, "timed out");
+	start_free(start);
+}
+
 static int method_screencast_start(sd_bus_message *msg, void *data,
 		sd_bus_error *ret_error) {
 	struct xdpw_state *state = data;
@@ -397,51 +778,44 @@ static int method_screencast_start(sd_bus_message *msg, void *data,
 		return ret;
 	}
 
-	struct xdpw_screencast_instance *cast = NULL;
-	struct xdpw_session *sess, *tmp_s;
+	struct xdpw_session *sess, *tmp_s, *found = NULL;
 	wl_list_for_each_reverse_safe(sess, tmp_s, &state->xdpw_sessions, link) {
 		if (strcmp(sess->session_handle, session_handle) == 0) {
 				logprint(DEBUG, "dbus: start: found matching session %s", sess->session_handle);
-				cast = sess->screencast_instance;
+				found = sess;
 		}
 	}
-	if (!cast) {
+	if (!found || found->n_screencast_instances == 0) {
 		return -1;
 	}
+	sess = found;
 
-	if (!cast->initialized) {
-		start_screencast(cast);
-	}
-
-	while (cast->node_id == 0) {
-		int ret = pw_loop_iterate(state->pw_loop, 0);
-		if (ret != 0) {
-			logprint(ERROR, "pipewire_loop_iterate failed: %s", spa_strerror(ret));
-		}
-	}
-
-	sd_bus_message *reply = NULL;
-	ret = sd_bus_message_new_method_return(msg, &reply);
-	if (ret < 0) {
-		return ret;
-	}
-
-	ret = sd_bus_message_append(reply, "ua{sv}", PORTAL_RESPONSE_SUCCESS, 1,
-		"streams", "a(ua{sv})", 1,
-		cast->node_id, 2,
-		"position", "(ii)", 0, 0,
-		"size", "(ii)", cast->simple_frame.width, cast->simple_frame.height);
-
-	if (ret < 0) {
-		return ret;
+	if (sess->start != NULL) {
+		logprint(ERROR, "dbus: start: session %s is already starting", sess->session_handle);
+		return -1;
 	}
 
-	ret = sd_bus_send(NULL, reply, NULL);
-	if (ret < 0) {
-		return ret;
+	struct xdpw_start *start = calloc(1, sizeof(*start));
+	if (start == NULL) {
+		return -ENOMEM;
 	}
-	sd_bus_message_unref(reply);
-
+	start->sess = sess;
+	start->msg = sd_bus_message_ref(msg);
+	clock_gettime(CLOCK_MONOTONIC, &start->started);
+	getrusage(RUSAGE_SELF, &start->usage);
+	sess->start = start;
+
+	// nothing blocks here, the first buffer events of the captures and the
+	// node ids from the pipewire thread move the start on in
+	// xdpw_screencast_check_starts, which replies
+	pw_thread_loop_lock(state->pw_thread_loop);
+	start_captures(sess->screencast_instances, sess->n_screencast_instances);
+	pw_thread_loop_unlock(state->pw_thread_loop);
+	wl_display_flush(state->wl_display);
+
+	start->timeout = xdpw_add_timer(state,
+		XDPW_START_TIMEOUT_SEC * TIMESPEC_NSEC_PER_SEC, start_timeout_cb, start);
+	xdpw_screencast_check_starts(state);
 	return 0;
 }
 
@@ -468,9 +842,13 @@ static const sd_bus_vtable screencast_vtable[] = {
 int xdpw_screencast_init(struct xdpw_state *state) {
 	sd_bus_slot *slot = NULL;
 
-	state->screencast = (struct xdpw_screencast_context) { 0 };
-	state->screencast.state = state;
+	state->screencast = (struct xdpw_screencast_context) {
+		.state = state,
+		.frames_done_fd = -1,
+	};
 
+	// both only start here and finish in the background, SelectSources and
+	// Start calls that need them before wait without blocking
 	int err;
 	err = xdpw_pwr_core_connect(state);
 	if (err) {
@@ -482,6 +860,10 @@ int xdpw_screencast_init(struct xdpw_state *state) {
 		goto end;
 	}
 
+	struct config_screencast *conf = &state->config->screencast_conf;
+	xdpw_frame_copy_init(conf->copy_threads, (size_t)conf->copy_threshold * 1024);
+	xdpw_frame_convert_init();
+
 	return sd_bus_add_object_vtable(state->bus, &slot, object_path, interface_name,
 		screencast_vtable, state);
 
@@ -1,5 +1,19 @@
+// memfd_create, MAP_POPULATE and MADV_HUGEPAGE
+#define _GNU_SOURCE
 #include "screencast_common.h"
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define XDPW_HUGE_PAGE_SIZE (2 * 1024 * 1024)
 
 void randname(char *buf) {
 	struct timespec ts;
@@ -12,6 +26,133 @@ void randname(char *buf) {
 	}
 }
 
+int anonymous_shm_open(void) {
+	char name[] = "/xdpw-shm-XXXXXX";
+	int retries = 100;
+
+	do {
+		randname(name + strlen(name) - 6);
+
+		--retries;
+		// shm_open guarantees that O_CLOEXEC is set
+		int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+		if (fd >= 0) {
+			shm_unlink(name);
+			return fd;
+		}
+	} while (retries > 0 && errno == EEXIST);
+
+	return -1;
+}
+
+// accepts "x,y widthxheight", the format of slurp -f "%X,%Y %wx%h"
+bool xdpw_output_region_parse(const char *str, struct xdpw_output_region *region) {
+	struct xdpw_output_region r;
+	int n = 0;
+	if (sscanf(str, " %d,%d %dx%d %n", &r.x, &r.y, &r.width, &r.height, &n) != 4 ||
+			str[n] != '\0' || r.x < 0 || r.y < 0 || r.width <= 0 || r.height <= 0) {
+		return false;
+	}
+	*region = r;
+	return true;
+}
+
+bool xdpw_output_region_is_empty(const struct xdpw_output_region *region) {
+	return region->width <= 0 || region->height <= 0;
+}
+
+bool xdpw_output_region_equal(const struct xdpw_output_region *a,
+		const struct xdpw_output_region *b) {
+	if (xdpw_output_region_is_empty(a) || xdpw_output_region_is_empty(b)) {
+		return xdpw_output_region_is_empty(a) == xdpw_output_region_is_empty(b);
+	}
+	return a->x == b->x && a->y == b->y &&
+		a->width == b->width && a->height == b->height;
+}
+
+static int shm_open_hugetlb(void) {
+#ifdef MFD_HUGETLB
+	return memfd_create("xdpw-shm", MFD_CLOEXEC | MFD_HUGETLB);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void *shm_map(int fd, uint32_t size, enum xdpw_buffer_alloc mode) {
+	int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	if (mode != XDPW_BUFFER_ALLOC_DEFAULT) {
+		flags |= MAP_POPULATE;
+	}
+#endif
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+	if (data == MAP_FAILED) {
+		return NULL;
+	}
+
+	if (mode == XDPW_BUFFER_ALLOC_DEFAULT) {
+		return data;
+	}
+#ifdef MADV_HUGEPAGE
+	// only effective if shmem huge pages are enabled, failing is fine
+	if (mode == XDPW_BUFFER_ALLOC_HUGEPAGE) {
+		madvise(data, size, MADV_HUGEPAGE);
+	}
+#endif
+#ifndef MAP_POPULATE
+	// fault every page in now instead of in the frame path
+	long page_size = sysconf(_SC_PAGESIZE);
+	for (uint32_t off = 0; off < size; off += page_size) {
+		((volatile uint8_t *)data)[off] = 0;
+	}
+#endif
+	return data;
+}
+
+int xdpw_shm_alloc(enum xdpw_buffer_alloc mode, uint32_t size,
+		void **data, uint32_t *map_size) {
+	int fd = -1;
+	int ret;
+
+	// hugetlb pages have to be reserved by the admin, fall back to regular
+	// shm if there are none
+	if (mode == XDPW_BUFFER_ALLOC_HUGEPAGE) {
+		uint64_t huge_size = SPA_ROUND_UP_N((uint64_t)size, XDPW_HUGE_PAGE_SIZE);
+		if (huge_size <= INT32_MAX && (fd = shm_open_hugetlb()) >= 0) {
+			while ((ret = ftruncate(fd, huge_size)) < 0 && errno == EINTR);
+			if (ret == 0 && (*data = shm_map(fd, huge_size, mode)) != NULL) {
+				*map_size = huge_size;
+				return fd;
+			}
+			close(fd);
+		}
+		logprint(DEBUG, "xdpw: no hugetlb pages available (%m), using regular shm");
+	}
+
+	fd = anonymous_shm_open();
+	if (fd < 0) {
+		logprint(ERROR, "xdpw: shm_open failed");
+		return -1;
+	}
+
+	while ((ret = ftruncate(fd, size)) < 0 && errno == EINTR);
+	if (ret < 0) {
+		logprint(ERROR, "xdpw: ftruncate failed");
+		close(fd);
+		return -1;
+	}
+
+	*data = shm_map(fd, size, mode);
+	if (*data == NULL) {
+		logprint(ERROR, "xdpw: mmap failed: %m");
+		close(fd);
+		return -1;
+	}
+	*map_size = size;
+	return fd;
+}
+
 enum spa_video_format xdpw_format_pw_from_wl_shm(
 		struct xdpw_screencast_instance *cast) {
 	switch (cast->simple_frame.format) {
@@ -53,6 +194,161 @@ enum spa_video_format xdpw_format_pw_strip_alpha(enum spa_video_format format) {
 	}
 }
 
+uint32_t xdpw_bpp_from_wl_shm(enum wl_shm_format format) {
+	switch (format) {
+	case WL_SHM_FORMAT_ARGB8888:
+	case WL_SHM_FORMAT_XRGB8888:
+	case WL_SHM_FORMAT_RGBA8888:
+	case WL_SHM_FORMAT_RGBX8888:
+	case WL_SHM_FORMAT_ABGR8888:
+	case WL_SHM_FORMAT_XBGR8888:
+	case WL_SHM_FORMAT_BGRA8888:
+	case WL_SHM_FORMAT_BGRX8888:
+		return 4;
+	default:
+		// planar or unknown, callers fall back to copying whole frames
+		return 0;
+	}
+}
+
+bool xdpw_frame_damage_is_empty(const struct xdpw_frame_damage *damage) {
+	return damage->width == 0 || damage->height == 0;
+}
+
+void xdpw_frame_damage_union(struct xdpw_frame_damage *dst,
+		const struct xdpw_frame_damage *src) {
+	if (xdpw_frame_damage_is_empty(src)) {
+		return;
+	}
+	if (xdpw_frame_damage_is_empty(dst)) {
+		*dst = *src;
+		return;
+	}
+
+	uint32_t x1 = dst->x < src->x ? dst->x : src->x;
+	uint32_t y1 = dst->y < src->y ? dst->y : src->y;
+	uint32_t x2 = dst->x + dst->width > src->x + src->width ?
+		dst->x + dst->width : src->x + src->width;
+	uint32_t y2 = dst->y + dst->height > src->y + src->height ?
+		dst->y + dst->height : src->y + src->height;
+
+	dst->x = x1;
+	dst->y = y1;
+	dst->width = x2 - x1;
+	dst->height = y2 - y1;
+}
+
+static uint64_t rect_area(const struct xdpw_frame_damage *rect) {
+	return (uint64_t)rect->width * rect->height;
+}
+
+static bool rect_contains(const struct xdpw_frame_damage *outer,
+		const struct xdpw_frame_damage *inner) {
+	return inner->x >= outer->x && inner->y >= outer->y &&
+		inner->x + inner->width <= outer->x + outer->width &&
+		inner->y + inner->height <= outer->y + outer->height;
+}
+
+static uint64_t rect_intersection_area(const struct xdpw_frame_damage *a,
+		const struct xdpw_frame_damage *b) {
+	uint32_t x1 = a->x > b->x ? a->x : b->x;
+	uint32_t y1 = a->y > b->y ? a->y : b->y;
+	uint32_t x2 = a->x + a->width < b->x + b->width ?
+		a->x + a->width : b->x + b->width;
+	uint32_t y2 = a->y + a->height < b->y + b->height ?
+		a->y + a->height : b->y + b->height;
+	if (x2 <= x1 || y2 <= y1) {
+		return 0;
+	}
+	return (uint64_t)(x2 - x1) * (y2 - y1);
+}
+
+// area the bounding box of both rects covers that neither of them does
+static uint64_t rect_merge_waste(const struct xdpw_frame_damage *a,
+		const struct xdpw_frame_damage *b) {
+	struct xdpw_frame_damage bbox = *a;
+	xdpw_frame_damage_union(&bbox, b);
+	uint64_t covered = rect_area(a) + rect_area(b) - rect_intersection_area(a, b);
+	return rect_area(&bbox) - covered;
+}
+
+static bool rect_should_merge(const struct xdpw_frame_damage *a,
+		const struct xdpw_frame_damage *b) {
+	struct xdpw_frame_damage bbox = *a;
+	xdpw_frame_damage_union(&bbox, b);
+	// merge when at most 1/8 of the bounding box would be copied needlessly
+	return rect_merge_waste(a, b) * 8 <= rect_area(&bbox);
+}
+
+static void region_remove(struct xdpw_region *region, uint32_t i) {
+	region->rects[i] = region->rects[--region->n_rects];
+}
+
+void xdpw_region_clear(struct xdpw_region *region) {
+	region->n_rects = 0;
+}
+
+bool xdpw_region_is_empty(const struct xdpw_region *region) {
+	return region->n_rects == 0;
+}
+
+void xdpw_region_add_rect(struct xdpw_region *region,
+		const struct xdpw_frame_damage *rect) {
+	if (xdpw_frame_damage_is_empty(rect)) {
+		return;
+	}
+
+	struct xdpw_frame_damage add = *rect;
+	uint32_t i = 0;
+	while (i < region->n_rects) {
+		struct xdpw_frame_damage *cur = &region->rects[i];
+		if (rect_contains(cur, &add)) {
+			return;
+		}
+		if (rect_contains(&add, cur) || rect_should_merge(cur, &add)) {
+			// the grown rect may now swallow rects we already checked
+			xdpw_frame_damage_union(&add, cur);
+			region_remove(region, i);
+			i = 0;
+			continue;
+		}
+		i++;
+	}
+
+	if (region->n_rects < XDPW_REGION_MAX_RECTS) {
+		region->rects[region->n_rects++] = add;
+		return;
+	}
+
+	// the list is full, grow the rect that wastes the least area
+	uint32_t best = 0;
+	uint64_t best_waste = UINT64_MAX;
+	for (i = 0; i < region->n_rects; i++) {
+		uint64_t waste = rect_merge_waste(&region->rects[i], &add);
+		if (waste < best_waste) {
+			best = i;
+			best_waste = waste;
+		}
+	}
+	xdpw_frame_damage_union(&add, &region->rects[best]);
+	region_remove(region, best);
+	xdpw_region_add_rect(region, &add);
+}
+
+void xdpw_region_union(struct xdpw_region *dst, const struct xdpw_region *src) {
+	for (uint32_t i = 0; i < src->n_rects; i++) {
+		xdpw_region_add_rect(dst, &src->rects[i]);
+	}
+}
+
+struct xdpw_frame_damage xdpw_region_extents(const struct xdpw_region *region) {
+	struct xdpw_frame_damage extents = {0};
+	for (uint32_t i = 0; i < region->n_rects; i++) {
+		xdpw_frame_damage_union(&extents, &region->rects[i]);
+	}
+	return extents;
+}
+
 enum xdpw_chooser_types get_chooser_type(const char *chooser_type) {
 	if (!chooser_type || strcmp(chooser_type, "default") == 0) {
 		return XDPW_CHOOSER_DEFAULT;
@@ -81,3 +377,112 @@ const char *chooser_type_str(enum xdpw_chooser_types chooser_type) {
 	fprintf(stderr, "Could not find chooser type %d\n", chooser_type);
 	abort();
 }
+
+enum xdpw_unchanged_frames get_unchanged_frames(const char *unchanged_frames) {
+	if (!unchanged_frames || strcmp(unchanged_frames, "send") == 0) {
+		return XDPW_UNCHANGED_FRAMES_SEND;
+	} else if (strcmp(unchanged_frames, "skip") == 0) {
+		return XDPW_UNCHANGED_FRAMES_SKIP;
+	}
+	fprintf(stderr, "Could not understand unchanged frames mode %s\n", unchanged_frames);
+	exit(1);
+}
+
+const char *unchanged_frames_str(enum xdpw_unchanged_frames unchanged_frames) {
+	switch (unchanged_frames) {
+	case XDPW_UNCHANGED_FRAMES_SEND:
+		return "send";
+	case XDPW_UNCHANGED_FRAMES_SKIP:
+		return "skip";
+	}
+	fprintf(stderr, "Could not find unchanged frames mode %d\n", unchanged_frames);
+	abort();
+}
+
+enum xdpw_capture_pacing get_capture_pacing(const char *capture_pacing) {
+	if (!capture_pacing || strcmp(capture_pacing, "free") == 0) {
+		return XDPW_CAPTURE_PACING_FREE;
+	} else if (strcmp(capture_pacing, "consumer") == 0) {
+		return XDPW_CAPTURE_PACING_CONSUMER;
+	}
+	fprintf(stderr, "Could not understand capture pacing %s\n", capture_pacing);
+	exit(1);
+}
+
+const char *capture_pacing_str(enum xdpw_capture_pacing capture_pacing) {
+	switch (capture_pacing) {
+	case XDPW_CAPTURE_PACING_FREE:
+		return "free";
+	case XDPW_CAPTURE_PACING_CONSUMER:
+		return "consumer";
+	}
+	fprintf(stderr, "Could not find capture pacing %d\n", capture_pacing);
+	abort();
+}
+
+enum xdpw_yuv_matrix get_yuv_matrix(const char *yuv_matrix) {
+	if (!yuv_matrix || strcmp(yuv_matrix, "bt709") == 0) {
+		return XDPW_YUV_MATRIX_BT709;
+	} else if (strcmp(yuv_matrix, "bt601") == 0) {
+		return XDPW_YUV_MATRIX_BT601;
+	}
+	fprintf(stderr, "Could not understand yuv matrix %s\n", yuv_matrix);
+	exit(1);
+}
+
+const char *yuv_matrix_str(enum xdpw_yuv_matrix yuv_matrix) {
+	switch (yuv_matrix) {
+	case XDPW_YUV_MATRIX_BT709:
+		return "bt709";
+	case XDPW_YUV_MATRIX_BT601:
+		return "bt601";
+	}
+	fprintf(stderr, "Could not find yuv matrix %d\n", yuv_matrix);
+	abort();
+}
+
+enum xdpw_yuv_range get_yuv_range(const char *yuv_range) {
+	if (!yuv_range || strcmp(yuv_range, "limited") == 0) {
+		return XDPW_YUV_RANGE_LIMITED;
+	} else if (strcmp(yuv_range, "full") == 0) {
+		return XDPW_YUV_RANGE_FULL;
+	}
+	fprintf(stderr, "Could not understand yuv range %s\n", yuv_range);
+	exit(1);
+}
+
+const char *yuv_range_str(enum xdpw_yuv_range yuv_range) {
+	switch (yuv_range) {
+	case XDPW_YUV_RANGE_LIMITED:
+		return "limited";
+	case XDPW_YUV_RANGE_FULL:
+		return "full";
+	}
+	fprintf(stderr, "Could not find yuv range %d\n", yuv_range);
+	abort();
+}
+
+enum xdpw_buffer_alloc get_buffer_alloc(const char *buffer_alloc) {
+	if (!buffer_alloc || strcmp(buffer_alloc, "default") == 0) {
+		return XDPW_BUFFER_ALLOC_DEFAULT;
+	} else if (strcmp(buffer_alloc, "prefault") == 0) {
+		return XDPW_BUFFER_ALLOC_PREFAULT;
+	} else if (strcmp(buffer_alloc, "hugepage") == 0) {
+		return XDPW_BUFFER_ALLOC_HUGEPAGE;
+	}
+	fprintf(stderr, "Could not understand buffer allocation mode %s\n", buffer_alloc);
+	exit(1);
+}
+
+const char *buffer_alloc_str(enum xdpw_buffer_alloc buffer_alloc) {
+	switch (buffer_alloc) {
+	case XDPW_BUFFER_ALLOC_DEFAULT:
+		return "default";
+	case XDPW_BUFFER_ALLOC_PREFAULT:
+		return "prefault";
+	case XDPW_BUFFER_ALLOC_HUGEPAGE:
+		return "hugepage";
+	}
+	fprintf(stderr, "Could not find buffer allocation mode %d\n", buffer_alloc);
+	abort();
+}
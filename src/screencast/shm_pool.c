@@ -0,0 +1,255 @@
+#include "shm_pool.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "xdpw.h"
+#include "logger.h"
+#include "timespec_util.h"
+
+// one shm file, mapping and wl_shm_pool, split into slots of one size class
+struct xdpw_shm_block {
+	struct wl_list link; // xdpw_shm_pool::blocks
+	uint32_t size_class;
+	uint32_t map_size;
+	void *data;
+	struct wl_shm_pool *wl_pool;
+	uint32_t n_used;
+	// when the last slot was handed back
+	struct timespec idle_since;
+	uint32_t n_slots;
+	struct xdpw_shm_buffer slots[];
+};
+
+struct xdpw_shm_pool {
+	struct xdpw_state *state;
+	struct wl_shm *shm;
+	struct wl_list blocks;
+	struct xdpw_timer *trim_timer;
+	uint32_t page_size;
+};
+
+static int shm_pool_idle_ms(struct xdpw_shm_pool *pool) {
+	return pool->state->config->screencast_conf.shm_pool_idle_ms;
+}
+
+// rounds up to pages and above 8 pages to eighths of a power of two, so
+// small size changes (a cursor plane, a toggled panel) land in the same class
+// while wasting at most 12.5%
+static uint32_t shm_size_class(struct xdpw_shm_pool *pool, uint64_t size) {
+	uint64_t class = SPA_ROUND_UP_N(size, (uint64_t)pool->page_size);
+	if (class > 8 * (uint64_t)pool->page_size) {
+		uint32_t bits = 63 - __builtin_clzll(class);
+		class = SPA_ROUND_UP_N(class, (uint64_t)1 << (bits - 3));
+	}
+	if (class > INT32_MAX) {
+		class = SPA_ROUND_UP_N(size, (uint64_t)pool->page_size);
+	}
+	return class > INT32_MAX ? 0 : class;
+}
+
+static void shm_slot_clear(struct xdpw_shm_buffer *slot) {
+	if (slot->buffer != NULL) {
+		wl_buffer_destroy(slot->buffer);
+		slot->buffer = NULL;
+	}
+}
+
+static void shm_block_destroy(struct xdpw_shm_block *block) {
+	logprint(DEBUG, "shm pool: unmapping %u slots of %u bytes",
+		block->n_slots, block->size_class);
+	for (uint32_t i = 0; i < block->n_slots; i++) {
+		shm_slot_clear(&block->slots[i]);
+	}
+	wl_shm_pool_destroy(block->wl_pool);
+	munmap(block->data, block->map_size);
+	wl_list_remove(&block->link);
+	free(block);
+}
+
+static struct xdpw_shm_block *shm_block_create(struct xdpw_shm_pool *pool,
+		uint32_t size_class, uint32_t n_slots) {
+	while (n_slots > 1 && (uint64_t)size_class * n_slots > INT32_MAX) {
+		n_slots--;
+	}
+
+	struct xdpw_shm_block *block =
+		calloc(1, sizeof(*block) + n_slots * sizeof(block->slots[0]));
+	if (block == NULL) {
+		logprint(ERROR, "shm pool: block allocation failed");
+		return NULL;
+	}
+	block->size_class = size_class;
+	block->n_slots = n_slots;
+
+	enum xdpw_buffer_alloc mode = pool->state->config->screencast_conf.buffer_alloc;
+	int fd = xdpw_shm_alloc(mode, size_class * n_slots, &block->data, &block->map_size);
+	if (fd < 0) {
+		free(block);
+		return NULL;
+	}
+	// the compositor keeps its own reference to the file
+	block->wl_pool = wl_shm_create_pool(pool->shm, fd, size_class * n_slots);
+	close(fd);
+
+	for (uint32_t i = 0; i < n_slots; i++) {
+		struct xdpw_shm_buffer *slot = &block->slots[i];
+		slot->block = block;
+		slot->offset = i * size_class;
+		slot->data = (uint8_t *)block->data + slot->offset;
+	}
+	wl_list_insert(&pool->blocks, &block->link);
+
+	logprint(DEBUG, "shm pool: mapped %u slots of %u bytes", n_slots, size_class);
+	return block;
+}
+
+static bool shm_slot_matches(struct xdpw_shm_buffer *slot, enum wl_shm_format format,
+		uint32_t width, uint32_t height, uint32_t stride) {
+	return slot->buffer != NULL && slot->format == format &&
+		slot->width == width && slot->height == height && slot->stride == stride;
+}
+
+static struct xdpw_shm_buffer *shm_pool_find(struct xdpw_shm_pool *pool,
+		uint32_t size_class, enum wl_shm_format format,
+		uint32_t width, uint32_t height, uint32_t stride) {
+	struct xdpw_shm_buffer *found = NULL;
+	struct xdpw_shm_block *block;
+	wl_list_for_each(block, &pool->blocks, link) {
+		if (block->size_class != size_class || block->n_used == block->n_slots) {
+			continue;
+		}
+		for (uint32_t i = 0; i < block->n_slots; i++) {
+			struct xdpw_shm_buffer *slot = &block->slots[i];
+			if (slot->used) {
+				continue;
+			}
+			// prefer a slot whose wl_buffer can be reused as is
+			if (shm_slot_matches(slot, format, width, height, stride)) {
+				return slot;
+			}
+			if (found == NULL) {
+				found = slot;
+			}
+		}
+	}
+	return found;
+}
+
+struct xdpw_shm_buffer *xdpw_shm_pool_get(struct xdpw_shm_pool *pool,
+		enum wl_shm_format format, uint32_t width, uint32_t height, uint32_t stride,
+		uint32_t count) {
+	uint32_t size_class = shm_size_class(pool, (uint64_t)stride * height);
+	if (size_class == 0) {
+		return NULL;
+	}
+
+	struct xdpw_shm_buffer *slot =
+		shm_pool_find(pool, size_class, format, width, height, stride);
+	if (slot == NULL) {
+		struct xdpw_shm_block *block =
+			shm_block_create(pool, size_class, count > 0 ? count : 1);
+		if (block == NULL) {
+			return NULL;
+		}
+		slot = &block->slots[0];
+	} else {
+		logprint(TRACE, "shm pool: reusing slot at offset %u of %u bytes",
+			slot->offset, size_class);
+	}
+
+	if (!shm_slot_matches(slot, format, width, height, stride)) {
+		shm_slot_clear(slot);
+		slot->buffer = wl_shm_pool_create_buffer(slot->block->wl_pool,
+			slot->offset, width, height, stride, format);
+		slot->format = format;
+		slot->width = width;
+		slot->height = height;
+		slot->stride = stride;
+	}
+
+	slot->used = true;
+	slot->block->n_used++;
+	return slot;
+}
+
+static void shm_pool_trim_cb(void *data);
+
+// frees blocks idle for longer than shm_pool_idle_ms, rearms the timer for
+// the remaining ones
+static void shm_pool_trim(struct xdpw_shm_pool *pool) {
+	int64_t idle_ns = (int64_t)shm_pool_idle_ms(pool) * 1000000;
+	int64_t next_ns = -1;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	struct xdpw_shm_block *block, *tmp;
+	wl_list_for_each_safe(block, tmp, &pool->blocks, link) {
+		if (block->n_used > 0) {
+			continue;
+		}
+		int64_t left_ns = idle_ns - timespec_diff_ns(&now, &block->idle_since);
+		if (left_ns <= 0) {
+			shm_block_destroy(block);
+		} else if (next_ns < 0 || left_ns < next_ns) {
+			next_ns = left_ns;
+		}
+	}
+
+	if (next_ns > 0 && pool->trim_timer == NULL) {
+		pool->trim_timer = xdpw_add_timer(pool->state, next_ns,
+			shm_pool_trim_cb, pool);
+	}
+}
+
+static void shm_pool_trim_cb(void *data) {
+	struct xdpw_shm_pool *pool = data;
+	pool->trim_timer = NULL;
+	shm_pool_trim(pool);
+}
+
+void xdpw_shm_pool_put(struct xdpw_shm_pool *pool, struct xdpw_shm_buffer *buffer) {
+	struct xdpw_shm_block *block = buffer->block;
+
+	buffer->used = false;
+	if (--block->n_used > 0) {
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &block->idle_since);
+	if (pool->trim_timer == NULL) {
+		shm_pool_trim(pool);
+	}
+}
+
+struct xdpw_shm_pool *xdpw_shm_pool_create(struct xdpw_state *state,
+		struct wl_shm *shm) {
+	struct xdpw_shm_pool *pool = calloc(1, sizeof(*pool));
+	if (pool == NULL) {
+		logprint(ERROR, "shm pool: allocation failed");
+		return NULL;
+	}
+	pool->state = state;
+	pool->shm = shm;
+	pool->page_size = sysconf(_SC_PAGESIZE);
+	wl_list_init(&pool->blocks);
+	return pool;
+}
+
+void xdpw_shm_pool_destroy(struct xdpw_shm_pool *pool) {
+	if (pool == NULL) {
+		return;
+	}
+	struct xdpw_shm_block *block, *tmp;
+	wl_list_for_each_safe(block, tmp, &pool->blocks, link) {
+		if (block->n_used > 0) {
+			logprint(WARN, "shm pool: destroying a block with %u buffers in use",
+				block->n_used);
+		}
+		shm_block_destroy(block);
+	}
+	xdpw_destroy_timer(pool->trim_timer);
+	free(pool);
+}
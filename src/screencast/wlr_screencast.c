@@ -1,15 +1,23 @@
+// syscall for pidfd_open
+#define _GNU_SOURCE
 #include "wlr_screencast.h"
 
 #include "wlr-screencopy-unstable-v1-client-protocol.h"
 #include "xdg-output-unstable-v1-client-protocol.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <wayland-client-protocol.h>
@@ -19,114 +27,548 @@
 #include "xdpw.h"
 #include "logger.h"
 #include "fps_limit.h"
+#include "shm_pool.h"
+#include "timespec_util.h"
 
-static void wlr_frame_buffer_destroy(struct xdpw_screencast_instance *cast) {
+#define XDPW_CAPTURE_STATS_PERIOD_SEC 5
+
+_Static_assert(XDPW_CAPTURE_BUFFERS_MAX <= XDPW_SPSC_RING_SIZE,
+	"every capture of an instance must fit into its frame rings");
+
+static void wlr_frame_buffer_destroy(struct xdpw_frame *frame) {
 	// Even though this check may be deemed unnecessary,
 	// this has been found to cause SEGFAULTs, like this one:
 	// https://github.com/emersion/xdg-desktop-portal-wlr/issues/50
-	if (cast->simple_frame.data != NULL) {
-		munmap(cast->simple_frame.data, cast->simple_frame.size);
-		cast->simple_frame.data = NULL;
+	if (frame->data != NULL) {
+		munmap(frame->data, frame->map_size);
+		frame->data = NULL;
 	}
 
-	if (cast->simple_frame.buffer != NULL) {
-		wl_buffer_destroy(cast->simple_frame.buffer);
-		cast->simple_frame.buffer = NULL;
+	if (frame->buffer != NULL) {
+		wl_buffer_destroy(frame->buffer);
+		frame->buffer = NULL;
 	}
 }
 
-void xdpw_wlr_frame_free(struct xdpw_screencast_instance *cast) {
-	zwlr_screencopy_frame_v1_destroy(cast->wlr_frame);
-	cast->wlr_frame = NULL;
-	if (cast->quit || cast->err) {
-		wlr_frame_buffer_destroy(cast);
-		logprint(TRACE, "xdpw: simple_frame buffer destroyed");
+static bool wlr_frame_params_equal(struct xdpw_frame *a, struct xdpw_frame *b) {
+	return a->width == b->width && a->height == b->height &&
+		a->stride == b->stride && a->format == b->format;
+}
+
+// buffers borrowed from a shared pipewire buffer are owned by pipewire
+static void wlr_capture_buffer_release(struct xdpw_capture *capture) {
+	if (capture->shm != NULL) {
+		xdpw_shm_pool_put(capture->cast->ctx->shm_pool, capture->shm);
+		capture->shm = NULL;
+		capture->frame.buffer = NULL;
+		capture->frame.data = NULL;
+		return;
+	}
+	if (capture->pw_buffer == NULL) {
+		wlr_frame_buffer_destroy(&capture->frame);
+		return;
+	}
+	xdpw_pwr_return_buffer(capture->cast, capture->pw_buffer);
+	capture->pw_buffer = NULL;
+	capture->frame.buffer = NULL;
+	capture->frame.data = NULL;
+}
+
+static bool wlr_capture_use_shared_buffer(struct xdpw_capture *capture) {
+	struct xdpw_screencast_instance *cast = capture->cast;
+
+	if (capture->pw_buffer == NULL) {
+		struct pw_buffer *pw_buf;
+		if (capture->reserved == NULL) {
+			pw_buf = xdpw_pwr_dequeue_shared_buffer(cast, &capture->frame);
+		} else if (xdpw_pwr_buffer_shareable(cast, capture->reserved, &capture->frame)) {
+			pw_buf = capture->reserved;
+			capture->reserved = NULL;
+		} else {
+			// copy into the reserved buffer instead
+			pw_buf = NULL;
+		}
+		if (pw_buf == NULL) {
+			return false;
+		}
+		wlr_capture_buffer_release(capture);
+		capture->pw_buffer = pw_buf;
+	}
+
+	struct xdpw_pwr_buffer *pwr_buf = capture->pw_buffer->user_data;
+	capture->frame.buffer = pwr_buf->frame.buffer;
+	capture->frame.data = pwr_buf->frame.data;
+	capture->frame.map_size = pwr_buf->frame.map_size;
+	return true;
+}
+
+void xdpw_wlr_capture_detach_buffer(struct xdpw_screencast_instance *cast,
+		struct pw_buffer *pw_buf, bool *adopted) {
+	*adopted = false;
+	for (uint32_t i = 0; i < cast->n_captures; i++) {
+		struct xdpw_capture *capture = &cast->captures[i];
+		if (capture->reserved == pw_buf) {
+			capture->reserved = NULL;
+		}
+		if (capture->pw_buffer != pw_buf) {
+			continue;
+		}
+		// the slot keeps the mapping and the wl_buffer, the compositor
+		// might still be copying into it
+		capture->pw_buffer = NULL;
+		*adopted = true;
+	}
+}
+
+static bool wlr_capture_busy(struct xdpw_screencast_instance *cast) {
+	for (uint32_t i = 0; i < cast->n_captures; i++) {
+		if (cast->captures[i].state != XDPW_CAPTURE_IDLE) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static struct xdpw_capture *wlr_capture_find(struct xdpw_screencast_instance *cast,
+		enum xdpw_capture_state state) {
+	for (uint32_t i = 0; i < cast->n_captures; i++) {
+		if (cast->captures[i].state == state) {
+			return &cast->captures[i];
+		}
+	}
+	return NULL;
+}
+
+static void wlr_capture_stats_report(struct xdpw_screencast_instance *cast,
+		enum LOGLEVEL loglevel) {
+	struct xdpw_capture_stats *stats = &cast->capture_stats;
+	logprint(loglevel, "wlroots: capture ring of %u buffers: %" PRIu64 " frames, "
+		"%" PRIu64 " overlapped with the next capture, "
+		"%" PRIu64 " captures delayed by a full ring, "
+		"%" PRIu64 " unchanged frames skipped, "
+		"%" PRIu64 " captures waiting for a free pipewire buffer, "
+		"%" PRIu64 " frames dropped for slower streams",
+		cast->n_captures, stats->frames, stats->overlapped, stats->ring_full,
+		stats->skipped, stats->starved, stats->decimated);
+	if (stats->copies > 0) {
+		// compare against the frame interval to see whether the output's
+		// refresh rate can be sustained
+		logprint(loglevel, "wlroots: %ux%u frames: %" PRIu64 " copies, "
+			"average %.2f ms, max %.2f ms, frame interval %.2f ms",
+			cast->simple_frame.width, cast->simple_frame.height, stats->copies,
+			(double)stats->copy_ns / stats->copies / 1000000.0,
+			(double)stats->copy_ns_max / 1000000.0,
+			cast->framerate > 0 ? 1000.0 / cast->framerate : 0.0);
 	}
+	if (stats->intervals > 0) {
+		double mean = stats->interval_sum_ms / stats->intervals;
+		double variance = stats->interval_sq_sum_ms / stats->intervals - mean * mean;
+		logprint(loglevel, "wlroots: frame interval average %.2f ms, "
+			"jitter %.2f ms, max %.2f ms",
+			mean, variance > 0 ? sqrt(variance) : 0.0, stats->interval_max_ms);
+	}
+	stats->intervals = 0;
+	stats->interval_sum_ms = 0;
+	stats->interval_sq_sum_ms = 0;
+	stats->interval_max_ms = 0;
+}
+
+static void wlr_capture_stats_update(struct xdpw_screencast_instance *cast) {
+	struct xdpw_capture_stats *stats = &cast->capture_stats;
+	stats->frames++;
+	if (wlr_capture_find(cast, XDPW_CAPTURE_PENDING) != NULL) {
+		stats->overlapped++;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespec_is_zero(&stats->last_report)) {
+		stats->last_report = now;
+	} else if (timespec_diff_ns(&now, &stats->last_report) >=
+			XDPW_CAPTURE_STATS_PERIOD_SEC * TIMESPEC_NSEC_PER_SEC) {
+		wlr_capture_stats_report(cast, DEBUG);
+		stats->last_report = now;
+	}
+}
+
+void xdpw_wlr_capture_init(struct xdpw_screencast_instance *cast,
+		uint32_t n_captures) {
+	if (n_captures < 1) {
+		n_captures = 1;
+	} else if (n_captures > XDPW_CAPTURE_BUFFERS_MAX) {
+		n_captures = XDPW_CAPTURE_BUFFERS_MAX;
+	}
+	cast->n_captures = n_captures;
+	wl_list_init(&cast->capture_batch_link);
+	xdpw_spsc_ring_init(&cast->frames_ready);
+	xdpw_spsc_ring_init(&cast->frames_done);
+	for (uint32_t i = 0; i < n_captures; i++) {
+		cast->captures[i].cast = cast;
+		cast->captures[i].state = XDPW_CAPTURE_IDLE;
+	}
+	logprint(DEBUG, "wlroots: using a ring of %u capture buffers", n_captures);
+}
+
+static void wlr_capture_batch_stats_close(struct xdpw_screencast_context *ctx) {
+	struct xdpw_capture_batch_stats *stats = &ctx->capture_batch_stats;
+	if (stats->frames < 2) {
+		return;
+	}
+	uint64_t skew_ns = stats->last_ns - stats->first_ns;
+	stats->batches++;
+	stats->skew_ns += skew_ns;
+	if (skew_ns > stats->skew_ns_max) {
+		stats->skew_ns_max = skew_ns;
+	}
+	stats->frames = 0;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespec_is_zero(&stats->last_report)) {
+		stats->last_report = now;
+	} else if (timespec_diff_ns(&now, &stats->last_report) >=
+			XDPW_CAPTURE_STATS_PERIOD_SEC * TIMESPEC_NSEC_PER_SEC) {
+		logprint(DEBUG, "wlroots: %" PRIu64 " captures started together on several outputs, "
+			"frame timestamp skew average %.2f ms, max %.2f ms", stats->batches,
+			(double)stats->skew_ns / stats->batches / 1000000.0,
+			(double)stats->skew_ns_max / 1000000.0);
+		stats->batches = 0;
+		stats->skew_ns = 0;
+		stats->skew_ns_max = 0;
+		stats->last_report = now;
+	}
+}
+
+// the spread of the compositor's timestamps shows how well the outputs of a
+// batch line up
+static void wlr_capture_batch_frame(struct xdpw_capture *capture) {
+	struct xdpw_screencast_context *ctx = capture->cast->ctx;
+	struct xdpw_capture_batch_stats *stats = &ctx->capture_batch_stats;
+	if (capture->batch_seq == 0) {
+		return;
+	}
+
+	uint64_t ts_ns = capture->frame.tv_sec * TIMESPEC_NSEC_PER_SEC + capture->frame.tv_nsec;
+	if (stats->seq != capture->batch_seq) {
+		wlr_capture_batch_stats_close(ctx);
+		stats->seq = capture->batch_seq;
+		stats->frames = 0;
+	}
+	if (stats->frames == 0 || ts_ns < stats->first_ns) {
+		stats->first_ns = ts_ns;
+	}
+	if (stats->frames == 0 || ts_ns > stats->last_ns) {
+		stats->last_ns = ts_ns;
+	}
+	stats->frames++;
+}
+
+static bool wlr_capture_deferred(struct xdpw_screencast_instance *cast) {
+	return !wl_list_empty(&cast->capture_batch_link);
+}
+
+static void wlr_capture_batch_timer_cb(void *data);
+
+// a single timer for the earliest waiting instance
+static void wlr_capture_batch_arm(struct xdpw_screencast_context *ctx) {
+	struct xdpw_screencast_instance *first = NULL, *cast;
+	wl_list_for_each(cast, &ctx->capture_batch, capture_batch_link) {
+		if (first == NULL || timespec_less(&cast->capture_due, &first->capture_due)) {
+			first = cast;
+		}
+	}
+
+	if (ctx->capture_batch_timer != NULL) {
+		// firing early only means nothing is due yet
+		if (first != NULL &&
+				!timespec_less(&first->capture_due, &ctx->capture_batch_timer->at)) {
+			return;
+		}
+		xdpw_destroy_timer(ctx->capture_batch_timer);
+		ctx->capture_batch_timer = NULL;
+	}
+	if (first == NULL) {
+		return;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t delay_ns = timespec_diff_ns(&first->capture_due, &now);
+	ctx->capture_batch_timer = xdpw_add_timer(ctx->state, delay_ns > 0 ? delay_ns : 0,
+		wlr_capture_batch_timer_cb, ctx);
+}
+
+static void wlr_capture_defer(struct xdpw_screencast_instance *cast, uint64_t delay_ns) {
+	struct xdpw_screencast_context *ctx = cast->ctx;
+
+	clock_gettime(CLOCK_MONOTONIC, &cast->capture_due);
+	timespec_add(&cast->capture_due, delay_ns);
+	wl_list_remove(&cast->capture_batch_link);
+	wl_list_insert(&ctx->capture_batch, &cast->capture_batch_link);
+	wlr_capture_batch_arm(ctx);
+}
+
+static void wlr_capture_undefer(struct xdpw_screencast_instance *cast) {
+	if (!wlr_capture_deferred(cast)) {
+		return;
+	}
+	wl_list_remove(&cast->capture_batch_link);
+	wl_list_init(&cast->capture_batch_link);
+	wlr_capture_batch_arm(cast->ctx);
+}
+
+// starts every instance due within capture_batch_ms, their requests go out
+// with the same flush at the end of the event loop iteration and the outputs
+// stay in step when they run at the same rate
+static void wlr_capture_batch_timer_cb(void *data) {
+	struct xdpw_screencast_context *ctx = data;
+	ctx->capture_batch_timer = NULL;
+
+	struct timespec limit;
+	clock_gettime(CLOCK_MONOTONIC, &limit);
+	timespec_add(&limit,
+		(int64_t)ctx->state->config->screencast_conf.capture_batch_ms * 1000000);
+
+	struct wl_list due;
+	wl_list_init(&due);
+	struct xdpw_screencast_instance *cast, *tmp;
+	wl_list_for_each_safe(cast, tmp, &ctx->capture_batch, capture_batch_link) {
+		if (!timespec_less(&limit, &cast->capture_due)) {
+			wl_list_remove(&cast->capture_batch_link);
+			wl_list_insert(due.prev, &cast->capture_batch_link);
+		}
+	}
+
+	ctx->capture_batch_seq = wl_list_length(&due) > 1 ? ++ctx->capture_batches : 0;
+	wl_list_for_each_safe(cast, tmp, &due, capture_batch_link) {
+		wl_list_remove(&cast->capture_batch_link);
+		wl_list_init(&cast->capture_batch_link);
+		cast->capture_starved = false;
+		xdpw_wlr_register_cb(cast);
+	}
+	ctx->capture_batch_seq = 0;
+
+	wlr_capture_batch_arm(ctx);
+}
+
+static void wlr_capture_teardown(struct xdpw_screencast_instance *cast) {
+	for (uint32_t i = 0; i < cast->n_captures; i++) {
+		struct xdpw_capture *capture = &cast->captures[i];
+		if (capture->state == XDPW_CAPTURE_READY) {
+			zwlr_screencopy_frame_v1_destroy(capture->wlr_frame);
+			capture->wlr_frame = NULL;
+			capture->state = XDPW_CAPTURE_IDLE;
+		}
+		if (capture->state == XDPW_CAPTURE_IDLE) {
+			wlr_capture_buffer_release(capture);
+			if (capture->reserved != NULL) {
+				xdpw_pwr_return_buffer(cast, capture->reserved);
+				capture->reserved = NULL;
+			}
+		}
+	}
+	logprint(TRACE, "xdpw: capture buffers destroyed");
+
+	if (wlr_capture_busy(cast)) {
+		// wait for the capture still owned by the compositor
+		return;
+	}
+
+	wlr_capture_undefer(cast);
+	wlr_capture_stats_report(cast, INFO);
+
+	// TODO: revisit the exit condition (remove quit?)
+	// and clean up sessions that still exist if err
+	// is the cause of the instance_destroy call
+	xdpw_screencast_instance_destroy(cast);
+}
+
+void xdpw_wlr_frame_free(struct xdpw_capture *capture) {
+	struct xdpw_screencast_instance *cast = capture->cast;
+
+	if (capture->state == XDPW_CAPTURE_READY) {
+		wlr_capture_stats_update(cast);
+	}
+	zwlr_screencopy_frame_v1_destroy(capture->wlr_frame);
+	capture->wlr_frame = NULL;
+	capture->state = XDPW_CAPTURE_IDLE;
 	logprint(TRACE, "wlroots: frame destroyed");
 
 	if (cast->quit || cast->err) {
-		// TODO: revisit the exit condition (remove quit?)
-		// and clean up sessions that still exist if err
-		// is the cause of the instance_destroy call
-		xdpw_screencast_instance_destroy(cast);
-		return ;
+		wlr_capture_teardown(cast);
+		return;
 	}
 
-	uint64_t delay_ns = fps_limit_measure_end(&cast->fps_limit, cast->ctx->state->config->screencast_conf.max_fps);
-	if (delay_ns > 0) {
-		xdpw_add_timer(cast->ctx->state, delay_ns,
-			(xdpw_event_loop_timer_func_t) xdpw_wlr_register_cb, cast);
-	} else {
+	// a ring slot became available, resume a capture that had to wait for it
+	if (!wlr_capture_deferred(cast) &&
+			wlr_capture_find(cast, XDPW_CAPTURE_PENDING) == NULL) {
 		xdpw_wlr_register_cb(cast);
 	}
 }
 
-static int anonymous_shm_open(void) {
-	char name[] = "/xdpw-shm-XXXXXX";
-	int retries = 100;
+// nothing could receive a frame, try again once pipewire reports a free
+// buffer or a frame interval later, whichever comes first
+static void wlr_capture_starve(struct xdpw_screencast_instance *cast) {
+	cast->capture_stats.starved++;
+	if (wlr_capture_deferred(cast)) {
+		return;
+	}
+	uint64_t retry_ns = TIMESPEC_NSEC_PER_SEC / (cast->framerate > 0 ? cast->framerate : 60);
+	wlr_capture_defer(cast, retry_ns);
+	cast->capture_starved = true;
+}
+
+void xdpw_wlr_capture_buffer_available(struct xdpw_screencast_instance *cast) {
+	if (!cast->capture_starved) {
+		return;
+	}
+	wlr_capture_undefer(cast);
+	cast->capture_starved = false;
+	xdpw_wlr_register_cb(cast);
+}
 
-	do {
-		randname(name + strlen(name) - 6);
+void xdpw_wlr_frames_done(struct xdpw_screencast_context *ctx) {
+	uint64_t count;
+	if (read(ctx->frames_done_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		logprint(ERROR, "wlroots: failed to read the frame eventfd: %s",
+			strerror(errno));
+	}
 
-		--retries;
-		// shm_open guarantees that O_CLOEXEC is set
-		int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-		if (fd >= 0) {
-			shm_unlink(name);
-			return fd;
+	// sinks closed while the pipewire thread copied into them, before a
+	// source going away can hand its capture loop to one of them
+	struct xdpw_screencast_instance *cast, *tmp;
+	wl_list_for_each_safe(cast, tmp, &ctx->screencast_instances, link) {
+		if (cast->capture_source != NULL && cast->quit && cast->copies == 0) {
+			xdpw_screencast_instance_destroy(cast);
 		}
-	} while (retries > 0 && errno == EEXIST);
+	}
 
-	return -1;
+	wl_list_for_each_safe(cast, tmp, &ctx->screencast_instances, link) {
+		// freeing a frame of a quitting instance may destroy it
+		bool gone = false;
+		struct xdpw_capture *capture;
+		while (!gone && (capture = xdpw_spsc_ring_pop(&cast->frames_done)) != NULL) {
+			if (capture->state != XDPW_CAPTURE_READY) {
+				continue;
+			}
+			gone = cast->quit || cast->err;
+			xdpw_wlr_frame_free(capture);
+		}
+		if (!gone && cast->buffer_freed) {
+			cast->buffer_freed = false;
+			xdpw_wlr_capture_buffer_available(cast);
+		}
+	}
 }
 
-static struct wl_buffer *create_shm_buffer(struct xdpw_screencast_instance *cast,
-		enum wl_shm_format fmt, int width, int height, int stride,
-		void **data_out) {
-	struct xdpw_screencast_context *ctx = cast->ctx;
-	int size = stride * height;
-
-	int fd = anonymous_shm_open();
-	if (fd < 0) {
-		logprint(ERROR, "wlroots: shm_open failed");
-		return NULL;
+// the capture loop runs at the highest rate any stream it feeds wants
+double xdpw_wlr_capture_max_fps(struct xdpw_screencast_instance *cast) {
+	double max_fps = cast->max_fps;
+	if (max_fps <= 0) {
+		return 0;
+	}
+	struct xdpw_screencast_instance *sink;
+	wl_list_for_each(sink, &cast->capture_sinks, capture_sink_link) {
+		if (sink->max_fps <= 0) {
+			return 0;
+		}
+		if (sink->max_fps > max_fps) {
+			max_fps = sink->max_fps;
+		}
 	}
+	return max_fps;
+}
 
-	int ret;
-	while ((ret = ftruncate(fd, size)) == EINTR);
+// slows down while the compositor keeps reporting frames without damage
+static void wlr_capture_adapt_rate(struct xdpw_capture *capture) {
+	struct xdpw_screencast_instance *cast = capture->cast;
+	struct config_screencast *conf = &cast->ctx->state->config->screencast_conf;
+	double max_fps = xdpw_wlr_capture_max_fps(cast);
+	double ceiling_fps = max_fps > 0 ? max_fps : cast->framerate;
 
-	if (ret < 0) {
-		close(fd);
-		logprint(ERROR, "wlroots: ftruncate failed");
-		return NULL;
+	fps_limit_update_idle(&cast->fps_limit,
+		!xdpw_region_is_empty(&capture->frame.damage),
+		ceiling_fps, conf->idle_min_fps, conf->idle_backoff);
+}
+
+static void wlr_capture_schedule(struct xdpw_screencast_instance *cast) {
+	double max_fps = fps_limit_target(&cast->fps_limit, xdpw_wlr_capture_max_fps(cast));
+	uint64_t delay_ns = fps_limit_measure_end(&cast->fps_limit, max_fps);
+	if (delay_ns > 0) {
+		wlr_capture_defer(cast, delay_ns);
+	} else {
+		xdpw_wlr_register_cb(cast);
 	}
+}
 
-	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (data == MAP_FAILED) {
-		logprint(ERROR, "wlroots: mmap failed: %m");
-		close(fd);
-		return NULL;
+// wl_shm pools are limited to INT32_MAX bytes
+static bool wlr_frame_size(uint32_t stride, uint32_t height, uint32_t *size) {
+	uint64_t size64 = (uint64_t)stride * height;
+	if (size64 == 0 || size64 > INT32_MAX) {
+		return false;
 	}
+	*size = size64;
+	return true;
+}
 
+static struct wl_buffer *import_shm_buffer(struct xdpw_screencast_context *ctx,
+		int fd, int32_t size, enum wl_shm_format fmt, int width, int height, int stride) {
 	struct wl_shm_pool *pool = wl_shm_create_pool(ctx->shm, fd, size);
-	close(fd);
 	struct wl_buffer *buffer =
 		wl_shm_pool_create_buffer(pool, 0, width, height, stride, fmt);
 	wl_shm_pool_destroy(pool);
-
-	*data_out = data;
 	return buffer;
 }
 
-static void wlr_frame_buffer_chparam(struct xdpw_screencast_instance *cast,
+struct wl_buffer *xdpw_wlr_import_shm_buffer(struct xdpw_screencast_instance *cast,
+		int fd, struct xdpw_frame *frame) {
+	return import_shm_buffer(cast->ctx, fd, frame->size, frame->format,
+		frame->width, frame->height, frame->stride);
+}
+
+// ring slots of all instances share the context's shm pool, a slot with
+// the same parameters usually finds its wl_buffer still there
+static bool wlr_capture_pool_buffer(struct xdpw_capture *capture) {
+	struct xdpw_screencast_instance *cast = capture->cast;
+	struct xdpw_frame *frame = &capture->frame;
+
+	capture->shm = xdpw_shm_pool_get(cast->ctx->shm_pool, frame->format,
+		frame->width, frame->height, frame->stride, cast->n_captures);
+	if (capture->shm == NULL) {
+		return false;
+	}
+	frame->buffer = capture->shm->buffer;
+	frame->data = capture->shm->data;
+	frame->map_size = 0;
+	return true;
+}
+
+static bool wlr_frame_buffer_chparam(struct xdpw_screencast_instance *cast,
 		uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
 	logprint(DEBUG, "wlroots: reset buffer");
+	uint32_t size;
+	if (!wlr_frame_size(stride, height, &size)) {
+		logprint(ERROR, "wlroots: %ux%u frame with stride %u exceeds the shm size limit",
+			width, height, stride);
+		return false;
+	}
 	cast->simple_frame.width = width;
 	cast->simple_frame.height = height;
 	cast->simple_frame.stride = stride;
-	cast->simple_frame.size = stride * height;
+	cast->simple_frame.size = size;
 	cast->simple_frame.format = format;
-	wlr_frame_buffer_destroy(cast);
+	// new buffers get allocated, see how long the next frame takes
+	clock_gettime(CLOCK_MONOTONIC, &cast->capture_stats.buffer_change);
+
+	struct xdpw_screencast_instance *sink;
+	wl_list_for_each(sink, &cast->capture_sinks, capture_sink_link) {
+		sink->simple_frame.width = width;
+		sink->simple_frame.height = height;
+		sink->simple_frame.stride = stride;
+		sink->simple_frame.size = size;
+		sink->simple_frame.format = format;
+	}
+	return true;
 }
 
 static void wlr_frame_linux_dmabuf(void *data,
@@ -137,93 +579,142 @@ static void wlr_frame_linux_dmabuf(void *data,
 
 static void wlr_frame_buffer_done(void *data,
 		struct zwlr_screencopy_frame_v1 *frame) {
-	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_capture *capture = data;
+	struct xdpw_screencast_instance *cast = capture->cast;
 
 	logprint(TRACE, "wlroots: buffer_done event handler");
 
-	zwlr_screencopy_frame_v1_copy_with_damage(frame, cast->simple_frame.buffer);
+	zwlr_screencopy_frame_v1_copy_with_damage(frame, capture->frame.buffer);
 	logprint(TRACE, "wlroots: frame copied");
 
-	fps_limit_measure_start(&cast->fps_limit, cast->ctx->state->config->screencast_conf.max_fps);
+	fps_limit_measure_start(&cast->fps_limit,
+		fps_limit_target(&cast->fps_limit, xdpw_wlr_capture_max_fps(cast)));
 }
 
 static void wlr_frame_buffer(void *data, struct zwlr_screencopy_frame_v1 *frame,
 		uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
-	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_capture *capture = data;
+	struct xdpw_screencast_instance *cast = capture->cast;
 
 	logprint(TRACE, "wlroots: buffer event handler");
-	cast->wlr_frame = frame;
+	capture->wlr_frame = frame;
 	if (cast->simple_frame.width != width ||
 			cast->simple_frame.height != height ||
 			cast->simple_frame.stride != stride ||
 			cast->simple_frame.format != format) {
 		logprint(TRACE, "wlroots: buffer properties changed");
-		wlr_frame_buffer_chparam(cast, format, width, height, stride);
+		if (!wlr_frame_buffer_chparam(cast, format, width, height, stride)) {
+			cast->err = true;
+			xdpw_wlr_frame_free(capture);
+			return;
+		}
+	}
+	// a Start call waits for the buffer parameters of its captures
+	if (!cast->initialized) {
+		xdpw_screencast_check_starts(cast->ctx->state);
 	}
 
-	if (cast->simple_frame.buffer == NULL) {
-		logprint(DEBUG, "wlroots: create shm buffer");
-		cast->simple_frame.buffer = create_shm_buffer(cast, format, width, height,
-			stride, &cast->simple_frame.data);
-	} else {
-		logprint(TRACE,"wlroots: shm buffer exists");
+	// ring slots keep their buffer until they are reused with other parameters
+	if (!wlr_frame_params_equal(&capture->frame, &cast->simple_frame)) {
+		wlr_capture_buffer_release(capture);
+		capture->frame.width = width;
+		capture->frame.height = height;
+		capture->frame.stride = stride;
+		capture->frame.size = cast->simple_frame.size;
+		capture->frame.format = format;
 	}
 
-	if (cast->simple_frame.buffer == NULL) {
-		logprint(ERROR, "wlroots: failed to create buffer");
-		abort();
+	if (cast->zero_copy && wlr_capture_use_shared_buffer(capture)) {
+		logprint(TRACE, "wlroots: copying into shared pipewire buffer");
+	} else if (capture->frame.buffer == NULL) {
+		logprint(DEBUG, "wlroots: get shm buffer from the pool");
+		if (!wlr_capture_pool_buffer(capture)) {
+			logprint(ERROR, "wlroots: failed to create buffer");
+			cast->err = true;
+			xdpw_wlr_frame_free(capture);
+			return;
+		}
+	} else {
+		logprint(TRACE,"wlroots: shm buffer exists");
 	}
 
 	if (zwlr_screencopy_manager_v1_get_version(cast->ctx->screencopy_manager) < 3) {
-		wlr_frame_buffer_done(cast,frame);
+		wlr_frame_buffer_done(capture, frame);
 	}
 }
 
 static void wlr_frame_flags(void *data, struct zwlr_screencopy_frame_v1 *frame,
 		uint32_t flags) {
-	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_capture *capture = data;
 
 	logprint(TRACE, "wlroots: flags event handler");
-	cast->simple_frame.y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
+	capture->frame.y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
 }
 
 static void wlr_frame_ready(void *data, struct zwlr_screencopy_frame_v1 *frame,
 		uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
-	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_capture *capture = data;
+	struct xdpw_screencast_instance *cast = capture->cast;
 
 	logprint(TRACE, "wlroots: ready event handler");
 
-	cast->simple_frame.tv_sec = ((((uint64_t)tv_sec_hi) << 32) | tv_sec_lo);
-	cast->simple_frame.tv_nsec = tv_nsec;
+	capture->frame.tv_sec = ((((uint64_t)tv_sec_hi) << 32) | tv_sec_lo);
+	capture->frame.tv_nsec = tv_nsec;
+	capture->state = XDPW_CAPTURE_READY;
+	wlr_capture_batch_frame(capture);
 
-	if (!cast->quit && !cast->err && cast->pwr_stream_state) {
-		pw_loop_signal_event(cast->ctx->state->pw_loop, cast->event);
+	if (cast->quit || cast->err) {
+		xdpw_wlr_frame_free(capture);
 		return;
 	}
 
-	xdpw_wlr_frame_free(cast);
+	// start the next capture while this one is handed over to pipewire
+	wlr_capture_adapt_rate(capture);
+	wlr_capture_schedule(cast);
+
+	if (cast->stream != NULL &&
+			(cast->pwr_stream_state || !wl_list_empty(&cast->capture_sinks))) {
+		struct xdpw_state *state = cast->ctx->state;
+		xdpw_event_loop_frame_latency(state, &(struct timespec){
+			.tv_sec = capture->frame.tv_sec,
+			.tv_nsec = capture->frame.tv_nsec,
+		});
+		if (!state->startup_first_frame) {
+			state->startup_first_frame = true;
+			xdpw_startup_report(state, "first frame");
+		}
+		// holds at most the instance's captures, which can't overflow it
+		xdpw_spsc_ring_push(&cast->frames_ready, capture);
+		pw_loop_signal_event(cast->ctx->state->pw_loop, cast->ctx->frames_event);
+		return;
+	}
+
+	xdpw_wlr_frame_free(capture);
 }
 
 static void wlr_frame_failed(void *data,
 		struct zwlr_screencopy_frame_v1 *frame) {
-	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_capture *capture = data;
 
 	logprint(TRACE, "wlroots: failed event handler");
-	cast->err = true;
+	capture->cast->err = true;
 
-	xdpw_wlr_frame_free(cast);
+	xdpw_wlr_frame_free(capture);
 }
 
 static void wlr_frame_damage(void *data, struct zwlr_screencopy_frame_v1 *frame,
 		uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
-	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_capture *capture = data;
 
 	logprint(TRACE, "wlroots: damage event handler");
 
-	cast->simple_frame.damage.x = x;
-	cast->simple_frame.damage.y = y;
-	cast->simple_frame.damage.width = width;
-	cast->simple_frame.damage.height = height;
+	struct xdpw_frame_damage damage = {
+		.x = x,
+		.y = y,
+		.width = width,
+		.height = height,
+	};
+	xdpw_region_add_rect(&capture->frame.damage, &damage);
 }
 
 static const struct zwlr_screencopy_frame_v1_listener wlr_frame_listener = {
@@ -237,11 +728,54 @@ static const struct zwlr_screencopy_frame_v1_listener wlr_frame_listener = {
 };
 
 void xdpw_wlr_register_cb(struct xdpw_screencast_instance *cast) {
-	cast->frame_callback = zwlr_screencopy_manager_v1_capture_output(
-		cast->ctx->screencopy_manager, cast->with_cursor, cast->target_output->output);
+	if (cast->quit || cast->err) {
+		wlr_capture_teardown(cast);
+		return;
+	}
+
+	// only one request is outstanding at a time, the compositor would
+	// otherwise fill all of them from the same output commit
+	if (wlr_capture_find(cast, XDPW_CAPTURE_PENDING) != NULL) {
+		logprint(TRACE, "wlroots: capture already in flight");
+		return;
+	}
+
+	struct xdpw_capture *capture = wlr_capture_find(cast, XDPW_CAPTURE_IDLE);
+	if (capture == NULL) {
+		logprint(TRACE, "wlroots: capture ring full, waiting for pipewire");
+		cast->capture_stats.ring_full++;
+		return;
+	}
+
+	// with consumer pacing no capture is requested that no buffer could take,
+	// the streams of other sessions can't be reserved from
+	if (cast->ctx->state->config->screencast_conf.capture_pacing ==
+			XDPW_CAPTURE_PACING_CONSUMER && wl_list_empty(&cast->capture_sinks) &&
+			capture->reserved == NULL && capture->pw_buffer == NULL) {
+		capture->reserved = xdpw_pwr_reserve_buffer(cast);
+		if (capture->reserved == NULL) {
+			wlr_capture_starve(cast);
+			return;
+		}
+	}
 
-	zwlr_screencopy_frame_v1_add_listener(cast->frame_callback,
-		&wlr_frame_listener, cast);
+	capture->state = XDPW_CAPTURE_PENDING;
+	capture->seq = cast->capture_seq++;
+	capture->batch_seq = cast->ctx->capture_batch_seq;
+	capture->frame.y_invert = false;
+	xdpw_region_clear(&capture->frame.damage);
+	if (xdpw_output_region_is_empty(&cast->region)) {
+		capture->wlr_frame = zwlr_screencopy_manager_v1_capture_output(
+			cast->ctx->screencopy_manager, cast->with_cursor, cast->target_output->output);
+	} else {
+		// the compositor only copies the region, buffers shrink accordingly
+		capture->wlr_frame = zwlr_screencopy_manager_v1_capture_output_region(
+			cast->ctx->screencopy_manager, cast->with_cursor, cast->target_output->output,
+			cast->region.x, cast->region.y, cast->region.width, cast->region.height);
+	}
+
+	zwlr_screencopy_frame_v1_add_listener(capture->wlr_frame,
+		&wlr_frame_listener, capture);
 	logprint(TRACE, "wlroots: callbacks registered");
 }
 
@@ -284,13 +818,29 @@ static void wlr_xdg_output_name(void *data, struct zxdg_output_v1 *xdg_output,
 	output->name = strdup(name);
 };
 
+static void wlr_xdg_output_logical_position(void *data,
+		struct zxdg_output_v1 *xdg_output, int32_t x, int32_t y) {
+	struct xdpw_wlr_output *output = data;
+
+	output->x = x;
+	output->y = y;
+}
+
+static void wlr_xdg_output_logical_size(void *data,
+		struct zxdg_output_v1 *xdg_output, int32_t width, int32_t height) {
+	struct xdpw_wlr_output *output = data;
+
+	output->width = width;
+	output->height = height;
+}
+
 static void noop() {
 	// This space intentionally left blank
 }
 
 static const struct zxdg_output_v1_listener wlr_xdg_output_listener = {
-	.logical_position = noop,
-	.logical_size = noop,
+	.logical_position = wlr_xdg_output_logical_position,
+	.logical_size = wlr_xdg_output_logical_size,
 	.done = NULL, /* Deprecated */
 	.description = noop,
 	.name = wlr_xdg_output_name,
@@ -343,22 +893,150 @@ static pid_t spawn_chooser(char *cmd, int chooser_in[2], int chooser_out[2]) {
 	return pid;
 }
 
-static bool wait_chooser(pid_t pid) {
+static int pidfd_open_chooser(pid_t pid) {
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static const struct xdpw_output_chooser default_choosers[] = {
+	{XDPW_CHOOSER_SIMPLE, "slurp -f %o -o"},
+	{XDPW_CHOOSER_DMENU, "wofi -d -n"},
+	{XDPW_CHOOSER_DMENU, "bemenu"},
+};
+
+// a chooser child watched by the event loop, so running screencasts go on
+// while the user picks an output
+struct xdpw_output_chooser_run {
+	struct xdpw_screencast_context *ctx;
+	size_t max;
+	xdpw_output_chooser_done_func_t func;
+	void *data;
+
+	// choosers left to try, the default type falls back along the list and
+	// finally to the first output
+	const struct xdpw_output_chooser *choosers;
+	size_t n_choosers;
+	struct xdpw_output_chooser config_chooser;
+	bool fallback_first;
+	const struct xdpw_output_chooser *chooser;
+
+	pid_t pid;
+	int pidfd;
+	int out_fd;
+	struct xdpw_fd_watch *pid_watch;
+	struct xdpw_fd_watch *out_watch;
+	bool exited;
 	int status;
-	if (waitpid(pid ,&status, 0) != -1 && WIFEXITED(status)) {
-		return WEXITSTATUS(status) != 127;
+	char *out;
+	size_t out_len;
+	size_t out_size;
+
+	// reports a result known without running a chooser
+	struct xdpw_timer *done_timer;
+
+	struct xdpw_wlr_output *outputs[XDPW_SESSION_MAX_SOURCES];
+	struct xdpw_output_region regions[XDPW_SESSION_MAX_SOURCES];
+	size_t n_outputs;
+};
+
+// a line of chooser output, the output name optionally followed by a region
+static struct xdpw_wlr_output *wlr_output_chooser_parse(
+		const struct xdpw_output_chooser *chooser,
+		struct wl_list *output_list, char *line, struct xdpw_output_region *region) {
+	*region = (struct xdpw_output_region) { 0 };
+
+	// an optional region follows the output name
+	char *p = strchr(line, ' ');
+	if (p != NULL) {
+		*p = '\0';
+		if (!xdpw_output_region_parse(p + 1, region)) {
+			logprint(WARN, "wlroots: output chooser returned an invalid region \"%s\", "
+				"capturing the whole output", p + 1);
+		}
 	}
-	return false;
-}
 
-static bool wlr_output_chooser(struct xdpw_output_chooser *chooser,
-		struct wl_list *output_list, struct xdpw_wlr_output **output) {
-	logprint(DEBUG, "wlroots: output chooser called");
+	logprint(TRACE, "wlroots: output chooser %s selects output %s", chooser->cmd, line);
 	struct xdpw_wlr_output *out;
-	size_t name_size = 0;
-	char *name = NULL;
-	*output = NULL;
+	wl_list_for_each(out, output_list, link) {
+		// TODO: Replugging of outputs can result in a corrupted output_list
+		if (out->name && strcmp(out->name, line) == 0) {
+			return out;
+		}
+	}
+	return NULL;
+}
 
+// every line the chooser printed selects an output, up to max of them
+static void wlr_output_chooser_read_result(struct xdpw_output_chooser_run *run) {
+	char *line = run->out;
+	while (line != NULL && run->n_outputs < run->max) {
+		char *next = strchr(line, '\n');
+		if (next != NULL) {
+			*next++ = '\0';
+		}
+		if (*line != '\0') {
+			struct xdpw_wlr_output *out = wlr_output_chooser_parse(run->chooser,
+				&run->ctx->output_list, line, &run->regions[run->n_outputs]);
+			if (out != NULL) {
+				run->outputs[run->n_outputs++] = out;
+			} else {
+				logprint(WARN, "wlroots: output chooser selects unknown output %s", line);
+			}
+		}
+		line = next;
+	}
+
+	if (run->n_outputs > 0) {
+		logprint(DEBUG, "wlroots: output chooser selects %zu outputs", run->n_outputs);
+	} else {
+		logprint(DEBUG, "wlroots: output chooser canceled");
+	}
+}
+
+static void wlr_output_chooser_reap(struct xdpw_output_chooser_run *run) {
+	xdpw_destroy_fd_watch(run->out_watch);
+	run->out_watch = NULL;
+	if (run->out_fd >= 0) {
+		close(run->out_fd);
+		run->out_fd = -1;
+	}
+	xdpw_destroy_fd_watch(run->pid_watch);
+	run->pid_watch = NULL;
+	if (run->pidfd >= 0) {
+		close(run->pidfd);
+		run->pidfd = -1;
+	}
+	if (run->pid > 0 && !run->exited) {
+		kill(run->pid, SIGKILL);
+		waitpid(run->pid, NULL, 0);
+	}
+	run->pid = 0;
+	run->exited = false;
+	run->out_len = 0;
+}
+
+static void wlr_output_chooser_destroy(struct xdpw_output_chooser_run *run) {
+	wlr_output_chooser_reap(run);
+	xdpw_destroy_timer(run->done_timer);
+	free(run->out);
+	free(run);
+}
+
+static void wlr_output_chooser_complete(struct xdpw_output_chooser_run *run) {
+	run->func(run->outputs, run->regions, run->n_outputs, run->data);
+	wlr_output_chooser_destroy(run);
+}
+
+static bool wlr_output_chooser_handle_out(int fd, uint32_t events, void *data);
+static bool wlr_output_chooser_handle_pid(int fd, uint32_t events, void *data);
+
+static bool wlr_output_chooser_spawn(struct xdpw_output_chooser_run *run,
+		const struct xdpw_output_chooser *chooser) {
+	struct xdpw_state *state = run->ctx->state;
 	int chooser_in[2]; //p -> c
 	int chooser_out[2]; //c -> p
 
@@ -378,16 +1056,24 @@ static bool wlr_output_chooser(struct xdpw_output_chooser *chooser,
 		logprint(ERROR, "Failed to fork chooser");
 		goto error_fork;
 	}
+	run->chooser = chooser;
+	run->pid = pid;
+	run->out_fd = chooser_out[0];
+	fcntl(run->out_fd, F_SETFL, fcntl(run->out_fd, F_GETFL) | O_NONBLOCK);
+	fcntl(run->out_fd, F_SETFD, FD_CLOEXEC);
 
+	// the list is small enough for the pipe buffer
 	switch (chooser->type) {
 	case XDPW_CHOOSER_DMENU:;
 		FILE *f = fdopen(chooser_in[1], "w");
 		if (f == NULL) {
 			perror("fdopen pipe chooser_in");
 			logprint(ERROR, "Failed to create stream writing to pipe chooser_in");
-			goto error_fork;
+			close(chooser_in[1]);
+			break;
 		}
-		wl_list_for_each(out, output_list, link) {
+		struct xdpw_wlr_output *out;
+		wl_list_for_each(out, &run->ctx->output_list, link) {
 			fprintf(f, "%s\n", out->name);
 		}
 		fclose(f);
@@ -396,43 +1082,18 @@ static bool wlr_output_chooser(struct xdpw_output_chooser *chooser,
 		close(chooser_in[1]);
 	}
 
-	if (!wait_chooser(pid)) {
-		close(chooser_out[0]);
-		goto end;
-	}
-
-	FILE *f = fdopen(chooser_out[0], "r");
-	if (f == NULL) {
-		perror("fdopen pipe chooser_out");
-		logprint(ERROR, "Failed to create stream reading from pipe chooser_out");
-		close(chooser_out[0]);
-		goto end;
-	}
-
-	ssize_t nread = getline(&name, &name_size, f);
-	fclose(f);
-	if (nread < 0) {
-		perror("getline failed");
-		goto end;
+	run->out_watch = xdpw_add_fd_watch(state, run->out_fd, EPOLLIN,
+		wlr_output_chooser_handle_out, run);
+	// without pidfds the child is reaped once it closed its output
+	run->pidfd = pidfd_open_chooser(pid);
+	if (run->pidfd >= 0) {
+		run->pid_watch = xdpw_add_fd_watch(state, run->pidfd, EPOLLIN,
+			wlr_output_chooser_handle_pid, run);
 	}
-
-	//Strip newline
-	char *p = strchr(name, '\n');
-	if (p != NULL) {
-		*p = '\0';
+	if (run->out_watch == NULL || (run->pidfd >= 0 && run->pid_watch == NULL)) {
+		wlr_output_chooser_reap(run);
+		return false;
 	}
-
-	logprint(TRACE, "wlroots: output chooser %s selects output %s", chooser->cmd, name);
-	wl_list_for_each(out, output_list, link) {
-		// TODO: Replugging of outputs can result in a corrupted output_list
-		if (out->name && strcmp(out->name, name) == 0) {
-			*output = out;
-			break;
-		}
-	}
-	free(name);
-
-end:
 	return true;
 
 error_fork:
@@ -442,74 +1103,187 @@ error_chooser_out:
 	close(chooser_in[0]);
 	close(chooser_in[1]);
 error_chooser_in:
-	*output = NULL;
 	return false;
 }
 
-static struct xdpw_wlr_output *wlr_output_chooser_default(struct wl_list *output_list) {
-	logprint(DEBUG, "wlroots: output chooser called");
-	struct xdpw_output_chooser default_chooser[] = {
-		{XDPW_CHOOSER_SIMPLE, "slurp -f %o -o"},
-		{XDPW_CHOOSER_DMENU, "wofi -d -n"},
-		{XDPW_CHOOSER_DMENU, "bemenu"},
-	};
+// starts the next chooser on the list, false if none is left
+static bool wlr_output_chooser_next(struct xdpw_output_chooser_run *run) {
+	while (run->n_choosers > 0) {
+		const struct xdpw_output_chooser *chooser = run->choosers;
+		run->choosers++;
+		run->n_choosers--;
+
+		logprint(DEBUG, "wlroots: output chooser %s (%d)", chooser->cmd, chooser->type);
+		if (wlr_output_chooser_spawn(run, chooser)) {
+			return true;
+		}
+		logprint(ERROR, "wlroots: output chooser %s failed", chooser->cmd);
+	}
+
+	if (run->fallback_first) {
+		run->outputs[0] = xdpw_wlr_output_first(&run->ctx->output_list);
+		run->regions[0] = (struct xdpw_output_region) { 0 };
+		run->n_outputs = run->outputs[0] != NULL ? 1 : 0;
+	}
+	return false;
+}
 
-	size_t N = sizeof(default_chooser)/sizeof(default_chooser[0]);
-	struct xdpw_wlr_output *output = NULL;
-	bool ret;
-	for (size_t i = 0; i<N; i++) {
-		ret = wlr_output_chooser(&default_chooser[i], output_list, &output);
-		if (!ret) {
-			logprint(DEBUG, "wlroots: output chooser %s not found. Trying next one.",
-					default_chooser[i].cmd);
+// both the output and the exit status are needed
+static void wlr_output_chooser_check(struct xdpw_output_chooser_run *run) {
+	if (run->out_fd >= 0 || !run->exited) {
+		return;
+	}
+
+	if (WIFEXITED(run->status) && WEXITSTATUS(run->status) == 127) {
+		logprint(DEBUG, "wlroots: output chooser %s not found. Trying next one.",
+			run->chooser->cmd);
+		wlr_output_chooser_reap(run);
+		if (!wlr_output_chooser_next(run)) {
+			wlr_output_chooser_complete(run);
+		}
+		return;
+	}
+
+	if (WIFEXITED(run->status) && run->out_len > 0) {
+		wlr_output_chooser_read_result(run);
+	} else {
+		logprint(DEBUG, "wlroots: output chooser canceled");
+	}
+	wlr_output_chooser_complete(run);
+}
+
+static bool wlr_output_chooser_handle_out(int fd, uint32_t events, void *data) {
+	struct xdpw_output_chooser_run *run = data;
+
+	while (true) {
+		if (run->out_size - run->out_len < 256) {
+			size_t size = run->out_size > 0 ? run->out_size * 2 : 1024;
+			char *out = realloc(run->out, size);
+			if (out == NULL) {
+				logprint(ERROR, "wlroots: output chooser buffer allocation failed");
+				break;
+			}
+			run->out = out;
+			run->out_size = size;
+		}
+		// keeps room for the terminating zero
+		ssize_t n = read(fd, run->out + run->out_len, run->out_size - run->out_len - 1);
+		if (n > 0) {
+			run->out_len += n;
+			run->out[run->out_len] = '\0';
 			continue;
 		}
-		if (output != NULL) {
-			logprint(DEBUG, "wlroots: output chooser selects %s", output->name);
-		} else {
-			logprint(DEBUG, "wlroots: output chooser canceled");
+		if (n < 0 && errno == EINTR) {
+			continue;
 		}
-		return output;
+		if (n < 0 && errno == EAGAIN) {
+			return false;
+		}
+		break;
+	}
+
+	// end of output
+	xdpw_destroy_fd_watch(run->out_watch);
+	run->out_watch = NULL;
+	close(run->out_fd);
+	run->out_fd = -1;
+	if (run->pidfd < 0 && !run->exited) {
+		waitpid(run->pid, &run->status, 0);
+		run->exited = true;
+	}
+	wlr_output_chooser_check(run);
+	return false;
+}
+
+static bool wlr_output_chooser_handle_pid(int fd, uint32_t events, void *data) {
+	struct xdpw_output_chooser_run *run = data;
+
+	if (waitpid(run->pid, &run->status, WNOHANG) <= 0) {
+		return false;
 	}
-	return xdpw_wlr_output_first(output_list);
+	run->exited = true;
+	xdpw_destroy_fd_watch(run->pid_watch);
+	run->pid_watch = NULL;
+	close(run->pidfd);
+	run->pidfd = -1;
+	wlr_output_chooser_check(run);
+	return false;
+}
+
+static void wlr_output_chooser_done_cb(void *data) {
+	struct xdpw_output_chooser_run *run = data;
+	run->done_timer = NULL;
+	wlr_output_chooser_complete(run);
 }
 
-struct xdpw_wlr_output *xdpw_wlr_output_chooser(struct xdpw_screencast_context *ctx) {
-	switch (ctx->state->config->screencast_conf.chooser_type) {
+struct xdpw_output_chooser_run *xdpw_wlr_output_chooser_start(
+		struct xdpw_screencast_context *ctx, size_t max,
+		xdpw_output_chooser_done_func_t func, void *data) {
+	struct config_screencast *conf = &ctx->state->config->screencast_conf;
+	struct xdpw_output_chooser_run *run = calloc(1, sizeof(*run));
+	if (run == NULL) {
+		logprint(ERROR, "wlroots: output chooser allocation failed");
+		return NULL;
+	}
+	run->ctx = ctx;
+	run->max = max < XDPW_SESSION_MAX_SOURCES ? max : XDPW_SESSION_MAX_SOURCES;
+	run->func = func;
+	run->data = data;
+	run->pidfd = -1;
+	run->out_fd = -1;
+
+	logprint(DEBUG, "wlroots: output chooser called");
+	switch (conf->chooser_type) {
 	case XDPW_CHOOSER_DEFAULT:
-		return wlr_output_chooser_default(&ctx->output_list);
+		run->choosers = default_choosers;
+		run->n_choosers = sizeof(default_choosers) / sizeof(default_choosers[0]);
+		run->fallback_first = true;
+		break;
 	case XDPW_CHOOSER_NONE:
-		if (ctx->state->config->screencast_conf.output_name) {
-			return xdpw_wlr_output_find_by_name(&ctx->output_list, ctx->state->config->screencast_conf.output_name);
+		if (conf->region && !xdpw_output_region_parse(conf->region, &run->regions[0])) {
+			logprint(WARN, "wlroots: invalid region \"%s\", capturing the whole output",
+				conf->region);
+		}
+		if (conf->output_name) {
+			run->outputs[0] = xdpw_wlr_output_find_by_name(&ctx->output_list, conf->output_name);
 		} else {
-			return xdpw_wlr_output_first(&ctx->output_list);
+			run->outputs[0] = xdpw_wlr_output_first(&ctx->output_list);
 		}
+		run->n_outputs = run->outputs[0] != NULL ? 1 : 0;
+		break;
 	case XDPW_CHOOSER_DMENU:
-	case XDPW_CHOOSER_SIMPLE:;
-		struct xdpw_wlr_output *output = NULL;
-		if (!ctx->state->config->screencast_conf.chooser_cmd) {
+	case XDPW_CHOOSER_SIMPLE:
+		if (!conf->chooser_cmd) {
 			logprint(ERROR, "wlroots: no output chooser given");
-			goto end;
+			break;
 		}
-		struct xdpw_output_chooser chooser = {
-			ctx->state->config->screencast_conf.chooser_type,
-			ctx->state->config->screencast_conf.chooser_cmd
+		run->config_chooser = (struct xdpw_output_chooser) {
+			conf->chooser_type,
+			conf->chooser_cmd,
 		};
-		logprint(DEBUG, "wlroots: output chooser %s (%d)", chooser.cmd, chooser.type);
-		bool ret = wlr_output_chooser(&chooser, &ctx->output_list, &output);
-		if (!ret) {
-			logprint(ERROR, "wlroots: output chooser %s failed", chooser.cmd);
-			goto end;
-		}
-		if (output) {
-			logprint(DEBUG, "wlroots: output chooser selects %s", output->name);
-		} else {
-			logprint(DEBUG, "wlroots: output chooser canceled");
-		}
-		return output;
+		run->choosers = &run->config_chooser;
+		run->n_choosers = 1;
+		break;
 	}
-end:
-	return NULL;
+
+	if (wlr_output_chooser_next(run)) {
+		return run;
+	}
+	// the result is known already, still report it from the event loop
+	run->done_timer = xdpw_add_timer(ctx->state, 0, wlr_output_chooser_done_cb, run);
+	if (run->done_timer == NULL) {
+		free(run);
+		return NULL;
+	}
+	return run;
+}
+
+void xdpw_wlr_output_chooser_cancel(struct xdpw_output_chooser_run *run) {
+	if (run == NULL) {
+		return;
+	}
+	logprint(DEBUG, "wlroots: output chooser canceled by the request");
+	wlr_output_chooser_destroy(run);
 }
 
 struct xdpw_wlr_output *xdpw_wlr_output_first(struct wl_list *output_list) {
@@ -552,7 +1326,7 @@ static void wlr_registry_handle_add(void *data, struct wl_registry *reg,
 
 	logprint(DEBUG, "wlroots: interface to register %s  (Version: %u)",interface, ver);
 	if (!strcmp(interface, wl_output_interface.name)) {
-		struct xdpw_wlr_output *output = malloc(sizeof(*output));
+		struct xdpw_wlr_output *output = calloc(1, sizeof(*output));
 
 		output->id = id;
 		logprint(DEBUG, "wlroots: |-- registered to interface %s (Version %u)", interface, WL_OUTPUT_VERSION);
@@ -597,30 +1371,20 @@ static const struct wl_registry_listener wlr_registry_listener = {
 	.global_remove = wlr_registry_handle_remove,
 };
 
-int xdpw_wlr_screencopy_init(struct xdpw_state *state) {
-	struct xdpw_screencast_context *ctx = &state->screencast;
-
-	// initialize a list of outputs
-	wl_list_init(&ctx->output_list);
-
-	// initialize a list of active screencast instances
-	wl_list_init(&ctx->screencast_instances);
+static void wlr_init_sync_done(void *data, struct wl_callback *callback,
+	uint32_t serial);
 
-	// retrieve registry
-	ctx->registry = wl_display_get_registry(state->wl_display);
-	wl_registry_add_listener(ctx->registry, &wlr_registry_listener, ctx);
-
-	wl_display_dispatch(state->wl_display);
-	wl_display_roundtrip(state->wl_display);
-
-	logprint(DEBUG, "wayland: registry listeners run");
-
-	wlr_init_xdg_outputs(ctx);
+static const struct wl_callback_listener wlr_init_sync_listener = {
+	.done = wlr_init_sync_done,
+};
 
-	wl_display_dispatch(state->wl_display);
-	wl_display_roundtrip(state->wl_display);
+static void wlr_init_sync(struct xdpw_screencast_context *ctx) {
+	ctx->init_sync = wl_display_sync(ctx->state->wl_display);
+	wl_callback_add_listener(ctx->init_sync, &wlr_init_sync_listener, ctx);
+}
 
-	logprint(DEBUG, "wayland: xdg output listeners run");
+static int wlr_init_finish(struct xdpw_screencast_context *ctx) {
+	struct xdpw_state *state = ctx->state;
 
 	// make sure our wlroots supports shm protocol
 	if (!ctx->shm) {
@@ -628,6 +1392,11 @@ int xdpw_wlr_screencopy_init(struct xdpw_state *state) {
 		return -1;
 	}
 
+	ctx->shm_pool = xdpw_shm_pool_create(state, ctx->shm);
+	if (!ctx->shm_pool) {
+		return -1;
+	}
+
 	// make sure our wlroots supports screencopy protocol
 	if (!ctx->screencopy_manager) {
 		logprint(ERROR, "Compositor doesn't support %s!",
@@ -638,7 +1407,63 @@ int xdpw_wlr_screencopy_init(struct xdpw_state *state) {
 	return 0;
 }
 
+// the registry and the outputs are set up by the event loop, one roundtrip
+// each, while D-Bus is already served
+static void wlr_init_sync_done(void *data, struct wl_callback *callback,
+		uint32_t serial) {
+	struct xdpw_screencast_context *ctx = data;
+
+	wl_callback_destroy(callback);
+	ctx->init_sync = NULL;
+
+	switch (ctx->init_stage) {
+	case XDPW_WLR_INIT_REGISTRY:
+		logprint(DEBUG, "wayland: registry listeners run");
+		wlr_init_xdg_outputs(ctx);
+		ctx->init_stage = XDPW_WLR_INIT_OUTPUTS;
+		wlr_init_sync(ctx);
+		break;
+	case XDPW_WLR_INIT_OUTPUTS:
+		logprint(DEBUG, "wayland: xdg output listeners run");
+		ctx->init_err = wlr_init_finish(ctx);
+		ctx->init_stage = XDPW_WLR_INIT_DONE;
+		if (ctx->init_err < 0) {
+			logprint(ERROR, "wlroots: screencasts are unavailable");
+		} else {
+			xdpw_startup_report(ctx->state, "wayland ready");
+		}
+		xdpw_screencast_setup_done(ctx->state);
+		break;
+	case XDPW_WLR_INIT_DONE:
+		break;
+	}
+}
+
+int xdpw_wlr_screencopy_init(struct xdpw_state *state) {
+	struct xdpw_screencast_context *ctx = &state->screencast;
+
+	// initialize a list of outputs
+	wl_list_init(&ctx->output_list);
+
+	// initialize a list of active screencast instances
+	wl_list_init(&ctx->screencast_instances);
+	wl_list_init(&ctx->capture_batch);
+
+	// retrieve registry
+	ctx->registry = wl_display_get_registry(state->wl_display);
+	wl_registry_add_listener(ctx->registry, &wlr_registry_listener, ctx);
+
+	ctx->init_stage = XDPW_WLR_INIT_REGISTRY;
+	wlr_init_sync(ctx);
+	return 0;
+}
+
 void xdpw_wlr_screencopy_finish(struct xdpw_screencast_context *ctx) {
+	if (ctx->init_sync) {
+		wl_callback_destroy(ctx->init_sync);
+		ctx->init_sync = NULL;
+	}
+
 	struct xdpw_wlr_output *output, *tmp_o;
 	wl_list_for_each_safe(output, tmp_o, &ctx->output_list, link) {
 		wl_list_remove(&output->link);
@@ -654,6 +1479,8 @@ void xdpw_wlr_screencopy_finish(struct xdpw_screencast_context *ctx) {
 	if (ctx->screencopy_manager) {
 		zwlr_screencopy_manager_v1_destroy(ctx->screencopy_manager);
 	}
+	xdpw_shm_pool_destroy(ctx->shm_pool);
+	ctx->shm_pool = NULL;
 	if (ctx->shm) {
 		wl_shm_destroy(ctx->shm);
 	}
@@ -0,0 +1,117 @@
+// checks every yuv conversion kernel the cpu supports against the scalar one
+
+#include "frame_convert.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_WIDTH_MAX 100
+#define TEST_HEIGHT_MAX 5
+#define TEST_SRC_STRIDE (TEST_WIDTH_MAX * 4 + 12)
+#define TEST_PLANE_STRIDE (TEST_WIDTH_MAX + 16)
+#define TEST_PLANE_SIZE (TEST_PLANE_STRIDE * TEST_HEIGHT_MAX)
+
+static const uint32_t test_widths[] = { 1, 2, 15, 16, 17, 31, 32, 33, 47, 64, 99, 100 };
+static const uint32_t test_heights[] = { 1, 2, 3, 5 };
+static const enum wl_shm_format test_formats[] = {
+	WL_SHM_FORMAT_XRGB8888,
+	WL_SHM_FORMAT_XBGR8888,
+	WL_SHM_FORMAT_RGBX8888,
+	WL_SHM_FORMAT_BGRX8888,
+};
+static const struct yuv_coeffs *test_coeffs[] = {
+	&bt601_limited, &bt601_full, &bt709_limited, &bt709_full,
+};
+
+static uint8_t src[TEST_SRC_STRIDE * TEST_HEIGHT_MAX];
+
+struct planes {
+	uint8_t y[TEST_PLANE_SIZE];
+	uint8_t u[TEST_PLANE_SIZE];
+	uint8_t v[TEST_PLANE_SIZE];
+};
+
+static struct planes expected, result;
+
+static void run_kernel(convert_rows_func_t convert_rows, struct convert_job job,
+		struct planes *planes) {
+	memset(planes, 0xa5, sizeof(*planes));
+	job.y = planes->y;
+	job.u = planes->u;
+	job.v = job.interleaved ? NULL : planes->v;
+	convert_rows(&job, 0, (job.height + 1) / 2);
+}
+
+static bool check_job(const struct convert_kernel *kernel, struct convert_job job,
+		enum wl_shm_format format, bool flip) {
+	rgb_offsets(format, &job.r, &job.g, &job.b);
+	if (flip) {
+		job.src = src + (job.height - 1) * TEST_SRC_STRIDE;
+		job.src_stride = -TEST_SRC_STRIDE;
+	}
+
+	run_kernel(convert_rows_scalar, job, &expected);
+	run_kernel(kernel->convert_rows, job, &result);
+	if (memcmp(&expected, &result, sizeof(result)) != 0) {
+		fprintf(stderr, "%s: format %#x %ux%u %s flip %d differs\n",
+			kernel->name, format, job.width, job.height,
+			job.interleaved ? "nv12" : "i420", flip);
+		return false;
+	}
+	return true;
+}
+
+static bool check_kernel(const struct convert_kernel *kernel) {
+	bool ok = true;
+	for (size_t w = 0; w < sizeof(test_widths) / sizeof(test_widths[0]); w++) {
+		for (size_t h = 0; h < sizeof(test_heights) / sizeof(test_heights[0]); h++) {
+			for (size_t c = 0; c < sizeof(test_coeffs) / sizeof(test_coeffs[0]); c++) {
+				struct convert_job job = {
+					.src = src,
+					.src_stride = TEST_SRC_STRIDE,
+					.width = test_widths[w],
+					.height = test_heights[h],
+					.c = test_coeffs[c],
+					.y_stride = TEST_PLANE_STRIDE,
+					.uv_stride = TEST_PLANE_STRIDE,
+				};
+				for (size_t f = 0; f < sizeof(test_formats) / sizeof(test_formats[0]); f++) {
+					for (int i = 0; i < 4; i++) {
+						job.interleaved = i & 1;
+						ok &= check_job(kernel, job, test_formats[f], i & 2);
+					}
+				}
+			}
+		}
+	}
+	return ok;
+}
+
+int main(void) {
+	init_logger(stderr, ERROR);
+
+	// the first rows hold the extremes that hit the clamping, the rest is noise
+	uint32_t seed = 1;
+	for (size_t i = 0; i < sizeof(src); i++) {
+		seed = seed * 1103515245 + 12345;
+		src[i] = seed >> 16;
+	}
+	for (size_t x = 0; x < TEST_WIDTH_MAX * 4; x++) {
+		src[x] = x & 4 ? 0xff : 0;
+		src[TEST_SRC_STRIDE + x] = x % 12 < 4 ? 0xff : 0;
+	}
+
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(convert_kernels) / sizeof(convert_kernels[0]); i++) {
+		const struct convert_kernel *kernel = &convert_kernels[i];
+		if (!kernel->supported()) {
+			printf("%s: not supported by this cpu, skipped\n", kernel->name);
+			continue;
+		}
+		bool kernel_ok = check_kernel(kernel);
+		printf("%s: %s\n", kernel->name, kernel_ok ? "ok" : "FAILED");
+		ok &= kernel_ok;
+	}
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
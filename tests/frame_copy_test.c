@@ -0,0 +1,109 @@
+// checks every copy kernel the cpu supports against the scalar reference
+
+#include "frame_copy.c"
+
+#include <stdio.h>
+
+#define TEST_ROWS 7
+#define TEST_STRIDE_MAX 1200
+#define TEST_GUARD 64
+
+static const size_t test_lengths[] = { 1, 3, 15, 17, 63, 64, 65, 127, 129, 1000, 1029 };
+// added to the length, odd values give unaligned row starts from the second row on
+static const size_t test_stride_pad[] = { 0, 1, 13, 64 };
+static const size_t test_offsets[] = { 0, 1, 17, 63 };
+
+static uint8_t src[TEST_STRIDE_MAX * TEST_ROWS + 2 * TEST_GUARD];
+static uint8_t expected[sizeof(src)];
+static uint8_t result[sizeof(src)];
+
+static bool check_copy(const struct copy_kernel *kernel, size_t length,
+		size_t stride, size_t off, bool flip, bool streaming) {
+	const uint8_t *s = src + TEST_GUARD + off;
+	ptrdiff_t s_stride = stride;
+	if (flip) {
+		s += (TEST_ROWS - 1) * stride;
+		s_stride = -(ptrdiff_t)stride;
+	}
+
+	// the guard bytes around the rows must stay untouched
+	memset(expected, 0xa5, sizeof(expected));
+	memset(result, 0xa5, sizeof(result));
+	copy_rows_scalar(expected + TEST_GUARD + off, stride, s, s_stride,
+		length, TEST_ROWS, streaming);
+	kernel->copy_rows(result + TEST_GUARD + off, stride, s, s_stride,
+		length, TEST_ROWS, streaming);
+	if (memcmp(expected, result, sizeof(result)) != 0) {
+		fprintf(stderr, "%s: length %zu stride %zu offset %zu flip %d streaming %d differs\n",
+			kernel->name, length, stride, off, flip, streaming);
+		return false;
+	}
+	return true;
+}
+
+static bool check_kernel(const struct copy_kernel *kernel) {
+	bool ok = true;
+	for (size_t l = 0; l < sizeof(test_lengths) / sizeof(test_lengths[0]); l++) {
+		for (size_t p = 0; p < sizeof(test_stride_pad) / sizeof(test_stride_pad[0]); p++) {
+			for (size_t o = 0; o < sizeof(test_offsets) / sizeof(test_offsets[0]); o++) {
+				size_t length = test_lengths[l];
+				size_t stride = length + test_stride_pad[p];
+				for (int flip = 0; flip < 2; flip++) {
+					for (int streaming = 0; streaming < 2; streaming++) {
+						ok &= check_copy(kernel, length, stride,
+							test_offsets[o], flip, streaming);
+					}
+				}
+			}
+		}
+	}
+	return ok;
+}
+
+// copies just below and just above the streaming threshold take different
+// store paths and must give the same result
+static bool check_streaming_threshold(void) {
+	size_t length = 1000;
+	size_t stride = length + 13;
+	bool ok = true;
+
+	for (int above = 0; above < 2; above++) {
+		streaming_threshold = length * TEST_ROWS - (above ? 1 : 0);
+		memset(expected, 0xa5, sizeof(expected));
+		memset(result, 0xa5, sizeof(result));
+		copy_rows_scalar(expected + TEST_GUARD + 1, stride, src + TEST_GUARD, stride,
+			length, TEST_ROWS, false);
+		xdpw_copy_rows(result + TEST_GUARD + 1, stride, src + TEST_GUARD, stride,
+			length, TEST_ROWS);
+		if (memcmp(expected, result, sizeof(result)) != 0) {
+			fprintf(stderr, "copy %s the streaming threshold differs\n",
+				above ? "above" : "at");
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+int main(void) {
+	init_logger(stderr, ERROR);
+	for (size_t i = 0; i < sizeof(src); i++) {
+		src[i] = (uint8_t)(i * 131 + 7);
+	}
+
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(copy_kernels) / sizeof(copy_kernels[0]); i++) {
+		const struct copy_kernel *kernel = &copy_kernels[i];
+		if (!kernel->supported()) {
+			printf("%s: not supported by this cpu, skipped\n", kernel->name);
+			continue;
+		}
+		bool kernel_ok = check_kernel(kernel);
+		printf("%s: %s\n", kernel->name, kernel_ok ? "ok" : "FAILED");
+		ok &= kernel_ok;
+	}
+
+	xdpw_frame_copy_init(1, 0);
+	ok &= check_streaming_threshold();
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
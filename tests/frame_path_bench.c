@@ -0,0 +1,161 @@
+// time the copy, scale and convert path takes for synthetic 7680x4320 frames,
+// against the interval of a 60 Hz output. The optional argument is the
+// copy_threads setting, 1 by default like in the config
+
+#include "frame_convert.h"
+#include "frame_copy.h"
+#include "frame_scale.h"
+#include "logger.h"
+#include "timespec_util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_WIDTH 7680
+#define BENCH_HEIGHT 4320
+#define BENCH_STRIDE (BENCH_WIDTH * 4)
+#define BENCH_FRAMES 10
+#define BENCH_INTERVAL_NS (TIMESPEC_NSEC_PER_SEC / 60)
+
+enum bench_path {
+	BENCH_COPY,
+	BENCH_COPY_FLIPPED,
+	BENCH_SCALE,
+	BENCH_CONVERT_NV12,
+	BENCH_CONVERT_I420,
+	BENCH_SCALE_CONVERT_NV12,
+};
+
+static const struct {
+	enum bench_path path;
+	const char *name;
+} bench_paths[] = {
+	{ BENCH_COPY, "copy" },
+	{ BENCH_COPY_FLIPPED, "copy, y inverted" },
+	{ BENCH_SCALE, "scale to 3840x2160" },
+	{ BENCH_CONVERT_NV12, "convert to NV12" },
+	{ BENCH_CONVERT_I420, "convert to I420" },
+	{ BENCH_SCALE_CONVERT_NV12, "scale to 3840x2160, NV12" },
+};
+
+static struct xdpw_frame frame = {
+	.width = BENCH_WIDTH,
+	.height = BENCH_HEIGHT,
+	.stride = BENCH_STRIDE,
+	.size = BENCH_STRIDE * BENCH_HEIGHT,
+	.format = WL_SHM_FORMAT_XRGB8888,
+};
+static struct xdpw_frame scaled = {
+	.width = BENCH_WIDTH / 2,
+	.height = BENCH_HEIGHT / 2,
+	.stride = BENCH_STRIDE / 2,
+	.size = BENCH_STRIDE / 2 * BENCH_HEIGHT / 2,
+	.format = WL_SHM_FORMAT_XRGB8888,
+};
+static uint8_t *dst;
+static struct xdpw_scaler *scaler;
+
+static void convert(struct xdpw_frame *src, enum spa_video_format format) {
+	struct xdpw_yuv_layout layout;
+	xdpw_convert_layout(format, src->width, src->height, &layout);
+	uint8_t *planes[XDPW_YUV_MAX_PLANES] = { 0 };
+	uint8_t *plane = dst;
+	for (uint32_t i = 0; i < layout.n_planes; i++) {
+		planes[i] = plane;
+		plane += layout.sizes[i];
+	}
+	xdpw_convert_frame(src, format, SPA_VIDEO_COLOR_MATRIX_BT709,
+		SPA_VIDEO_COLOR_RANGE_16_235, &layout, planes, NULL);
+}
+
+// full frames, as sent to a new buffer or after a buffer change
+static void run_path(enum bench_path path) {
+	switch (path) {
+	case BENCH_COPY:
+		xdpw_copy_rows(dst, BENCH_STRIDE, frame.data, BENCH_STRIDE,
+			BENCH_STRIDE, BENCH_HEIGHT);
+		break;
+	case BENCH_COPY_FLIPPED:
+		xdpw_copy_rows(dst, BENCH_STRIDE,
+			(uint8_t *)frame.data + (size_t)(BENCH_HEIGHT - 1) * BENCH_STRIDE,
+			-(ptrdiff_t)BENCH_STRIDE, BENCH_STRIDE, BENCH_HEIGHT);
+		break;
+	case BENCH_SCALE:
+		xdpw_scaler_scale(scaler, &frame, dst, scaled.stride, NULL);
+		break;
+	case BENCH_CONVERT_NV12:
+		convert(&frame, SPA_VIDEO_FORMAT_NV12);
+		break;
+	case BENCH_CONVERT_I420:
+		convert(&frame, SPA_VIDEO_FORMAT_I420);
+		break;
+	case BENCH_SCALE_CONVERT_NV12:
+		xdpw_scaler_scale(scaler, &frame, scaled.data, scaled.stride, NULL);
+		convert(&scaled, SPA_VIDEO_FORMAT_NV12);
+		break;
+	}
+}
+
+static bool bench(enum bench_path path, const char *name) {
+	// the first run faults the destination pages in
+	run_path(path);
+
+	uint64_t total_ns = 0, max_ns = 0;
+	for (int i = 0; i < BENCH_FRAMES; i++) {
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		run_path(path);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		uint64_t ns = timespec_diff_ns(&end, &start);
+		total_ns += ns;
+		if (ns > max_ns) {
+			max_ns = ns;
+		}
+	}
+
+	bool keeps_up = max_ns <= BENCH_INTERVAL_NS;
+	printf("%-26s average %6.2f ms, max %6.2f ms, %s\n", name,
+		total_ns / BENCH_FRAMES / 1000000.0, max_ns / 1000000.0,
+		keeps_up ? "keeps up with 60 Hz" : "too slow for 60 Hz");
+	return keeps_up;
+}
+
+int main(int argc, char *argv[]) {
+	init_logger(stderr, ERROR);
+	int threads = argc > 1 ? atoi(argv[1]) : 1;
+	xdpw_frame_copy_init(threads, XDPW_COPY_THRESHOLD_KB_DEFAULT * 1024);
+	xdpw_frame_convert_init();
+
+	frame.data = malloc(frame.size);
+	scaled.data = malloc(scaled.size);
+	dst = malloc(frame.size);
+	scaler = xdpw_scaler_create(BENCH_WIDTH, BENCH_HEIGHT, scaled.width, scaled.height);
+	if (frame.data == NULL || scaled.data == NULL || dst == NULL || scaler == NULL) {
+		fprintf(stderr, "failed to allocate the frames\n");
+		return EXIT_FAILURE;
+	}
+	uint32_t seed = 1;
+	uint32_t *pixels = frame.data;
+	for (size_t i = 0; i < frame.size / 4; i++) {
+		seed = seed * 1103515245 + 12345;
+		pixels[i] = seed;
+	}
+
+	printf("%ux%u XRGB8888 frames, %d copy threads, %.2f ms frame interval\n",
+		BENCH_WIDTH, BENCH_HEIGHT, threads, BENCH_INTERVAL_NS / 1000000.0);
+	int slow = 0;
+	for (size_t i = 0; i < sizeof(bench_paths) / sizeof(bench_paths[0]); i++) {
+		slow += !bench(bench_paths[i].path, bench_paths[i].name);
+	}
+	if (slow > 0) {
+		printf("%d of %zu paths can't sustain 60 Hz, try more copy threads\n",
+			slow, sizeof(bench_paths) / sizeof(bench_paths[0]));
+	}
+
+	xdpw_scaler_destroy(scaler);
+	free(dst);
+	free(scaled.data);
+	free(frame.data);
+	return EXIT_SUCCESS;
+}
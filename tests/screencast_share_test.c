@@ -0,0 +1,276 @@
+// sessions of the same output share one capture loop, this checks that a
+// sink never depends on a source whose session closed before it started
+
+#include "screencast.c"
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+		return false; \
+	} \
+} while (0)
+
+#define TEST_WIDTH 1920
+#define TEST_HEIGHT 1080
+
+static uint32_t node_ids;
+
+// the wayland and pipewire sides are replaced, an instance's captures are
+// idle unless the test says otherwise
+
+void xdpw_wlr_capture_init(struct xdpw_screencast_instance *cast, uint32_t n_captures) {
+}
+
+// like the real one with an idle capture ring, requests are counted in
+// capture_seq
+void xdpw_wlr_register_cb(struct xdpw_screencast_instance *cast) {
+	if (cast->quit || cast->err) {
+		xdpw_screencast_instance_destroy(cast);
+		return;
+	}
+	cast->capture_seq++;
+}
+
+void xdpw_pwr_stream_init(struct xdpw_screencast_instance *cast) {
+	// a stream can't be negotiated without the frame size
+	if (cast->simple_frame.width == 0 || cast->simple_frame.height == 0) {
+		fprintf(stderr, "stream of %p set up with a %ux%u frame\n", (void *)cast,
+			cast->simple_frame.width, cast->simple_frame.height);
+		abort();
+	}
+	cast->node_id = ++node_ids;
+}
+
+void xdpw_pwr_stream_destroy(struct xdpw_screencast_instance *cast) {
+}
+
+struct xdpw_timer *xdpw_add_timer(struct xdpw_state *state,
+		uint64_t delay_ns, xdpw_event_loop_timer_func_t func, void *data) {
+	return NULL;
+}
+
+void xdpw_destroy_timer(struct xdpw_timer *timer) {
+}
+
+struct xdpw_request *xdpw_request_create(sd_bus *bus, const char *object_path) {
+	return NULL;
+}
+
+struct xdpw_output_chooser_run *xdpw_wlr_output_chooser_start(
+		struct xdpw_screencast_context *ctx, size_t max_outputs,
+		xdpw_output_chooser_done_func_t done, void *data) {
+	return NULL;
+}
+
+void xdpw_wlr_output_chooser_cancel(struct xdpw_output_chooser_run *run) {
+}
+
+void xdpw_frame_copy_init(int threads, size_t threshold) {
+}
+
+void xdpw_frame_convert_init(void) {
+}
+
+int xdpw_pwr_core_connect(struct xdpw_state *state) {
+	return 0;
+}
+
+int xdpw_wlr_screencopy_init(struct xdpw_state *state) {
+	return 0;
+}
+
+void xdpw_wlr_screencopy_finish(struct xdpw_screencast_context *ctx) {
+}
+
+static struct xdpw_config config;
+static struct xdpw_wlr_output output = {
+	.id = 1,
+	.name = "TEST-1",
+	.framerate = 60,
+};
+
+static void test_init(struct xdpw_state *state) {
+	*state = (struct xdpw_state) {
+		.pw_thread_loop = pw_thread_loop_new("xdpw-test", NULL),
+		.config = &config,
+	};
+	wl_list_init(&state->xdpw_sessions);
+	state->screencast.state = state;
+	state->screencast.pwr_core_done = true;
+	state->screencast.init_stage = XDPW_WLR_INIT_DONE;
+	wl_list_init(&state->screencast.output_list);
+	wl_list_init(&state->screencast.screencast_instances);
+}
+
+static void test_finish(struct xdpw_state *state) {
+	struct xdpw_session *sess, *tmp;
+	wl_list_for_each_safe(sess, tmp, &state->xdpw_sessions, link) {
+		xdpw_session_destroy(sess);
+	}
+	// running captures go on their next frame
+	struct xdpw_screencast_instance *cast, *cast_tmp;
+	wl_list_for_each_safe(cast, cast_tmp, &state->screencast.screencast_instances, link) {
+		xdpw_wlr_register_cb(cast);
+	}
+	pw_thread_loop_destroy(state->pw_thread_loop);
+}
+
+static struct xdpw_session *test_select_output(struct xdpw_state *state,
+		struct xdpw_wlr_output *out, struct xdpw_output_region region) {
+	struct xdpw_session *sess = calloc(1, sizeof(*sess));
+	sess->state = state;
+	sess->session_handle = strdup("/org/freedesktop/portal/desktop/session/test");
+	wl_list_insert(&state->xdpw_sessions, &sess->link);
+
+	struct xdpw_wlr_output *outs[] = { out };
+	struct xdpw_output_region regions[] = { region };
+	setup_outputs(&state->screencast, sess, true, outs, regions, 1);
+	return sess;
+}
+
+static struct xdpw_session *test_select(struct xdpw_state *state) {
+	return test_select_output(state, &output, (struct xdpw_output_region) { 0 });
+}
+
+// the compositor announces the buffer parameters of the first capture
+static void test_buffer(struct xdpw_screencast_instance *cast) {
+	struct xdpw_frame *frame = &cast->simple_frame;
+	frame->width = TEST_WIDTH;
+	frame->height = TEST_HEIGHT;
+	frame->stride = TEST_WIDTH * 4;
+	frame->size = frame->stride * TEST_HEIGHT;
+	frame->format = WL_SHM_FORMAT_XRGB8888;
+}
+
+static int test_start(struct xdpw_session *sess) {
+	start_captures(sess->screencast_instances, sess->n_screencast_instances);
+	return start_streams(&sess->state->screencast, sess);
+}
+
+// the reported case, the source never started and the sink's Start would
+// have brought up the capture loop of an instance freed on the way
+static bool test_source_closed_before_sink_started(void) {
+	struct xdpw_state state;
+	test_init(&state);
+
+	struct xdpw_session *a = test_select(&state);
+	struct xdpw_session *b = test_select(&state);
+	struct xdpw_screencast_instance *cast = b->screencast_instances[0];
+	// a source that doesn't capture yet isn't shared
+	CHECK(cast->capture_source == NULL);
+
+	xdpw_session_destroy(a);
+	CHECK(wl_list_length(&state.screencast.screencast_instances) == 1);
+
+	CHECK(test_start(b) == 0);
+	CHECK(cast->capture_seq == 1);
+	test_buffer(cast);
+	CHECK(test_start(b) == 1);
+	CHECK(cast->initialized);
+
+	test_finish(&state);
+	return true;
+}
+
+static bool test_sink_promoted_before_start(void) {
+	struct xdpw_state state;
+	test_init(&state);
+
+	struct xdpw_session *a = test_select(&state);
+	struct xdpw_screencast_instance *source = a->screencast_instances[0];
+	CHECK(test_start(a) == 0);
+	test_buffer(source);
+	CHECK(test_start(a) == 1);
+
+	struct xdpw_session *b = test_select(&state);
+	struct xdpw_screencast_instance *sink = b->screencast_instances[0];
+	CHECK(sink->capture_source == source);
+	CHECK(sink->simple_frame.width == TEST_WIDTH);
+
+	// the capture loop of the source tears it down on its next frame
+	xdpw_session_destroy(a);
+	CHECK(wl_list_length(&state.screencast.screencast_instances) == 2);
+	xdpw_wlr_register_cb(source);
+	CHECK(wl_list_length(&state.screencast.screencast_instances) == 1);
+
+	CHECK(sink->capture_source == NULL);
+	CHECK(sink->capture_seq == 1);
+	CHECK(test_start(b) == 1);
+	CHECK(sink->initialized);
+	CHECK(sink->simple_frame.width == TEST_WIDTH);
+
+	test_finish(&state);
+	return true;
+}
+
+static bool test_started_sink_promoted(void) {
+	struct xdpw_state state;
+	test_init(&state);
+
+	struct xdpw_session *a = test_select(&state);
+	struct xdpw_screencast_instance *source = a->screencast_instances[0];
+	test_start(a);
+	test_buffer(source);
+	CHECK(test_start(a) == 1);
+
+	struct xdpw_session *b = test_select(&state);
+	struct xdpw_screencast_instance *sink = b->screencast_instances[0];
+	CHECK(test_start(b) == 1);
+	// fed by the source, its own ring stays idle
+	CHECK(sink->capture_seq == 0);
+	uint32_t node_id = sink->node_id;
+
+	xdpw_session_destroy(a);
+	xdpw_wlr_register_cb(source);
+	CHECK(sink->capture_source == NULL);
+	CHECK(sink->capture_seq == 1);
+	CHECK(sink->node_id == node_id);
+
+	test_finish(&state);
+	return true;
+}
+
+// Start reports the streams in logical coordinates, which on an output with
+// scale 2 are half the size of the frames
+static bool test_scaled_output_rect(void) {
+	struct xdpw_state state;
+	test_init(&state);
+
+	struct xdpw_wlr_output scaled = {
+		.id = 2,
+		.name = "TEST-2",
+		.x = TEST_WIDTH,
+		.width = TEST_WIDTH / 2,
+		.height = TEST_HEIGHT / 2,
+		.framerate = 60,
+	};
+	struct xdpw_session *a = test_select_output(&state, &scaled,
+		(struct xdpw_output_region) { 0 });
+	struct xdpw_session *b = test_select_output(&state, &scaled,
+		(struct xdpw_output_region) { .x = 100, .y = 50, .width = 640, .height = 360 });
+	test_buffer(a->screencast_instances[0]);
+	test_buffer(b->screencast_instances[0]);
+
+	struct xdpw_output_region rect;
+	stream_logical_rect(a->screencast_instances[0], &rect);
+	CHECK(rect.x == TEST_WIDTH && rect.y == 0);
+	CHECK(rect.width == TEST_WIDTH / 2 && rect.height == TEST_HEIGHT / 2);
+	stream_logical_rect(b->screencast_instances[0], &rect);
+	CHECK(rect.x == TEST_WIDTH + 100 && rect.y == 50);
+	CHECK(rect.width == 640 && rect.height == 360);
+
+	test_finish(&state);
+	return true;
+}
+
+int main(void) {
+	init_logger(stderr, ERROR);
+	pw_init(NULL, NULL);
+
+	bool ok = true;
+	ok &= test_source_closed_before_sink_started();
+	ok &= test_sink_promoted_before_start();
+	ok &= test_started_sink_promoted();
+	ok &= test_scaled_output_rect();
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
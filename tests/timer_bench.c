@@ -0,0 +1,71 @@
+// cost of the timer queue operations against the number of pending timers,
+// they should grow with log(n)
+
+#include "xdpw.h"
+#include "logger.h"
+#include "timespec_util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_DELAY_NS 1000000000ull
+
+static const size_t bench_sizes[] = { 1000, 10000, 100000 };
+
+static void nop(void *data) {
+}
+
+static double elapsed_ns(struct timespec *start, size_t ops) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (double)timespec_diff_ns(&end, start) / ops;
+}
+
+static void bench(size_t n) {
+	struct xdpw_state state = { .timer_poll_fd = -1 };
+	wl_list_init(&state.timers_free);
+	struct xdpw_timer **timers = calloc(n, sizeof(*timers));
+	uint32_t seed = 1;
+
+	// the pool and the heap grow on the first round only
+	struct timespec start;
+	double add_ns = 0, destroy_ns = 0;
+	for (int round = 0; round < 2; round++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (size_t i = 0; i < n; i++) {
+			seed = seed * 1103515245 + 12345;
+			timers[i] = xdpw_add_timer(&state, BENCH_DELAY_NS + seed % n * 1000,
+				nop, NULL);
+		}
+		add_ns = elapsed_ns(&start, n);
+
+		// the middle of the heap, not just the top
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (size_t i = 0; i < n; i++) {
+			xdpw_destroy_timer(timers[(i * 7919) % n]);
+		}
+		destroy_ns = elapsed_ns(&start, n);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		xdpw_add_timer(&state, 0, nop, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (state.n_timers > 0) {
+		xdpw_run_timers(&state);
+	}
+	double run_ns = elapsed_ns(&start, n);
+
+	printf("%7zu timers: add %6.1f ns, destroy %6.1f ns, run %6.1f ns\n",
+		n, add_ns, destroy_ns, run_ns);
+	free(timers);
+	free(state.timer_heap);
+}
+
+int main(void) {
+	init_logger(stderr, ERROR);
+	for (size_t i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+		bench(bench_sizes[i]);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,110 @@
+// checks the order timers run in and what a single wakeup runs
+
+#include "xdpw.h"
+#include "logger.h"
+#include "timespec_util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+		return false; \
+	} \
+} while (0)
+
+#define TEST_TIMERS 50
+#define TEST_DELAY_NS 1000000
+
+static struct xdpw_state state;
+static struct timespec deadlines[TEST_TIMERS];
+static int ran[TEST_TIMERS * 4];
+static size_t n_ran;
+
+// the pool keeps its nodes for good, only the heap is released
+static void test_init(void) {
+	free(state.timer_heap);
+	state = (struct xdpw_state) { .timer_poll_fd = -1 };
+	wl_list_init(&state.timers_free);
+	n_ran = 0;
+}
+
+static void record(void *data) {
+	ran[n_ran++] = (int)(intptr_t)data;
+}
+
+static void run_all(void) {
+	while (state.n_timers > 0) {
+		xdpw_run_timers(&state);
+	}
+}
+
+static bool test_deadline_order(void) {
+	test_init();
+	struct xdpw_timer *timers[TEST_TIMERS];
+	for (int i = 0; i < TEST_TIMERS; i++) {
+		// interleaved so the heap has to reorder them
+		int n = (i * 7) % TEST_TIMERS;
+		timers[n] = xdpw_add_timer(&state, n, record, (void *)(intptr_t)n);
+		CHECK(timers[n] != NULL);
+		deadlines[n] = timers[n]->at;
+	}
+	for (int i = 0; i < TEST_TIMERS; i += 3) {
+		xdpw_destroy_timer(timers[i]);
+	}
+	run_all();
+
+	for (size_t i = 0; i < n_ran; i++) {
+		CHECK(ran[i] % 3 != 0);
+		CHECK(i == 0 || !timespec_less(&deadlines[ran[i]], &deadlines[ran[i - 1]]));
+	}
+	CHECK(n_ran == TEST_TIMERS - (TEST_TIMERS + 2) / 3);
+	return true;
+}
+
+static void chain(void *data) {
+	int left = (int)(intptr_t)data;
+	record(data);
+	if (left > 0) {
+		xdpw_add_timer(&state, 0, chain, (void *)(intptr_t)(left - 1));
+	}
+}
+
+// a timer added with no delay by a callback runs in the same wakeup
+static bool test_zero_delay_chain(void) {
+	test_init();
+	xdpw_add_timer(&state, 0, chain, (void *)(intptr_t)3);
+	xdpw_add_timer(&state, TEST_DELAY_NS * 1000, record, (void *)(intptr_t)-1);
+	xdpw_run_timers(&state);
+	CHECK(n_ran == 4);
+	CHECK(state.n_timers == 1);
+	xdpw_destroy_timer(state.timer_heap[0]);
+	return true;
+}
+
+static void rearm(void *data) {
+	record(data);
+	xdpw_add_timer(&state, 0, rearm, data);
+}
+
+// one that keeps adding itself doesn't hold up the event loop
+static bool test_run_budget(void) {
+	test_init();
+	xdpw_add_timer(&state, 0, rearm, NULL);
+	xdpw_run_timers(&state);
+	CHECK(n_ran > 1 && n_ran < sizeof(ran) / sizeof(ran[0]));
+	CHECK(state.n_timers == 1);
+	xdpw_destroy_timer(state.timer_heap[0]);
+	return true;
+}
+
+int main(void) {
+	init_logger(stderr, ERROR);
+
+	bool ok = true;
+	ok &= test_deadline_order();
+	ok &= test_zero_delay_chain();
+	ok &= test_run_budget();
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}